@@ -96,8 +96,7 @@ serve_style_css(struct http_request *req)
 int
 serve_index(struct http_request *req)
 {
-	http_response_header(req, "content-type", "text/html");
-	http_response(req, 200, asset_index_html, asset_len_index_html);
+	http_response_asset(req, &asset_info_index_html);
 
 	return (KORE_RESULT_OK);
 }
@@ -25,12 +25,21 @@ extern "C" {
 #define HTTP_HSTS_ENABLE	31536000
 #define HTTP_HEADER_MAX_LEN	4096
 #define HTTP_BODY_MAX_LEN	10240000
+#define HTTP_BODY_CHUNK		65536
+#define HTTP_BODY_DISK_PATH	"tmp_files"
 #define HTTP_URI_LEN		2000
 #define HTTP_USERAGENT_LEN	256
 #define HTTP_REQ_HEADER_MAX	25
 #define HTTP_MAX_QUERY_ARGS	20
 #define HTTP_MAX_COOKIES	10
 #define HTTP_REQUEST_LIMIT	1000
+#define HTTP_COMPRESS_MIN_LEN	1024
+#define HTTP_COMPRESS_LEVEL	6
+#define HTTP_CACHE_MAX		(16 * 1024 * 1024)
+
+#define HTTP_COMPRESS_GZIP	0
+#define HTTP_COMPRESS_DEFLATE	1
+#define HTTP_COMPRESS_MAX	2
 
 #define HTTP_ARG_TYPE_RAW	0
 #define HTTP_ARG_TYPE_BYTE	1
@@ -54,15 +63,26 @@ struct http_header {
 	TAILQ_ENTRY(http_header)	list;
 };
 
+/*
+ * A request header as a slice of the request's header buffer, values
+ * are not copied out of it.
+ */
+struct http_header_ref {
+	u_int16_t		name;
+	u_int16_t		name_len;
+	u_int16_t		value;
+	u_int16_t		value_len;
+};
+
+/*
+ * A slot in the argument table of a request. The name belongs to the
+ * handler its parameter spec, the value is always NUL terminated.
+ */
 struct http_arg {
-	char			*name;
+	const char		*name;
 	void			*value;
 	u_int32_t		len;
-
-	char			*s_value;
-	u_int32_t		s_len;
-
-	TAILQ_ENTRY(http_arg)	list;
+	u_int32_t		hash;
 };
 
 #define COPY_ARG_TYPE(v, l, t)				\
@@ -76,7 +96,7 @@ struct http_arg {
 	do {								\
 		int err;						\
 		type nval;						\
-		nval = (type)kore_strtonum64(q->s_value, sign, &err);	\
+		nval = (type)kore_strtonum64(q->value, sign, &err);	\
 		if (err != KORE_RESULT_OK)				\
 			return (KORE_RESULT_ERROR);			\
 		COPY_ARG_TYPE(nval, len, type);				\
@@ -86,26 +106,16 @@ struct http_arg {
 	do {								\
 		int err;						\
 		int64_t nval;						\
-		nval = kore_strtonum(q->s_value, 10, min, max, &err);	\
+		nval = kore_strtonum(q->value, 10, min, max, &err);	\
 		if (err != KORE_RESULT_OK)				\
 			return (KORE_RESULT_ERROR);			\
 		COPY_ARG_TYPE(nval, len, type);				\
 	} while (0);
 
-#define CACHE_STRING()							\
-	do {								\
-		if (q->s_value == NULL) {				\
-			q->s_len = q->len + 1;				\
-			q->s_value = kore_malloc(q->s_len);		\
-			kore_strlcpy(q->s_value, q->value, q->s_len);	\
-		}							\
-	} while (0);
-
 #define COPY_AS_INTTYPE_64(type, sign)					\
 	do {								\
 		if (nout == NULL)					\
 			return (KORE_RESULT_ERROR);			\
-		CACHE_STRING();						\
 		COPY_ARG_INT64(type, sign);				\
 	} while (0);
 
@@ -113,7 +123,6 @@ struct http_arg {
 	do {								\
 		if (nout == NULL)					\
 			return (KORE_RESULT_ERROR);			\
-		CACHE_STRING();						\
 		COPY_ARG_INT(min, max, type);				\
 	} while (0);
 
@@ -155,6 +164,45 @@ struct http_file {
 	TAILQ_ENTRY(http_file)	list;
 };
 
+#define HTTP_MULTIPART_BUF		8192
+#define HTTP_MULTIPART_BOUNDARY_MAX	70
+#define HTTP_MULTIPART_NAME_MAX		128
+#define HTTP_MULTIPART_FILENAME_MAX	256
+
+#define HTTP_MULTIPART_STATE_PREAMBLE	0
+#define HTTP_MULTIPART_STATE_DELIM	1
+#define HTTP_MULTIPART_STATE_HEADERS	2
+#define HTTP_MULTIPART_STATE_DATA	3
+#define HTTP_MULTIPART_STATE_END	4
+
+/*
+ * Incremental multipart/form-data parser. Set the callbacks after
+ * http_multipart_init() and hand it body data with http_multipart_feed()
+ * as it comes in. The begin callback can set fd to have the part data
+ * written there instead of going to the data callback, the caller
+ * closes it again in the end callback.
+ */
+struct http_multipart {
+	struct http_request	*req;
+	void			*arg;
+
+	int			fd;
+	int			file;
+	char			name[HTTP_MULTIPART_NAME_MAX];
+	char			filename[HTTP_MULTIPART_FILENAME_MAX];
+
+	int			(*begin)(struct http_multipart *);
+	int			(*data)(struct http_multipart *,
+				    const u_int8_t *, size_t);
+	int			(*end)(struct http_multipart *);
+
+	u_int8_t		state;
+	size_t			dlen;
+	u_int8_t		delim[HTTP_MULTIPART_BOUNDARY_MAX + 4];
+	size_t			len;
+	u_int8_t		buf[HTTP_MULTIPART_BUF];
+};
+
 #define HTTP_METHOD_GET		0
 #define HTTP_METHOD_POST	1
 #define HTTP_METHOD_PUT		2
@@ -164,16 +212,31 @@ struct http_file {
 #define HTTP_REQUEST_COMPLETE		0x01
 #define HTTP_REQUEST_DELETE		0x02
 #define HTTP_REQUEST_SLEEPING		0x04
+#define HTTP_REQUEST_BODY_STREAM	0x08
 #define HTTP_REQUEST_PGSQL_QUEUE	0x10
 #define HTTP_REQUEST_EXPECT_BODY	0x20
 #define HTTP_REQUEST_RETAIN_EXTRA	0x40
 #define HTTP_REQUEST_NO_CONTENT_LENGTH	0x80
+#define HTTP_REQUEST_CHUNKED		0x0100
+#define HTTP_REQUEST_CACHE_STORE	0x0200
+#define HTTP_REQUEST_CACHE_HIT		0x0400
+
+#define HTTP_CHUNK_SIZE			1
+#define HTTP_CHUNK_HEX			2
+#define HTTP_CHUNK_EXT			3
+#define HTTP_CHUNK_LF			4
+#define HTTP_CHUNK_DATA			5
+#define HTTP_CHUNK_DATA_CR		6
+#define HTTP_CHUNK_DATA_LF		7
+#define HTTP_CHUNK_TRAILER		8
+#define HTTP_CHUNK_DONE			9
 
 struct kore_task;
+struct http_arena;
 
 struct http_request {
 	u_int8_t			method;
-	u_int8_t			flags;
+	u_int16_t			flags;
 	u_int8_t			fsm_state;
 	u_int16_t			status;
 	u_int64_t			start;
@@ -185,22 +248,59 @@ struct http_request {
 	struct connection		*owner;
 	struct spdy_stream		*stream;
 	struct kore_buf			*http_body;
+	int				http_body_fd;
+	u_int64_t			http_body_length;
+	u_int64_t			http_body_offset;
+	u_int64_t			http_body_received;
+	u_int8_t			http_chunk_state;
+	u_int64_t			http_chunk_left;
 	void				*hdlr_extra;
 	char				*query_string;
-	u_int8_t			*multipart_body;
 	struct kore_module_handle	*hdlr;
+	struct kore_module_handle	*route;
 
 	LIST_HEAD(, kore_task)		tasks;
 	LIST_HEAD(, kore_pgsql)		pgsqls;
 
-	TAILQ_HEAD(, http_header)	req_headers;
+	u_int8_t			*hbuf;
+	struct kore_pool		*hbuf_pool;
+	u_int8_t			hdr_count;
+	struct http_header_ref		hdrs[HTTP_REQ_HEADER_MAX];
+
 	TAILQ_HEAD(, http_header)	resp_headers;
-	TAILQ_HEAD(, http_arg)		arguments;
+	struct http_arg			*args;
+	u_int32_t			args_mask;
 	TAILQ_HEAD(, http_file)		files;
+	struct http_arena		*arena;
 	TAILQ_ENTRY(http_request)	list;
 	TAILQ_ENTRY(http_request)	olist;
 };
 
+/* An asset compiled in by kore build, see asset_info_<name>_<ext>. */
+struct http_asset {
+	const char		*type;
+	u_int8_t		*data;
+	u_int32_t		len;
+	u_int8_t		*gz_data;
+	u_int32_t		gz_len;
+	const char		*etag;
+	const char		*gz_etag;
+	time_t			mtime;
+};
+
+struct http_cache_stats {
+	u_int64_t		hits;
+	u_int64_t		misses;
+	u_int64_t		entries;
+	u_int64_t		evictions;
+};
+
+struct http_filemap_stats {
+	u_int64_t		hits;
+	u_int64_t		opens;
+	u_int64_t		stale;
+};
+
 struct http_state {
 	const char		*name;
 	int			(*cb)(struct http_request *);
@@ -209,11 +309,38 @@ struct http_state {
 extern int		http_request_count;
 extern u_int16_t	http_header_max;
 extern u_int64_t	http_body_max;
+extern u_int64_t	http_body_disk_offload;
+extern char		*http_body_disk_path;
 extern u_int64_t	http_hsts_enable;
 extern u_int16_t	http_keepalive_time;
 extern u_int32_t	http_request_limit;
+extern u_int32_t	http_compress_min;
+extern int		http_compress_level;
+extern u_int64_t	http_cache_max;
+extern u_int64_t	http_cache_shared;
+extern struct http_cache_stats	http_cache_stats;
+extern struct http_filemap_stats	http_filemap_stats;
 
 void		http_init(void);
+void		http_compress_type_add(const char *);
+int		http_etag_match(struct http_request *, const char *);
+int		http_not_modified(struct http_request *, const char *, time_t);
+
+void		http_cache_init(void);
+void		http_cache_flush(void);
+int		http_cache_lookup(struct http_request *);
+void		http_cache_store(struct http_request *, int, void *,
+		    u_int32_t);
+void		http_cache_shm_init(void);
+void		http_cache_shm_flush(void);
+void		http_cache_shm_reap(pid_t);
+void		http_cache_shm_cleanup(void);
+
+void		http_filemap_init(void);
+void		http_filemap_flush(void);
+int		http_filemap_serve(struct http_request *);
+const char	*http_media_type(const char *);
+
 void		http_process(void);
 const char	*http_status_text(int);
 time_t		http_date_to_time(char *);
@@ -223,11 +350,25 @@ void		http_request_wakeup(struct http_request *);
 char		*http_body_text(struct http_request *);
 void		http_process_request(struct http_request *, int);
 u_int8_t	*http_body_bytes(struct http_request *, u_int32_t *);
+ssize_t		http_body_read(struct http_request *, void *, size_t);
 void		http_response(struct http_request *, int, void *, u_int32_t);
 void		http_response_stream(struct http_request *, int, void *,
 		    u_int64_t, int (*cb)(struct netbuf *), void *);
+void		http_response_fd(struct http_request *, int, int, off_t,
+		    u_int64_t);
+int		http_response_fd_shared(struct http_request *, int, int,
+		    off_t, u_int64_t, int (*cb)(struct netbuf *), void *);
+void		http_response_chunked_begin(struct http_request *, int);
+void		http_response_chunked_append(struct http_request *,
+		    const void *, size_t);
+void		http_response_chunked_end(struct http_request *);
+void		http_response_asset(struct http_request *,
+		    const struct http_asset *);
 int		http_request_header(struct http_request *,
 		    const char *, char **);
+int		http_request_header_ref(struct http_request *,
+		    const char *, const char **, u_int32_t *);
+void		*http_request_alloc(struct http_request *, size_t);
 void		http_response_header(struct http_request *,
 		    const char *, const char *);
 int		http_request_new(struct connection *, struct spdy_stream *,
@@ -241,6 +382,11 @@ int		http_header_recv(struct netbuf *);
 int		http_generic_404(struct http_request *);
 int		http_populate_arguments(struct http_request *);
 int		http_populate_multipart_form(struct http_request *, int *);
+int		http_multipart_init(struct http_multipart *,
+		    struct http_request *);
+int		http_multipart_feed(struct http_multipart *,
+		    const void *, size_t);
+int		http_multipart_done(struct http_multipart *);
 int		http_argument_get(struct http_request *,
 		    const char *, void **, void *, u_int32_t *, int);
 int		http_file_lookup(struct http_request *, const char *, char **,
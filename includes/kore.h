@@ -78,11 +78,21 @@ extern int daemon(int, int);
 
 #define NETBUF_RECV			0
 #define NETBUF_SEND			1
+#define NETBUF_SEND_FD			2
 #define NETBUF_SEND_PAYLOAD_MAX		8192
 
 #define NETBUF_LAST_CHAIN		0
 #define NETBUF_BEFORE_CHAIN		1
 
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__MACH__)
+#define KORE_USE_SENDFILE		1
+#endif
+
+#define NET_SEND_WRITE			0
+#define NET_SEND_WRITEV			1
+#define NET_SEND_IOV_MAX		64
+#define NET_SEND_CLASSES		4
+
 #define NETBUF_CALL_CB_ALWAYS	0x01
 #define NETBUF_FORCE_REMOVE	0x02
 #define NETBUF_MUST_RESEND	0x04
@@ -103,8 +113,10 @@ struct netbuf {
 	u_int32_t		s_off;
 	u_int32_t		b_len;
 	u_int32_t		m_len;
+	u_int32_t		scan_off;
 	u_int8_t		type;
 	u_int8_t		flags;
+	struct kore_pool	*pool;
 
 	void			*owner;
 	struct spdy_stream	*stream;
@@ -112,11 +124,23 @@ struct netbuf {
 	void			*extra;
 	int			(*cb)(struct netbuf *);
 
+	int			fd;
+	off_t			fd_off;
+	u_int64_t		fd_len;
+
 	TAILQ_ENTRY(netbuf)	list;
 };
 
 TAILQ_HEAD(netbuf_head, netbuf);
 
+struct net_stats {
+	u_int64_t		send_calls;
+	u_int64_t		send_bytes;
+	u_int64_t		send_netbufs;
+	u_int64_t		recv_idle;
+	u_int64_t		recv_saved_max;
+};
+
 #define KORE_TYPE_LISTENER	1
 #define KORE_TYPE_CONNECTION	2
 #define KORE_TYPE_PGSQL_CONN	3
@@ -127,6 +151,7 @@ struct listener {
 
 	int			fd;
 	u_int8_t		addrtype;
+	socklen_t		addrlen;
 
 	union {
 		struct sockaddr_in	ipv4;
@@ -170,6 +195,20 @@ LIST_HEAD(listener_head, listener);
 #define WEBSOCKET_BROADCAST_GLOBAL	2
 
 #define KORE_TIMER_ONESHOT	0x01
+#define KORE_TIMER_EMBEDDED	0x02
+
+struct kore_timer {
+	u_int64_t	nextrun;
+	u_int64_t	interval;
+	int		flags;
+	void		*arg;
+	void		(*cb)(void *, u_int64_t);
+
+	struct kore_timer_list	*slot;
+	TAILQ_ENTRY(kore_timer)	list;
+};
+
+TAILQ_HEAD(kore_timer_list, kore_timer);
 
 #define KORE_CONNECTION_PRUNE_DISCONNECT	0
 #define KORE_CONNECTION_PRUNE_ALL		1
@@ -198,8 +237,9 @@ struct connection {
 	} addr;
 
 	struct {
-		u_int64_t	length;
-		u_int64_t	start;
+		u_int64_t		length;
+		u_int64_t		start;
+		struct kore_timer	timer;
 	} idle_timer;
 
 	u_int8_t		inflate_started;
@@ -229,6 +269,7 @@ extern struct connection_list	disconnected;
 
 struct kore_handler_params {
 	char			*name;
+	u_int32_t		hash;
 	u_int8_t		method;
 	struct kore_validator	*validator;
 
@@ -254,6 +295,13 @@ struct kore_auth {
 
 #define HANDLER_TYPE_STATIC	1
 #define HANDLER_TYPE_DYNAMIC	2
+#define HANDLER_TYPE_FILEMAP	3
+
+#define HANDLER_BODY_STREAM	0x01
+#define HANDLER_COMPRESS	0x02
+#define HANDLER_CACHE		0x04
+
+#define HANDLER_CACHE_VARY_MAX	4
 
 struct kore_module {
 	void			*handle;
@@ -266,16 +314,31 @@ struct kore_module {
 	TAILQ_ENTRY(kore_module)	list;
 };
 
+struct kore_route_stats {
+	u_int64_t		lookups;
+	u_int64_t		lookup_ns;
+	u_int64_t		regexec_calls;
+};
+
+struct kore_route_table;
+
 struct kore_module_handle {
 	char			*path;
 	char			*func;
 	void			*addr;
 	int			type;
+	int			flags;
 	int			errors;
+	u_int32_t		cache_ttl;
+	char			*cache_vary[HANDLER_CACHE_VARY_MAX];
+	char			*root;
 	regex_t			rctx;
 	struct kore_domain	*dom;
 	struct kore_auth	*auth;
 
+	u_int32_t				params_count;
+	u_int32_t				params_mask;
+	struct kore_handler_params		**params_table;
 	TAILQ_HEAD(, kore_handler_params)	params;
 	TAILQ_ENTRY(kore_module_handle)		list;
 };
@@ -298,6 +361,7 @@ struct kore_domain {
 	char					*crlfile;
 	int					accesslog;
 	SSL_CTX					*ssl_ctx;
+	struct kore_route_table			*routes;
 	TAILQ_HEAD(, kore_module_handle)	handlers;
 	TAILQ_ENTRY(kore_domain)		list;
 };
@@ -355,16 +419,6 @@ struct kore_wscbs {
 	void		(*disconnect)(struct connection *);
 };
 
-struct kore_timer {
-	u_int64_t	nextrun;
-	u_int64_t	interval;
-	int		flags;
-	void		*arg;
-	void		(*cb)(void *, u_int64_t);
-
-	TAILQ_ENTRY(kore_timer)	list;
-};
-
 /* Reserved message ids, registered on workers. */
 #define KORE_MSG_ACCESSLOG	1
 #define KORE_MSG_WEBSOCKET	2
@@ -402,15 +456,20 @@ extern u_int32_t		worker_rlimit_nofiles;
 extern u_int32_t		worker_max_connections;
 extern u_int32_t		worker_active_connections;
 extern u_int32_t		worker_accept_threshold;
+extern u_int32_t		worker_accept_budget;
 extern u_int64_t		kore_websocket_maxframe;
 extern u_int64_t		kore_websocket_timeout;
 extern u_int32_t		kore_socket_backlog;
+extern u_int8_t			kore_socket_reuseport;
 
 extern struct listener_head	listeners;
 extern struct kore_worker	*worker;
 extern struct kore_domain_h	domains;
 extern struct kore_domain	*primary_dom;
 extern struct kore_pool		nb_pool;
+extern struct net_stats		net_stats;
+extern struct kore_route_stats	route_stats;
+extern u_int8_t			net_send_strategy;
 
 void		kore_cli_usage(int);
 int		kore_cli_main(int, char **);
@@ -437,6 +496,15 @@ void		kore_platform_schedule_read(int, void *);
 void		kore_platform_event_schedule(int, int, int, void *);
 void		kore_platform_worker_setcpu(struct kore_worker *);
 
+#if defined(KORE_USE_SENDFILE)
+int		kore_platform_sendfile(struct connection *, struct netbuf *);
+#endif
+#if defined(KORE_USE_URING)
+void		kore_uring_cancel(int);
+int		net_read_uring(struct connection *, int *);
+int		net_write_uring(struct connection *, int, int *);
+#endif
+
 void		kore_accesslog_init(void);
 void		kore_accesslog_worker_init(void);
 int		kore_accesslog_write(const void *, u_int32_t);
@@ -449,18 +517,22 @@ struct kore_auth	*kore_auth_lookup(const char *);
 void		kore_timer_init(void);
 u_int64_t	kore_timer_run(u_int64_t);
 void		kore_timer_remove(struct kore_timer *);
+void		kore_timer_cancel(struct kore_timer *);
+void		kore_timer_schedule(struct kore_timer *, u_int64_t);
+void		kore_timer_setup(struct kore_timer *,
+		    void (*cb)(void *, u_int64_t), void *);
 struct kore_timer	*kore_timer_add(void (*cb)(void *, u_int64_t),
 			    u_int64_t, void *, int);
 
 int		kore_tls_sni_cb(SSL *, int *, void *);
 int		kore_server_bind(const char *, const char *);
+void		kore_server_worker_bind(void);
 int		kore_tls_npn_cb(SSL *, const u_char **, unsigned int *, void *);
 void		kore_tls_info_callback(const SSL *, int, int);
 
 void			kore_connection_init(void);
 void			kore_connection_prune(int);
 struct connection	*kore_connection_new(void *);
-void			kore_connection_check_timeout(void);
 int			kore_connection_nonblock(int, int);
 int			kore_connection_handle(struct connection *);
 void			kore_connection_remove(struct connection *);
@@ -471,6 +543,10 @@ void			kore_connection_check_idletimer(u_int64_t,
 			    struct connection *);
 int			kore_connection_accept(struct listener *,
 			    struct connection **);
+int			kore_connection_adopt(struct listener *, int,
+			    const void *, struct connection **);
+u_int32_t		kore_connection_accept_batch(struct listener *);
+u_int32_t		kore_connection_accept_budget(void);
 
 u_int64_t	kore_time_ms(void);
 void		kore_log_init(void);
@@ -497,6 +573,8 @@ char		*kore_strdup(const char *);
 void		kore_log(int, const char *, ...);
 u_int64_t	kore_strtonum64(const char *, int, int *);
 void		kore_strlcpy(char *, const char *, size_t);
+u_int32_t	kore_strhash(const char *);
+u_int32_t	kore_strhash_seed(u_int32_t, const char *);
 void		kore_server_disconnect(struct connection *);
 int		kore_split_string(char *, char *, char **, size_t);
 void		kore_strip_chars(char *, char, char **);
@@ -527,6 +605,7 @@ int		kore_domain_new(char *);
 void		kore_module_init(void);
 void		kore_module_reload(int);
 void		kore_module_onload(void);
+void		kore_module_routes_build(void);
 int		kore_module_loaded(void);
 void		kore_domain_closelogs(void);
 void		*kore_module_getsym(const char *);
@@ -535,6 +614,13 @@ void		kore_module_load(const char *, const char *);
 void		kore_domain_sslstart(struct kore_domain *);
 int		kore_module_handler_new(const char *, const char *,
 		    const char *, const char *, int);
+int		kore_module_filemap_new(const char *, const char *,
+		    const char *, const char *);
+void		kore_module_handler_param_add(struct kore_module_handle *,
+		    struct kore_handler_params *);
+struct kore_handler_params	*kore_module_handler_param(
+				    struct kore_module_handle *, int,
+				    const char *, u_int32_t);
 
 struct kore_domain		*kore_domain_lookup(const char *);
 struct kore_module_handle	*kore_module_handler_find(const char *,
@@ -569,12 +655,21 @@ int		net_write_ssl(struct connection *, int, int *);
 void		net_recv_reset(struct connection *, u_int32_t,
 		    int (*cb)(struct netbuf *));
 void		net_remove_netbuf(struct netbuf_head *, struct netbuf *);
+void		net_send_fd(struct connection *, int, off_t, u_int64_t,
+		    struct spdy_stream *, int (*cb)(struct netbuf *),
+		    struct netbuf **);
 void		net_recv_queue(struct connection *, u_int32_t, int,
 		    int (*cb)(struct netbuf *));
+void		net_recv_free(struct connection *);
+void		net_recv_fill(struct connection *, const void *, u_int32_t);
+u_int8_t	*net_recv_detach(struct connection *, struct kore_pool **);
+void		net_buf_release(struct netbuf *);
 void		net_recv_expand(struct connection *c, u_int32_t,
 		    int (*cb)(struct netbuf *));
 void		net_send_queue(struct connection *, const void *,
 		    u_int32_t, struct spdy_stream *, int);
+void		net_send_queue_hint(struct connection *, const void *,
+		    u_int32_t, u_int32_t, struct spdy_stream *, int);
 void		net_send_stream(struct connection *, void *,
 		    u_int32_t, struct spdy_stream *,
 		    int (*cb)(struct netbuf *), struct netbuf **);
@@ -590,6 +685,8 @@ void	kore_buf_appendb(struct kore_buf *, struct kore_buf *);
 void	kore_buf_replace_string(struct kore_buf *, char *, void *, size_t);
 
 struct spdy_stream	*spdy_stream_lookup(struct connection *, u_int32_t);
+int			spdy_stream_header_ref(struct spdy_header_block *,
+			    const char *, const char **, u_int32_t *);
 int			spdy_stream_get_header(struct spdy_header_block *,
 			    const char *, char **);
 void			spdy_update_wsize(struct connection *,
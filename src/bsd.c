@@ -17,6 +17,8 @@
 #include <sys/param.h>
 #include <sys/event.h>
 #include <sys/sysctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #if defined(__FreeBSD_version)
 #include <sys/cpuset.h>
@@ -148,24 +150,7 @@ kore_platform_event_wait(u_int64_t timer)
 		switch (type) {
 		case KORE_TYPE_LISTENER:
 			l = (struct listener *)events[i].udata;
-
-			while (worker_active_connections <
-			    worker_max_connections) {
-				if (worker_accept_threshold != 0 &&
-				    r >= worker_accept_threshold)
-					break;
-
-				if (!kore_connection_accept(l, &c)) {
-					r = 1;
-					break;
-				}
-
-				if (c == NULL)
-					break;
-
-				r++;
-				kore_platform_event_all(c->fd, c);
-			}
+			r += kore_connection_accept_batch(l);
 			break;
 		case KORE_TYPE_CONNECTION:
 			c = (struct connection *)events[i].udata;
@@ -251,3 +236,45 @@ kore_platform_proctitle(char *title)
 	setproctitle("%s", title);
 #endif
 }
+
+#if defined(KORE_USE_SENDFILE)
+int
+kore_platform_sendfile(struct connection *c, struct netbuf *nb)
+{
+	int		r;
+	off_t		len, sent;
+
+	len = MIN(nb->fd_len, INT_MAX);
+
+#if defined(__MACH__)
+	sent = len;
+	r = sendfile(nb->fd, c->fd, nb->fd_off, &sent, NULL, 0);
+#else
+	r = sendfile(nb->fd, c->fd, nb->fd_off, len, NULL, &sent, 0);
+#endif
+
+	/* Even on EAGAIN part of the file may have been sent. */
+	nb->fd_off += sent;
+	nb->fd_len -= sent;
+
+	if (r == -1) {
+		switch (errno) {
+		case EINTR:
+		case EAGAIN:
+		case EBUSY:
+			c->flags &= ~CONN_WRITE_POSSIBLE;
+			return (KORE_RESULT_OK);
+		default:
+			kore_debug("sendfile(): %s", errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	if (sent == 0 && len != 0) {
+		kore_debug("sendfile(): file truncated");
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+#endif
@@ -0,0 +1,816 @@
+/*
+ * Copyright (c) 2015 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+#include <sys/shm.h>
+
+#include <sched.h>
+#include <time.h>
+
+#include "kore.h"
+#include "http.h"
+
+#define HTTP_CACHE_BUCKETS	1024
+#define HTTP_CACHE_HASH_INIT	14695981039346656037ULL
+#define HTTP_CACHE_HASH_PRIME	1099511628211ULL
+
+#define HTTP_CACHE_SHM_STRIPES		64
+#define HTTP_CACHE_SHM_CLASSES		5
+#define HTTP_CACHE_SHM_SLOT_MIN		2048
+#define HTTP_CACHE_SHM_SPINS		1000
+
+#define HTTP_CACHE_SLOT_FREE		0
+#define HTTP_CACHE_SLOT_WRITING		1
+#define HTTP_CACHE_SLOT_LIVE		2
+
+/*
+ * Describes a cached response. It is followed by the key, the handler
+ * its response headers as "name\0value\0" pairs and the body.
+ */
+struct http_cache_meta {
+	u_int64_t			hash;
+	u_int64_t			expires;
+	time_t				mtime;
+	u_int32_t			klen;
+	u_int32_t			hlen;
+	u_int32_t			len;
+	u_int32_t			etag;
+	int				status;
+};
+
+struct http_cache_entry {
+	size_t				size;
+	LIST_ENTRY(http_cache_entry)	hlist;
+	TAILQ_ENTRY(http_cache_entry)	lru;
+	struct http_cache_meta		meta;
+};
+
+/*
+ * The shared cache lives in one shm segment created by the parent: the
+ * header below, the bucket heads and then one slab per slot class. The
+ * locks hold the pid of their owner so the parent can release them if
+ * a worker dies while holding one.
+ */
+struct http_cache_shm_lock {
+	volatile pid_t			owner;
+	u_int8_t			pad[64 - sizeof(pid_t)];
+};
+
+struct http_cache_shm_class {
+	struct http_cache_shm_lock	lock;
+	size_t				size;
+	size_t				offset;
+	u_int32_t			first;
+	u_int32_t			nslots;
+	u_int32_t			hand;
+};
+
+struct http_cache_shm_slot {
+	volatile u_int32_t		state;
+	volatile u_int32_t		ref;
+	pid_t				owner;
+	u_int32_t			next;
+	struct http_cache_meta		meta;
+};
+
+struct http_cache_shm {
+	u_int32_t			nbuckets;
+	struct http_cache_shm_lock	stripes[HTTP_CACHE_SHM_STRIPES];
+	struct http_cache_shm_class	classes[HTTP_CACHE_SHM_CLASSES];
+};
+
+static u_int64_t	http_cache_key(struct http_request *);
+static void		http_cache_key_header(struct http_request *,
+			    const char *);
+static void		http_cache_remove(struct http_cache_entry *);
+static struct http_cache_entry	*http_cache_find(u_int64_t);
+static void		http_cache_fill(struct http_request *,
+			    struct http_cache_meta *, u_int64_t, int,
+			    void *, u_int32_t);
+static void		http_cache_send(struct http_request *,
+			    struct http_cache_meta *, u_int8_t *);
+static const char	*http_cache_header(struct http_request *,
+			    const char *);
+
+static int		http_cache_shm_lookup(struct http_request *,
+			    u_int64_t);
+static void		http_cache_shm_store(struct http_request *,
+			    u_int64_t, int, void *, u_int32_t, size_t);
+static struct http_cache_shm_slot	*http_cache_shm_slot(u_int32_t);
+static struct http_cache_shm_slot	*http_cache_shm_claim(
+			    struct http_cache_shm_class *);
+static void		http_cache_shm_unlink(u_int32_t, u_int32_t,
+			    u_int32_t);
+static void		http_cache_shm_lock(struct http_cache_shm_lock *);
+static void		http_cache_shm_unlock(struct http_cache_shm_lock *);
+
+static LIST_HEAD(, http_cache_entry)	cache_buckets[HTTP_CACHE_BUCKETS];
+static TAILQ_HEAD(http_cache_lru, http_cache_entry)	cache_lru;
+static struct kore_buf			*cache_key = NULL;
+static struct kore_buf			*cache_copy = NULL;
+static size_t				cache_size = 0;
+
+static int				cache_shm_key = -1;
+static struct http_cache_shm		*cache_shm = NULL;
+static u_int32_t			*cache_shm_buckets = NULL;
+static pid_t				cache_shm_pid = 0;
+
+u_int64_t			http_cache_max = HTTP_CACHE_MAX;
+u_int64_t			http_cache_shared = 0;
+struct http_cache_stats		http_cache_stats;
+
+void
+http_cache_init(void)
+{
+	int		i;
+
+	for (i = 0; i < HTTP_CACHE_BUCKETS; i++)
+		LIST_INIT(&cache_buckets[i]);
+
+	TAILQ_INIT(&cache_lru);
+	cache_key = kore_buf_create(HTTP_URI_LEN);
+	memset(&http_cache_stats, 0, sizeof(http_cache_stats));
+
+	if (cache_shm != NULL) {
+		cache_shm_pid = getpid();
+		cache_copy = kore_buf_create(HTTP_CACHE_SHM_SLOT_MIN);
+	}
+}
+
+void
+http_cache_flush(void)
+{
+	struct http_cache_entry		*ent;
+
+	while ((ent = TAILQ_FIRST(&cache_lru)) != NULL)
+		http_cache_remove(ent);
+}
+
+/*
+ * Empties the shared cache. The parent does this once on a reload, the
+ * workers only flush their own cache.
+ */
+void
+http_cache_shm_flush(void)
+{
+	u_int32_t			b, idx, next;
+	struct http_cache_shm_slot	*slot;
+
+	if (cache_shm == NULL)
+		return;
+
+	for (b = 0; b < cache_shm->nbuckets; b++) {
+		http_cache_shm_lock(&cache_shm->stripes[b %
+		    HTTP_CACHE_SHM_STRIPES]);
+		for (idx = cache_shm_buckets[b]; idx != 0; idx = next) {
+			slot = http_cache_shm_slot(idx);
+			next = slot->next;
+			slot->next = 0;
+			slot->state = HTTP_CACHE_SLOT_FREE;
+		}
+		cache_shm_buckets[b] = 0;
+		http_cache_shm_unlock(&cache_shm->stripes[b %
+		    HTTP_CACHE_SHM_STRIPES]);
+	}
+}
+
+/*
+ * Called before the handler runs. On a fresh hit the cached response
+ * is sent and 1 is returned, the handler does not get to run. On a
+ * miss a GET is marked so its response is stored, a HEAD answers from
+ * what a GET stored but its own body-less response is never kept.
+ */
+int
+http_cache_lookup(struct http_request *req)
+{
+	u_int64_t			hash;
+	struct http_cache_entry		*ent;
+
+	if (http_cache_max == 0 && cache_shm == NULL)
+		return (0);
+
+	if (req->method != HTTP_METHOD_GET && req->method != HTTP_METHOD_HEAD)
+		return (0);
+
+	hash = http_cache_key(req);
+	if (cache_shm != NULL)
+		return (http_cache_shm_lookup(req, hash));
+
+	if ((ent = http_cache_find(hash)) != NULL &&
+	    ent->meta.expires <= kore_time_ms()) {
+		http_cache_remove(ent);
+		ent = NULL;
+	}
+
+	if (ent == NULL) {
+		http_cache_stats.misses++;
+		if (req->method == HTTP_METHOD_GET)
+			req->flags |= HTTP_REQUEST_CACHE_STORE;
+		return (0);
+	}
+
+	http_cache_stats.hits++;
+	TAILQ_REMOVE(&cache_lru, ent, lru);
+	TAILQ_INSERT_HEAD(&cache_lru, ent, lru);
+
+	http_cache_send(req, &ent->meta, (u_int8_t *)(ent + 1));
+	return (1);
+}
+
+/*
+ * Called from http_response() for requests marked by http_cache_lookup(),
+ * with the final status, body and response headers.
+ */
+void
+http_cache_store(struct http_request *req, int status, void *d, u_int32_t len)
+{
+	u_int64_t			hash, h;
+	size_t				size, hlen;
+	char				etag[24], *date;
+	const char			*cc;
+	struct http_header		*hdr;
+	struct http_cache_entry		*ent;
+	u_int32_t			i;
+
+	req->flags &= ~HTTP_REQUEST_CACHE_STORE;
+
+	if (status != HTTP_STATUS_OK ||
+	    http_cache_header(req, "set-cookie") != NULL)
+		return;
+
+	if ((cc = http_cache_header(req, "cache-control")) != NULL &&
+	    (strstr(cc, "no-store") != NULL || strstr(cc, "private") != NULL))
+		return;
+
+	/* Responses get an etag and last-modified to revalidate against. */
+	if (http_cache_header(req, "etag") == NULL) {
+		h = HTTP_CACHE_HASH_INIT;
+		for (i = 0; i < len; i++) {
+			h ^= ((u_int8_t *)d)[i];
+			h *= HTTP_CACHE_HASH_PRIME;
+		}
+
+		(void)snprintf(etag, sizeof(etag), "\"%016" PRIx64 "\"", h);
+		http_response_header(req, "etag", etag);
+	}
+
+	if (http_cache_header(req, "last-modified") == NULL &&
+	    (date = kore_time_to_date(time(NULL))) != NULL)
+		http_response_header(req, "last-modified", date);
+
+	hlen = 0;
+	TAILQ_FOREACH(hdr, &(req->resp_headers), list)
+		hlen += strlen(hdr->header) + strlen(hdr->value) + 2;
+
+	hash = http_cache_key(req);
+	size = sizeof(struct http_cache_meta) + cache_key->offset + hlen + len;
+
+	if (cache_shm != NULL) {
+		http_cache_shm_store(req, hash, status, d, len, size);
+		return;
+	}
+
+	size += sizeof(*ent) - sizeof(struct http_cache_meta);
+
+	/* One response should not be able to flush out most others. */
+	if (size > http_cache_max / 4)
+		return;
+
+	if ((ent = http_cache_find(hash)) != NULL)
+		http_cache_remove(ent);
+
+	while (cache_size + size > http_cache_max &&
+	    (ent = TAILQ_LAST(&cache_lru, http_cache_lru)) != NULL) {
+		http_cache_stats.evictions++;
+		http_cache_remove(ent);
+	}
+
+	ent = kore_malloc(size);
+	ent->size = size;
+	http_cache_fill(req, &ent->meta, hash, status, d, len);
+
+	LIST_INSERT_HEAD(&cache_buckets[hash & (HTTP_CACHE_BUCKETS - 1)],
+	    ent, hlist);
+	TAILQ_INSERT_HEAD(&cache_lru, ent, lru);
+	cache_size += size;
+	http_cache_stats.entries++;
+}
+
+/*
+ * Creates the shared cache segment in the parent, before the workers
+ * are forked so they all inherit the same mapping. The memory is split
+ * evenly over slot classes of 2KB up to 512KB, responses larger than
+ * the biggest slot are not cached.
+ */
+void
+http_cache_shm_init(void)
+{
+	u_int8_t			*base;
+	size_t				len, size, share;
+	u_int32_t			i, nslots, nbuckets;
+	struct http_cache_shm_class	*cls;
+	struct http_cache_shm		hdr;
+
+	if (http_cache_shared == 0)
+		return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	share = http_cache_shared / HTTP_CACHE_SHM_CLASSES;
+
+	nslots = 0;
+	size = HTTP_CACHE_SHM_SLOT_MIN;
+	for (i = 0; i < HTTP_CACHE_SHM_CLASSES; i++) {
+		cls = &hdr.classes[i];
+		cls->size = size;
+		cls->first = nslots + 1;
+		cls->nslots = share / size;
+		nslots += cls->nslots;
+		size *= 4;
+	}
+
+	if (nslots == 0)
+		fatal("http_cache_shared of %" PRIu64 " bytes is too small",
+		    http_cache_shared);
+
+	nbuckets = HTTP_CACHE_SHM_STRIPES;
+	while (nbuckets < nslots)
+		nbuckets <<= 1;
+	hdr.nbuckets = nbuckets;
+
+	len = sizeof(hdr) + (nbuckets * sizeof(u_int32_t));
+	len = (len + 63) & ~(size_t)63;
+	for (i = 0; i < HTTP_CACHE_SHM_CLASSES; i++) {
+		cls = &hdr.classes[i];
+		cls->offset = len;
+		len += cls->size * cls->nslots;
+	}
+
+	cache_shm_key = shmget(IPC_PRIVATE, len, IPC_CREAT | IPC_EXCL | 0700);
+	if (cache_shm_key == -1)
+		fatal("http_cache_shm_init(): shmget() %s", errno_s);
+	if ((base = shmat(cache_shm_key, NULL, 0)) == (void *)-1)
+		fatal("http_cache_shm_init(): shmat() %s", errno_s);
+
+	/* Slots are FREE when zeroed, fresh segments come zeroed. */
+	cache_shm_pid = getpid();
+	cache_shm = (struct http_cache_shm *)base;
+	memcpy(cache_shm, &hdr, sizeof(hdr));
+	cache_shm_buckets = (u_int32_t *)(cache_shm + 1);
+
+	kore_debug("shared response cache: %u slots, %zu bytes",
+	    nslots, len);
+}
+
+void
+http_cache_shm_cleanup(void)
+{
+	if (cache_shm_key == -1)
+		return;
+
+	if (shmctl(cache_shm_key, IPC_RMID, NULL) == -1) {
+		kore_log(LOG_NOTICE,
+		    "failed to delete cache shm segment: %s", errno_s);
+	}
+
+	cache_shm_key = -1;
+}
+
+/*
+ * Called by the parent when a worker died, anything it held in the
+ * shared cache is released so the other workers do not spin forever.
+ */
+void
+http_cache_shm_reap(pid_t pid)
+{
+	u_int32_t			i, idx;
+	struct http_cache_shm_class	*cls;
+	struct http_cache_shm_slot	*slot;
+
+	if (cache_shm == NULL)
+		return;
+
+	for (i = 0; i < HTTP_CACHE_SHM_STRIPES; i++)
+		(void)__sync_bool_compare_and_swap(
+		    &cache_shm->stripes[i].owner, pid, 0);
+
+	for (i = 0; i < HTTP_CACHE_SHM_CLASSES; i++) {
+		cls = &cache_shm->classes[i];
+		(void)__sync_bool_compare_and_swap(&cls->lock.owner, pid, 0);
+
+		for (idx = cls->first; idx < cls->first + cls->nslots; idx++) {
+			slot = http_cache_shm_slot(idx);
+			if (slot->state == HTTP_CACHE_SLOT_WRITING &&
+			    slot->owner == pid)
+				slot->state = HTTP_CACHE_SLOT_FREE;
+		}
+	}
+}
+
+/*
+ * The key is the host, path and query plus the values of the headers the
+ * handler varies on. When responses get compressed accept-encoding is
+ * part of it too. Leaves the key itself in cache_key.
+ */
+static u_int64_t
+http_cache_key(struct http_request *req)
+{
+	int				i;
+	u_int64_t			h;
+	size_t				off;
+	struct kore_module_handle	*hdlr = req->hdlr;
+
+	cache_key->offset = 0;
+	kore_buf_append(cache_key, req->host, strlen(req->host) + 1);
+	kore_buf_append(cache_key, req->path, strlen(req->path) + 1);
+	if (req->query_string != NULL) {
+		kore_buf_append(cache_key, req->query_string,
+		    strlen(req->query_string));
+	}
+	kore_buf_append(cache_key, "", 1);
+
+	for (i = 0; i < HANDLER_CACHE_VARY_MAX; i++) {
+		if (hdlr->cache_vary[i] != NULL)
+			http_cache_key_header(req, hdlr->cache_vary[i]);
+	}
+
+	if (hdlr->flags & HANDLER_COMPRESS)
+		http_cache_key_header(req, "accept-encoding");
+
+	h = HTTP_CACHE_HASH_INIT;
+	for (off = 0; off < cache_key->offset; off++) {
+		h ^= cache_key->data[off];
+		h *= HTTP_CACHE_HASH_PRIME;
+	}
+
+	return (h);
+}
+
+static void
+http_cache_key_header(struct http_request *req, const char *name)
+{
+	const char	*value;
+	u_int32_t	vlen;
+
+	if (http_request_header_ref(req, name, &value, &vlen))
+		kore_buf_append(cache_key, value, vlen);
+
+	kore_buf_append(cache_key, "", 1);
+}
+
+static struct http_cache_entry *
+http_cache_find(u_int64_t hash)
+{
+	struct http_cache_entry		*ent;
+
+	LIST_FOREACH(ent, &cache_buckets[hash & (HTTP_CACHE_BUCKETS - 1)],
+	    hlist) {
+		if (ent->meta.hash == hash &&
+		    ent->meta.klen == cache_key->offset &&
+		    !memcmp(ent + 1, cache_key->data, ent->meta.klen))
+			return (ent);
+	}
+
+	return (NULL);
+}
+
+static void
+http_cache_remove(struct http_cache_entry *ent)
+{
+	LIST_REMOVE(ent, hlist);
+	TAILQ_REMOVE(&cache_lru, ent, lru);
+
+	cache_size -= ent->size;
+	http_cache_stats.entries--;
+	kore_mem_free(ent);
+}
+
+/* Writes the key, response headers and body after the given meta. */
+static void
+http_cache_fill(struct http_request *req, struct http_cache_meta *m,
+    u_int64_t hash, int status, void *d, u_int32_t len)
+{
+	u_int8_t		*p;
+	u_int32_t		i;
+	struct http_header	*hdr;
+
+	m->hash = hash;
+	m->status = status;
+	m->etag = 0;
+	m->mtime = 0;
+	m->expires = kore_time_ms() +
+	    ((u_int64_t)req->hdlr->cache_ttl * 1000);
+
+	p = (u_int8_t *)(m + 1);
+	m->klen = cache_key->offset;
+	memcpy(p, cache_key->data, m->klen);
+	p += m->klen;
+
+	m->hlen = 0;
+	TAILQ_FOREACH(hdr, &(req->resp_headers), list) {
+		i = strlen(hdr->header) + 1;
+		memcpy(p, hdr->header, i);
+		p += i;
+		m->hlen += i;
+
+		if (!strcasecmp(hdr->header, "etag"))
+			m->etag = m->hlen;
+		else if (!strcasecmp(hdr->header, "last-modified"))
+			m->mtime = kore_date_to_time(hdr->value);
+
+		i = strlen(hdr->value) + 1;
+		memcpy(p, hdr->value, i);
+		p += i;
+		m->hlen += i;
+	}
+
+	m->len = len;
+	if (len > 0)
+		memcpy(p, d, len);
+}
+
+/* Answers the request from a cached response, blob follows the meta. */
+static void
+http_cache_send(struct http_request *req, struct http_cache_meta *m,
+    u_int8_t *blob)
+{
+	int		not_modified;
+	size_t		len;
+	const char	*name, *value, *end, *headers, *etag;
+	u_int8_t	*data;
+
+	headers = (const char *)blob + m->klen;
+	data = blob + m->klen + m->hlen;
+	etag = (m->etag != 0) ? headers + m->etag : NULL;
+	not_modified = http_not_modified(req, etag, m->mtime);
+
+	end = headers + m->hlen;
+	for (name = headers; name < end; name = value + len + 1) {
+		value = name + strlen(name) + 1;
+		len = strlen(value);
+
+		/* A 304 carries no body, nor anything describing one. */
+		if (not_modified && !strncasecmp(name, "content-", 8))
+			continue;
+
+		http_response_header(req, name, value);
+	}
+
+	req->flags |= HTTP_REQUEST_CACHE_HIT;
+	if (not_modified)
+		http_response(req, 304, NULL, 0);
+	else
+		http_response(req, m->status, data, m->len);
+}
+
+static const char *
+http_cache_header(struct http_request *req, const char *name)
+{
+	struct http_header	*hdr;
+
+	TAILQ_FOREACH(hdr, &(req->resp_headers), list) {
+		if (!strcasecmp(hdr->header, name))
+			return (hdr->value);
+	}
+
+	return (NULL);
+}
+
+/*
+ * The entry is copied out while its stripe is locked and sent from the
+ * copy, so a slow response never holds up the other workers.
+ */
+static int
+http_cache_shm_lookup(struct http_request *req, u_int64_t hash)
+{
+	u_int32_t			b, idx, prev;
+	struct http_cache_meta		meta;
+	struct http_cache_shm_slot	*slot;
+	struct http_cache_shm_lock	*stripe;
+
+	b = hash & (cache_shm->nbuckets - 1);
+	stripe = &cache_shm->stripes[b % HTTP_CACHE_SHM_STRIPES];
+
+	prev = 0;
+	slot = NULL;
+	http_cache_shm_lock(stripe);
+
+	for (idx = cache_shm_buckets[b]; idx != 0; idx = slot->next) {
+		slot = http_cache_shm_slot(idx);
+		if (slot->meta.hash == hash &&
+		    slot->meta.klen == cache_key->offset &&
+		    !memcmp(&slot->meta + 1, cache_key->data, slot->meta.klen))
+			break;
+		prev = idx;
+	}
+
+	if (idx != 0 && slot->meta.expires <= kore_time_ms()) {
+		http_cache_shm_unlink(b, idx, prev);
+		idx = 0;
+	}
+
+	if (idx != 0) {
+		slot->ref = 1;
+		meta = slot->meta;
+		cache_copy->offset = 0;
+		kore_buf_append(cache_copy, &slot->meta + 1,
+		    meta.klen + meta.hlen + meta.len);
+	}
+
+	http_cache_shm_unlock(stripe);
+
+	if (idx == 0) {
+		http_cache_stats.misses++;
+		if (req->method == HTTP_METHOD_GET)
+			req->flags |= HTTP_REQUEST_CACHE_STORE;
+		return (0);
+	}
+
+	http_cache_stats.hits++;
+	http_cache_send(req, &meta, cache_copy->data);
+
+	return (1);
+}
+
+/*
+ * The response is written into a claimed slot without holding any lock,
+ * it only becomes visible once it is linked into its bucket.
+ */
+static void
+http_cache_shm_store(struct http_request *req, u_int64_t hash, int status,
+    void *d, u_int32_t len, size_t size)
+{
+	u_int32_t			i, b, idx, prev, next;
+	struct http_cache_shm_class	*cls;
+	struct http_cache_shm_slot	*slot, *old;
+	struct http_cache_shm_lock	*stripe;
+
+	size += sizeof(*slot) - sizeof(struct http_cache_meta);
+
+	cls = NULL;
+	for (i = 0; i < HTTP_CACHE_SHM_CLASSES; i++) {
+		if (cache_shm->classes[i].nslots > 0 &&
+		    cache_shm->classes[i].size >= size) {
+			cls = &cache_shm->classes[i];
+			break;
+		}
+	}
+
+	if (cls == NULL)
+		return;
+
+	http_cache_shm_lock(&cls->lock);
+	slot = http_cache_shm_claim(cls);
+	http_cache_shm_unlock(&cls->lock);
+
+	if (slot == NULL)
+		return;
+
+	http_cache_fill(req, &slot->meta, hash, status, d, len);
+	idx = cls->first + (((u_int8_t *)slot - (u_int8_t *)cache_shm -
+	    cls->offset) / cls->size);
+
+	b = hash & (cache_shm->nbuckets - 1);
+	stripe = &cache_shm->stripes[b % HTTP_CACHE_SHM_STRIPES];
+	http_cache_shm_lock(stripe);
+
+	/* Another worker may have stored the same response meanwhile. */
+	prev = 0;
+	for (i = cache_shm_buckets[b]; i != 0; i = next) {
+		old = http_cache_shm_slot(i);
+		next = old->next;
+		if (old->meta.hash == hash &&
+		    old->meta.klen == slot->meta.klen &&
+		    !memcmp(&old->meta + 1, &slot->meta + 1, old->meta.klen)) {
+			http_cache_shm_unlink(b, i, prev);
+			continue;
+		}
+		prev = i;
+	}
+
+	slot->ref = 0;
+	slot->owner = 0;
+	slot->next = cache_shm_buckets[b];
+	slot->state = HTTP_CACHE_SLOT_LIVE;
+	cache_shm_buckets[b] = idx;
+
+	http_cache_shm_unlock(stripe);
+}
+
+static struct http_cache_shm_slot *
+http_cache_shm_slot(u_int32_t idx)
+{
+	u_int32_t			i;
+	struct http_cache_shm_class	*cls;
+
+	for (i = 0; i < HTTP_CACHE_SHM_CLASSES; i++) {
+		cls = &cache_shm->classes[i];
+		if (idx >= cls->first && idx < cls->first + cls->nslots)
+			break;
+	}
+
+	if (i == HTTP_CACHE_SHM_CLASSES)
+		fatal("http_cache_shm_slot(): bad slot %u", idx);
+
+	return ((struct http_cache_shm_slot *)((u_int8_t *)cache_shm +
+	    cls->offset + ((size_t)(idx - cls->first) * cls->size)));
+}
+
+/*
+ * Finds a slot to reuse with the clock algorithm, a live slot that was
+ * hit since the hand last passed gets another round. Called with the
+ * class lock held, which is always taken before a stripe lock.
+ */
+static struct http_cache_shm_slot *
+http_cache_shm_claim(struct http_cache_shm_class *cls)
+{
+	u_int32_t			n, b, idx, i, prev;
+	struct http_cache_shm_slot	*slot;
+	struct http_cache_shm_lock	*stripe;
+
+	for (n = 0; n < cls->nslots * 2; n++) {
+		idx = cls->first + cls->hand;
+		if (++cls->hand == cls->nslots)
+			cls->hand = 0;
+
+		slot = http_cache_shm_slot(idx);
+		if (slot->state == HTTP_CACHE_SLOT_WRITING)
+			continue;
+
+		if (slot->state == HTTP_CACHE_SLOT_LIVE) {
+			if (slot->ref) {
+				slot->ref = 0;
+				continue;
+			}
+
+			b = slot->meta.hash & (cache_shm->nbuckets - 1);
+			stripe = &cache_shm->stripes[b %
+			    HTTP_CACHE_SHM_STRIPES];
+
+			http_cache_shm_lock(stripe);
+			if (slot->state == HTTP_CACHE_SLOT_LIVE) {
+				prev = 0;
+				for (i = cache_shm_buckets[b]; i != idx;
+				    i = http_cache_shm_slot(i)->next)
+					prev = i;
+				http_cache_shm_unlink(b, idx, prev);
+				http_cache_stats.evictions++;
+			}
+			http_cache_shm_unlock(stripe);
+		}
+
+		slot->owner = cache_shm_pid;
+		slot->state = HTTP_CACHE_SLOT_WRITING;
+		return (slot);
+	}
+
+	return (NULL);
+}
+
+/* Called with the stripe lock of bucket b held. */
+static void
+http_cache_shm_unlink(u_int32_t b, u_int32_t idx, u_int32_t prev)
+{
+	struct http_cache_shm_slot	*slot;
+
+	slot = http_cache_shm_slot(idx);
+	if (prev == 0)
+		cache_shm_buckets[b] = slot->next;
+	else
+		http_cache_shm_slot(prev)->next = slot->next;
+
+	slot->next = 0;
+	slot->state = HTTP_CACHE_SLOT_FREE;
+}
+
+static void
+http_cache_shm_lock(struct http_cache_shm_lock *lock)
+{
+	u_int32_t	spins;
+
+	spins = 0;
+	while (!__sync_bool_compare_and_swap(&lock->owner, 0, cache_shm_pid)) {
+		if (++spins == HTTP_CACHE_SHM_SPINS) {
+			spins = 0;
+			sched_yield();
+		}
+	}
+}
+
+static void
+http_cache_shm_unlock(struct http_cache_shm_lock *lock)
+{
+	__sync_lock_release(&lock->owner);
+}
@@ -21,6 +21,7 @@
 #include <sys/wait.h>
 #include <sys/mman.h>
 
+#include <openssl/evp.h>
 #include <openssl/pem.h>
 #include <openssl/x509v3.h>
 
@@ -39,6 +40,7 @@
 #include <utime.h>
 
 #include "kore.h"
+#include "http.h"
 
 #if defined(OpenBSD) || defined(__FreeBSD_version) || \
     defined(NetBSD) || defined(__DragonFly_version)
@@ -101,6 +103,8 @@ static void		cli_file_write(int, const void *, size_t);
 static int		cli_vasprintf(char **, const char *, ...);
 static void		cli_spawn_proc(void (*cb)(void *), void *);
 static void		cli_write_asset(const char *, const char *);
+static void		cli_write_bytes(int, const u_int8_t *, size_t);
+static u_int8_t		*cli_asset_gzip(u_int8_t *, size_t, size_t *);
 static void		cli_register_cfile(char *, struct dirent *);
 static void		cli_file_create(const char *, const char *, size_t);
 static int		cli_file_requires_build(struct stat *, const char *);
@@ -333,6 +337,7 @@ cli_build(int argc, char **argv)
 
 		cli_file_writef(s_fd, "#ifndef __H_KORE_ASSETS_H\n");
 		cli_file_writef(s_fd, "#define __H_KORE_ASSETS_H\n");
+		cli_file_writef(s_fd, "\nstruct http_asset;\n");
 		cli_find_files(assets_path, cli_build_asset);
 		cli_file_writef(s_fd, "\n#endif\n");
 		cli_file_close(s_fd);
@@ -574,17 +579,67 @@ cli_write_asset(const char *n, const char *e)
 	cli_file_writef(s_fd, "extern u_int8_t asset_%s_%s[];\n", n, e);
 	cli_file_writef(s_fd, "extern u_int32_t asset_len_%s_%s;\n", n, e);
 	cli_file_writef(s_fd, "extern time_t asset_mtime_%s_%s;\n", n, e);
+	cli_file_writef(s_fd,
+	    "extern struct http_asset asset_info_%s_%s;\n", n, e);
+}
+
+static void
+cli_write_bytes(int fd, const u_int8_t *d, size_t len)
+{
+	size_t		off;
+
+	for (off = 0; off < len; off++)
+		cli_file_writef(fd, "0x%02x,", d[off]);
+}
+
+/*
+ * Returns the gzip compressed asset, or NULL if compressing it does
+ * not make it any smaller.
+ */
+static u_int8_t *
+cli_asset_gzip(u_int8_t *d, size_t len, size_t *olen)
+{
+	z_stream	zs;
+	u_int8_t	*out;
+	int		r;
+
+	memset(&zs, 0, sizeof(zs));
+	if ((r = deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED,
+	    15 + 16, 8, Z_DEFAULT_STRATEGY)) != Z_OK)
+		cli_fatal("deflateInit2(): %d", r);
+
+	out = kore_malloc(deflateBound(&zs, len));
+
+	zs.next_in = d;
+	zs.avail_in = len;
+	zs.next_out = out;
+	zs.avail_out = deflateBound(&zs, len);
+
+	if ((r = deflate(&zs, Z_FINISH)) != Z_STREAM_END)
+		cli_fatal("deflate(): %d", r);
+
+	*olen = zs.total_out;
+	deflateEnd(&zs);
+
+	if (*olen >= len) {
+		kore_mem_free(out);
+		return (NULL);
+	}
+
+	return (out);
 }
 
 static void
 cli_build_asset(char *fpath, struct dirent *dp)
 {
 	struct stat		st;
-	u_int8_t		*d;
-	off_t			off;
 	void			*base;
+	const char		*type;
 	int			in, out;
-	char			*cpath, *ext, *opath, *p, *name;
+	size_t			gz_len;
+	unsigned int		i, mdlen;
+	u_int8_t		*gz, md[EVP_MAX_MD_SIZE];
+	char			*cpath, *ext, *opath, *p, *name, etag[33];
 
 	name = kore_strdup(dp->d_name);
 
@@ -640,12 +695,12 @@ cli_build_asset(char *fpath, struct dirent *dp)
 	/* Start generating the file. */
 	cli_file_writef(out, "/* Auto generated */\n");
 	cli_file_writef(out, "#include <sys/param.h>\n\n");
+	cli_file_writef(out, "#include <kore/kore.h>\n");
+	cli_file_writef(out, "#include <kore/http.h>\n\n");
 
 	/* Write the file data as a byte array. */
 	cli_file_writef(out, "u_int8_t asset_%s_%s[] = {\n", name, ext);
-	d = base;
-	for (off = 0; off < st.st_size; off++)
-		cli_file_writef(out, "0x%02x,", *d++);
+	cli_write_bytes(out, base, st.st_size);
 
 	/*
 	 * Always NUL-terminate the asset, even if this NUL is not included in
@@ -661,6 +716,39 @@ cli_build_asset(char *fpath, struct dirent *dp)
 	cli_file_writef(out, "time_t asset_mtime_%s_%s = %" PRI_TIME_T ";\n",
 	    name, ext, st.st_mtime);
 
+	/* A gzip variant for clients that accept it, if it is smaller. */
+	gz = cli_asset_gzip(base, st.st_size, &gz_len);
+	if (gz != NULL) {
+		cli_file_writef(out,
+		    "\nstatic u_int8_t asset_gz_%s_%s[] = {\n", name, ext);
+		cli_write_bytes(out, gz, gz_len);
+		cli_file_writef(out, "};\n");
+	}
+
+	/* The strong ETag is the first 128 bits of the SHA256 digest. */
+	if (!EVP_Digest(base, st.st_size, md, &mdlen, EVP_sha256(), NULL))
+		cli_fatal("EVP_Digest() failed for %s", fpath);
+	for (i = 0; i < 16; i++)
+		snprintf(etag + (i * 2), 3, "%02x", md[i]);
+
+	type = http_media_type(ext);
+
+	cli_file_writef(out, "\nstruct http_asset asset_info_%s_%s = {\n",
+	    name, ext);
+	if (type != NULL)
+		cli_file_writef(out, "\t.type = \"%s\",\n", type);
+	cli_file_writef(out, "\t.data = asset_%s_%s,\n", name, ext);
+	cli_file_writef(out, "\t.len = %" PRIu32 ",\n", (u_int32_t)st.st_size);
+	if (gz != NULL) {
+		cli_file_writef(out, "\t.gz_data = asset_gz_%s_%s,\n",
+		    name, ext);
+		cli_file_writef(out, "\t.gz_len = %zu,\n", gz_len);
+		kore_mem_free(gz);
+	}
+	cli_file_writef(out, "\t.etag = \"\\\"%s\\\"\",\n", etag);
+	cli_file_writef(out, "\t.gz_etag = \"\\\"%s-gz\\\"\",\n", etag);
+	cli_file_writef(out, "\t.mtime = %" PRI_TIME_T "\n};\n\n", st.st_mtime);
+
 	/* Write the file symbols into assets.h so they can be used. */
 	cli_write_asset(name, ext);
 
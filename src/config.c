@@ -49,6 +49,7 @@ static int		configure_certkey(char **);
 static int		configure_rlimit_nofiles(char **);
 static int		configure_max_connections(char **);
 static int		configure_accept_threshold(char **);
+static int		configure_accept_budget(char **);
 static int		configure_set_affinity(char **);
 static int		configure_tls_version(char **);
 static int		configure_tls_cipher(char **);
@@ -56,6 +57,17 @@ static int		configure_tls_dhparam(char **);
 static int		configure_spdy_idle_time(char **);
 static int		configure_http_header_max(char **);
 static int		configure_http_body_max(char **);
+static int		configure_http_body_disk_offload(char **);
+static int		configure_http_body_disk_path(char **);
+static int		configure_body_stream(char **);
+static int		configure_filemap(char **);
+static int		configure_compress(char **);
+static int		configure_cache(char **);
+static int		configure_http_cache_max(char **);
+static int		configure_http_cache_shared(char **);
+static int		configure_http_compress_min(char **);
+static int		configure_http_compress_level(char **);
+static int		configure_http_compress_type(char **);
 static int		configure_http_hsts_enable(char **);
 static int		configure_http_keepalive_time(char **);
 static int		configure_http_request_limit(char **);
@@ -71,6 +83,8 @@ static int		configure_authentication_validator(char **);
 static int		configure_websocket_maxframe(char **);
 static int		configure_websocket_timeout(char **);
 static int		configure_socket_backlog(char **);
+static int		configure_net_send_strategy(char **);
+static int		configure_socket_reuseport(char **);
 
 #if defined(KORE_USE_PGSQL)
 static int		configure_pgsql_conn_max(char **);
@@ -92,6 +106,10 @@ static struct {
 	{ "load",			configure_load },
 	{ "static",			configure_handler },
 	{ "dynamic",			configure_handler },
+	{ "filemap",			configure_filemap },
+	{ "body_stream",		configure_body_stream },
+	{ "compress",			configure_compress },
+	{ "cache",			configure_cache },
 	{ "tls_version",		configure_tls_version },
 	{ "tls_cipher",			configure_tls_cipher },
 	{ "tls_dhparam",		configure_tls_dhparam },
@@ -103,6 +121,7 @@ static struct {
 	{ "worker_max_connections",	configure_max_connections },
 	{ "worker_rlimit_nofiles",	configure_rlimit_nofiles },
 	{ "worker_accept_threshold",	configure_accept_threshold },
+	{ "worker_accept_budget",	configure_accept_budget },
 	{ "worker_set_affinity",	configure_set_affinity },
 	{ "pidfile",			configure_pidfile },
 	{ "accesslog",			configure_accesslog },
@@ -111,6 +130,13 @@ static struct {
 	{ "client_certificates",	configure_client_certificates },
 	{ "http_header_max",		configure_http_header_max },
 	{ "http_body_max",		configure_http_body_max },
+	{ "http_body_disk_offload",	configure_http_body_disk_offload },
+	{ "http_body_disk_path",	configure_http_body_disk_path },
+	{ "http_compress_min",		configure_http_compress_min },
+	{ "http_compress_level",	configure_http_compress_level },
+	{ "http_compress_type",		configure_http_compress_type },
+	{ "http_cache_max",		configure_http_cache_max },
+	{ "http_cache_shared",		configure_http_cache_shared },
 	{ "http_hsts_enable",		configure_http_hsts_enable },
 	{ "http_keepalive_time",	configure_http_keepalive_time },
 	{ "http_request_limit",		configure_http_request_limit },
@@ -125,6 +151,8 @@ static struct {
 	{ "websocket_maxframe",		configure_websocket_maxframe },
 	{ "websocket_timeout",		configure_websocket_timeout },
 	{ "socket_backlog",		configure_socket_backlog },
+	{ "net_send_strategy",		configure_net_send_strategy },
+	{ "socket_reuseport",		configure_socket_reuseport },
 #if defined(KORE_USE_PGSQL)
 	{ "pgsql_conn_max",		configure_pgsql_conn_max },
 #endif
@@ -166,6 +194,8 @@ kore_parse_config(void)
 	if (getuid() != 0 && skip_runas == 0) {
 		fatal("cannot drop privileges, use -p to skip it");
 	}
+
+	kore_module_routes_build();
 }
 
 static void
@@ -295,6 +325,24 @@ configure_tls_version(char **argv)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_net_send_strategy(char **argv)
+{
+	if (argv[1] == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (!strcmp(argv[1], "write")) {
+		net_send_strategy = NET_SEND_WRITE;
+	} else if (!strcmp(argv[1], "writev")) {
+		net_send_strategy = NET_SEND_WRITEV;
+	} else {
+		printf("unknown value for net_send_strategy: %s\n", argv[1]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_tls_cipher(char **argv)
 {
@@ -412,6 +460,122 @@ configure_handler(char **argv)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_filemap(char **argv)
+{
+	if (current_domain == NULL) {
+		printf("missing domain for filemap\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (argv[1] == NULL || argv[2] == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (!kore_module_filemap_new(argv[1],
+	    current_domain->domain, argv[2], argv[3])) {
+		printf("cannot create filemap for %s\n", argv[1]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_body_stream(char **argv)
+{
+	struct kore_module_handle	*hdlr;
+
+	if (current_domain == NULL) {
+		printf("missing domain for body_stream\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (argv[1] == NULL)
+		return (KORE_RESULT_ERROR);
+
+	TAILQ_FOREACH(hdlr, &(current_domain->handlers), list) {
+		if (!strcmp(hdlr->path, argv[1])) {
+			hdlr->flags |= HANDLER_BODY_STREAM;
+			return (KORE_RESULT_OK);
+		}
+	}
+
+	printf("no handler for %s in body_stream\n", argv[1]);
+	return (KORE_RESULT_ERROR);
+}
+
+static int
+configure_compress(char **argv)
+{
+	struct kore_module_handle	*hdlr;
+
+	if (current_domain == NULL) {
+		printf("missing domain for compress\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (argv[1] == NULL)
+		return (KORE_RESULT_ERROR);
+
+	TAILQ_FOREACH(hdlr, &(current_domain->handlers), list) {
+		if (!strcmp(hdlr->path, argv[1])) {
+			hdlr->flags |= HANDLER_COMPRESS;
+			return (KORE_RESULT_OK);
+		}
+	}
+
+	printf("no handler for %s in compress\n", argv[1]);
+	return (KORE_RESULT_ERROR);
+}
+
+static int
+configure_cache(char **argv)
+{
+	int				i, err;
+	u_int32_t			ttl;
+	char				*vary[HANDLER_CACHE_VARY_MAX + 2];
+	struct kore_module_handle	*hdlr;
+
+	if (current_domain == NULL) {
+		printf("missing domain for cache\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (argv[1] == NULL || argv[2] == NULL)
+		return (KORE_RESULT_ERROR);
+
+	ttl = kore_strtonum(argv[2], 10, 1, UINT_MAX / 1000, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad cache ttl for %s: %s\n", argv[1], argv[2]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	TAILQ_FOREACH(hdlr, &(current_domain->handlers), list) {
+		if (strcmp(hdlr->path, argv[1]))
+			continue;
+
+		hdlr->flags |= HANDLER_CACHE;
+		hdlr->cache_ttl = ttl;
+
+		if (argv[3] == NULL)
+			return (KORE_RESULT_OK);
+
+		if (kore_split_string(argv[3], ",", vary,
+		    HANDLER_CACHE_VARY_MAX + 2) > HANDLER_CACHE_VARY_MAX) {
+			printf("too many headers in cache for %s\n", argv[1]);
+			return (KORE_RESULT_ERROR);
+		}
+
+		for (i = 0; vary[i] != NULL; i++)
+			hdlr->cache_vary[i] = kore_strdup(vary[i]);
+
+		return (KORE_RESULT_OK);
+	}
+
+	printf("no handler for %s in cache\n", argv[1]);
+	return (KORE_RESULT_ERROR);
+}
+
 static int
 configure_client_certificates(char **argv)
 {
@@ -624,6 +788,23 @@ configure_accept_threshold(char **argv)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_accept_budget(char **argv)
+{
+	int		err;
+
+	if (argv[1] == NULL)
+		return (KORE_RESULT_ERROR);
+
+	worker_accept_budget = kore_strtonum(argv[1], 0, 1, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for worker_accept_budget: %s\n", argv[1]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_set_affinity(char **argv)
 {
@@ -685,6 +866,116 @@ configure_http_body_max(char **argv)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_http_body_disk_offload(char **argv)
+{
+	int		err;
+
+	if (argv[1] == NULL)
+		return (KORE_RESULT_ERROR);
+
+	http_body_disk_offload = kore_strtonum(argv[1], 10, 0, LONG_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad http_body_disk_offload value: %s\n", argv[1]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_body_disk_path(char **argv)
+{
+	if (argv[1] == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (strcmp(http_body_disk_path, HTTP_BODY_DISK_PATH)) {
+		kore_debug("http_body_disk_path already set");
+		return (KORE_RESULT_ERROR);
+	}
+
+	http_body_disk_path = kore_strdup(argv[1]);
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_compress_min(char **argv)
+{
+	int		err;
+
+	if (argv[1] == NULL)
+		return (KORE_RESULT_ERROR);
+
+	http_compress_min = kore_strtonum(argv[1], 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad http_compress_min value: %s\n", argv[1]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_compress_level(char **argv)
+{
+	int		err;
+
+	if (argv[1] == NULL)
+		return (KORE_RESULT_ERROR);
+
+	http_compress_level = kore_strtonum(argv[1], 10, 1, 9, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad http_compress_level value: %s\n", argv[1]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_cache_max(char **argv)
+{
+	int		err;
+
+	if (argv[1] == NULL)
+		return (KORE_RESULT_ERROR);
+
+	http_cache_max = kore_strtonum(argv[1], 10, 0, LONG_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad http_cache_max value: %s\n", argv[1]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_cache_shared(char **argv)
+{
+	int		err;
+
+	if (argv[1] == NULL)
+		return (KORE_RESULT_ERROR);
+
+	http_cache_shared = kore_strtonum(argv[1], 10, 0, LONG_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad http_cache_shared value: %s\n", argv[1]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_compress_type(char **argv)
+{
+	if (argv[1] == NULL)
+		return (KORE_RESULT_ERROR);
+
+	http_compress_type_add(argv[1]);
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_http_hsts_enable(char **argv)
 {
@@ -844,7 +1135,7 @@ configure_validate(char **argv)
 	p->method = current_method;
 	p->name = kore_strdup(argv[1]);
 
-	TAILQ_INSERT_TAIL(&(current_handler->params), p, list);
+	kore_module_handler_param_add(current_handler, p);
 
 	return (KORE_RESULT_OK);
 }
@@ -1034,6 +1325,28 @@ configure_socket_backlog(char **argv)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_socket_reuseport(char **argv)
+{
+	int		err;
+
+	if (argv[1] == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (!LIST_EMPTY(&listeners)) {
+		printf("socket_reuseport must be set before any bind\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_socket_reuseport = kore_strtonum(argv[1], 10, 0, 1, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad socket_reuseport value: %s\n", argv[1]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 static void
 domain_sslstart(void)
 {
@@ -24,6 +24,16 @@
 #include "kore.h"
 #include "http.h"
 
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+#define KORE_USE_ACCEPT4	1
+#endif
+
+static int		connection_sockopts(int);
+static int		connection_accepted(struct connection *,
+			    struct connection **);
+static void		connection_idle_timeout(void *, u_int64_t);
+
+static u_int32_t		accept_budget = 0;
 struct kore_pool		connection_pool;
 struct connection_list		connections;
 struct connection_list		disconnected;
@@ -65,6 +75,7 @@ kore_connection_new(void *owner)
 	c->spdy_recv_wsize = SPDY_INIT_WSIZE;
 	c->idle_timer.start = 0;
 	c->idle_timer.length = KORE_IDLE_TIMER_MAX;
+	kore_timer_setup(&c->idle_timer.timer, connection_idle_timeout, c);
 
 	TAILQ_INIT(&(c->send_queue));
 	TAILQ_INIT(&(c->spdy_streams));
@@ -94,61 +105,116 @@ kore_connection_accept(struct listener *l, struct connection **out)
 		sin = (struct sockaddr *)&(c->addr.ipv6);
 	}
 
-	if ((c->fd = accept(l->fd, sin, &len)) == -1) {
+#if defined(KORE_USE_ACCEPT4)
+	c->fd = accept4(l->fd, sin, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	c->fd = accept(l->fd, sin, &len);
+#endif
+	if (c->fd == -1) {
 		kore_pool_put(&connection_pool, c);
-		kore_debug("accept(): %s", errno_s);
-		return (KORE_RESULT_ERROR);
+		switch (errno) {
+		case EINTR:
+		case EAGAIN:
+		case ECONNABORTED:
+			/* Nothing (left) to accept right now. */
+			return (KORE_RESULT_OK);
+		default:
+			kore_debug("accept(): %s", errno_s);
+			return (KORE_RESULT_ERROR);
+		}
 	}
 
-	if (!kore_connection_nonblock(c->fd, 1)) {
-		close(c->fd);
-		kore_pool_put(&connection_pool, c);
-		return (KORE_RESULT_ERROR);
-	}
+	return (connection_accepted(c, out));
+}
 
-#if !defined(KORE_NO_TLS)
-	c->state = CONN_STATE_SSL_SHAKE;
-	c->write = net_write_ssl;
-	c->read = net_read_ssl;
-#else
-	c->state = CONN_STATE_ESTABLISHED;
-	c->proto = CONN_PROTO_HTTP;
-	c->write = net_write;
-	c->read = net_read;
+/*
+ * Sets up a connection for fd, which was accepted on l by other means
+ * than kore_connection_accept(). The io_uring backend accepts on its
+ * ring and hands the descriptor and peer address over here.
+ */
+int
+kore_connection_adopt(struct listener *l, int fd, const void *addr,
+    struct connection **out)
+{
+	struct connection	*c;
 
-	if (http_keepalive_time != 0)
-		c->idle_timer.length = http_keepalive_time * 1000;
+	kore_debug("kore_connection_adopt(%p, %d)", l, fd);
 
-	net_recv_queue(c, http_header_max, NETBUF_CALL_CB_ALWAYS,
-	    http_header_recv);
-#endif
+	*out = NULL;
+	c = kore_connection_new(l);
 
-	TAILQ_INSERT_TAIL(&connections, c, list);
-	kore_connection_start_idletimer(c);
+	c->fd = fd;
+	c->addrtype = l->addrtype;
+	if (c->addrtype == AF_INET)
+		memcpy(&c->addr.ipv4, addr, sizeof(c->addr.ipv4));
+	else
+		memcpy(&c->addr.ipv6, addr, sizeof(c->addr.ipv6));
 
-	*out = c;
-	return (KORE_RESULT_OK);
+	return (connection_accepted(c, out));
 }
 
-void
-kore_connection_check_timeout(void)
+u_int32_t
+kore_connection_accept_batch(struct listener *l)
 {
 	struct connection	*c;
-	u_int64_t		now;
-
-	now = kore_time_ms();
-	TAILQ_FOREACH(c, &connections, list) {
-		if (c->proto == CONN_PROTO_MSG)
-			continue;
-		if (c->proto == CONN_PROTO_SPDY &&
-		    c->idle_timer.length == 0 &&
-		    !(c->flags & CONN_WRITE_BLOCK) &&
-		    !(c->flags & CONN_READ_BLOCK))
-			continue;
-		if (!(c->flags & CONN_IDLE_TIMER_ACT))
-			continue;
-		kore_connection_check_idletimer(now, c);
+	u_int32_t		count, budget;
+
+	budget = kore_connection_accept_budget();
+	kore_debug("kore_connection_accept_batch(%p): %u", l, budget);
+
+	for (count = 0; count < budget; count++) {
+		/* Report at least one so the accept lock gets released. */
+		if (!kore_connection_accept(l, &c))
+			return (MAX(count, 1));
+
+		if (c == NULL)
+			break;
+
+		kore_platform_event_all(c->fd, c);
+	}
+
+	/*
+	 * If we used up the entire accept budget there are likely more
+	 * clients waiting in the backlog, so allow a larger batch next
+	 * wakeup. Once the backlog drains again we shrink back towards
+	 * the configured minimum so a single worker does not hog new
+	 * connections in the quiet periods. A batch that was cut short
+	 * by free slots or the accept threshold says neither.
+	 */
+	if (worker_accept_budget != 0 && budget != 0) {
+		if (count == accept_budget) {
+			accept_budget = MIN(accept_budget * 2,
+			    worker_max_connections);
+		} else if (count < budget) {
+			accept_budget = MAX(accept_budget / 2,
+			    worker_accept_budget);
+		}
+	}
+
+	return (count);
+}
+
+/* How many connections may be accepted right now. */
+u_int32_t
+kore_connection_accept_budget(void)
+{
+	u_int32_t	budget;
+
+	if (worker_active_connections >= worker_max_connections)
+		return (0);
+
+	budget = worker_max_connections - worker_active_connections;
+
+	if (worker_accept_budget != 0) {
+		if (accept_budget == 0)
+			accept_budget = worker_accept_budget;
+		budget = MIN(budget, accept_budget);
 	}
+
+	if (worker_accept_threshold != 0)
+		budget = MIN(budget, worker_accept_threshold);
+
+	return (budget);
 }
 
 void
@@ -327,7 +393,20 @@ kore_connection_remove(struct connection *c)
 		X509_free(c->cert);
 #endif
 
+#if defined(KORE_USE_URING)
+	/*
+	 * Requests on the ring hold a reference to the socket, the close
+	 * only takes effect once their cancellation has been submitted.
+	 */
+	kore_uring_cancel(c->fd);
+#endif
+
 	close(c->fd);
+	kore_timer_cancel(&c->idle_timer.timer);
+
+	/* Only accepted connections have a listener as owner. */
+	if (c->owner != NULL)
+		worker_active_connections--;
 
 	if (c->hdlr_extra != NULL)
 		kore_mem_free(c->hdlr_extra);
@@ -347,18 +426,23 @@ kore_connection_remove(struct connection *c)
 	for (nb = TAILQ_FIRST(&(c->send_queue)); nb != NULL; nb = next) {
 		next = TAILQ_NEXT(nb, list);
 		TAILQ_REMOVE(&(c->send_queue), nb, list);
-		if (!(nb->flags & NETBUF_IS_STREAM)) {
-			kore_mem_free(nb->buf);
+		if (nb->type == NETBUF_SEND_FD) {
+			if (nb->buf != NULL)
+				net_buf_release(nb);
+			if (nb->cb != NULL)
+				(void)nb->cb(nb);
+			else
+				close(nb->fd);
+		} else if (!(nb->flags & NETBUF_IS_STREAM)) {
+			net_buf_release(nb);
 		} else if (nb->cb != NULL) {
 			(void)nb->cb(nb);
 		}
 		kore_pool_put(&nb_pool, nb);
 	}
 
-	if (c->rnb != NULL) {
-		kore_mem_free(c->rnb->buf);
-		kore_pool_put(&nb_pool, c->rnb);
-	}
+	if (c->rnb != NULL)
+		net_recv_free(c);
 
 	for (s = TAILQ_FIRST(&(c->spdy_streams)); s != NULL; s = snext) {
 		snext = TAILQ_NEXT(s, list);
@@ -388,16 +472,34 @@ kore_connection_check_idletimer(u_int64_t now, struct connection *c)
 			spdy_session_teardown(c, SPDY_SESSION_ERROR_OK);
 		else
 			kore_connection_disconnect(c);
+	} else {
+		kore_timer_schedule(&c->idle_timer.timer,
+		    c->idle_timer.start + c->idle_timer.length);
 	}
 }
 
 void
 kore_connection_start_idletimer(struct connection *c)
 {
+	u_int64_t	deadline;
+
 	kore_debug("kore_connection_start_idletimer(%p)", c);
 
+	if (c->proto == CONN_PROTO_MSG)
+		return;
+
 	c->flags |= CONN_IDLE_TIMER_ACT;
 	c->idle_timer.start = kore_time_ms();
+
+	/*
+	 * Restarting the idle timer happens on every event, so only touch
+	 * the wheel if the timer would fire too late. An early firing timer
+	 * is pushed out to the real deadline by connection_idle_timeout().
+	 */
+	deadline = c->idle_timer.start + c->idle_timer.length;
+	if (c->idle_timer.timer.slot == NULL ||
+	    c->idle_timer.timer.nextrun > deadline)
+		kore_timer_schedule(&c->idle_timer.timer, deadline);
 }
 
 void
@@ -438,3 +540,77 @@ kore_connection_nonblock(int fd, int nodelay)
 
 	return (KORE_RESULT_OK);
 }
+
+static int
+connection_sockopts(int fd)
+{
+	int		on;
+
+#if !defined(KORE_USE_ACCEPT4)
+	if (!kore_connection_nonblock(fd, 0))
+		return (KORE_RESULT_ERROR);
+#endif
+
+	on = 1;
+	if (setsockopt(fd, IPPROTO_TCP,
+	    TCP_NODELAY, (char *)&on, sizeof(on)) == -1) {
+		kore_log(LOG_NOTICE, "failed to set TCP_NODELAY on %d", fd);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/* The part of accepting a connection that follows accept(). */
+static int
+connection_accepted(struct connection *c, struct connection **out)
+{
+	if (!connection_sockopts(c->fd)) {
+		close(c->fd);
+		kore_pool_put(&connection_pool, c);
+		return (KORE_RESULT_ERROR);
+	}
+
+#if !defined(KORE_NO_TLS)
+	c->state = CONN_STATE_SSL_SHAKE;
+	c->write = net_write_ssl;
+	c->read = net_read_ssl;
+#else
+	c->state = CONN_STATE_ESTABLISHED;
+	c->proto = CONN_PROTO_HTTP;
+	c->write = net_write;
+	c->read = net_read;
+
+	if (http_keepalive_time != 0)
+		c->idle_timer.length = http_keepalive_time * 1000;
+
+	net_recv_queue(c, http_header_max, NETBUF_CALL_CB_ALWAYS,
+	    http_header_recv);
+#endif
+
+	worker_active_connections++;
+	TAILQ_INSERT_TAIL(&connections, c, list);
+	kore_connection_start_idletimer(c);
+
+	*out = c;
+	return (KORE_RESULT_OK);
+}
+
+static void
+connection_idle_timeout(void *arg, u_int64_t now)
+{
+	struct connection	*c = arg;
+
+	if (c->state == CONN_STATE_DISCONNECTING ||
+	    !(c->flags & CONN_IDLE_TIMER_ACT))
+		return;
+
+	/* SPDY sessions without an idle time only expire when stuck. */
+	if (c->proto == CONN_PROTO_SPDY && c->idle_timer.length == 0 &&
+	    !(c->flags & CONN_WRITE_BLOCK) && !(c->flags & CONN_READ_BLOCK)) {
+		kore_timer_schedule(&c->idle_timer.timer,
+		    now + KORE_IDLE_TIMER_MAX);
+		return;
+	}
+
+	kore_connection_check_idletimer(now, c);
+}
@@ -20,12 +20,26 @@
 
 #define SSL_SESSION_ID		"kore_ssl_sessionid"
 
+#define DOMAIN_TABLE_MIN	64
+
+struct domain_slot {
+	u_int32_t		hash;
+	struct kore_domain	*dom;
+};
+
 struct kore_domain_h		domains;
 struct kore_domain		*primary_dom = NULL;
 DH				*tls_dhparam = NULL;
 int				tls_version = KORE_TLS_VERSION_1_2;
 
 static void	domain_load_crl(struct kore_domain *);
+static void	domain_table_insert(struct kore_domain *);
+static struct kore_domain	*domain_table_find(u_int32_t, const char *,
+		    const char *);
+
+static struct domain_slot	*domain_table = NULL;
+static u_int32_t		domain_table_size = 0;
+static u_int32_t		domain_table_count = 0;
 
 #if !defined(KORE_NO_TLS)
 static int	domain_x509_verify(int, X509_STORE_CTX *);
@@ -35,14 +49,22 @@ void
 kore_domain_init(void)
 {
 	TAILQ_INIT(&domains);
+
+	domain_table_count = 0;
+	domain_table_size = DOMAIN_TABLE_MIN;
+	domain_table = kore_calloc(domain_table_size,
+	    sizeof(struct domain_slot));
+	memset(domain_table, 0, domain_table_size * sizeof(struct domain_slot));
 }
 
 int
 kore_domain_new(char *domain)
 {
+	u_int32_t		hash;
 	struct kore_domain	*dom;
 
-	if (kore_domain_lookup(domain) != NULL)
+	hash = kore_strhash(domain);
+	if (domain_table_find(hash, domain, NULL) != NULL)
 		return (KORE_RESULT_ERROR);
 
 	kore_debug("kore_domain_new(%s)", domain);
@@ -54,9 +76,11 @@ kore_domain_new(char *domain)
 	dom->ssl_ctx = NULL;
 	dom->certfile = NULL;
 	dom->crlfile = NULL;
+	dom->routes = NULL;
 	dom->domain = kore_strdup(domain);
 	TAILQ_INIT(&(dom->handlers));
 	TAILQ_INSERT_TAIL(&domains, dom, list);
+	domain_table_insert(dom);
 
 	if (primary_dom == NULL)
 		primary_dom = dom;
@@ -181,10 +205,22 @@ kore_domain_sslstart(struct kore_domain *dom)
 struct kore_domain *
 kore_domain_lookup(const char *domain)
 {
+	const char		*p;
 	struct kore_domain	*dom;
+	u_int32_t		hash, star;
+
+	hash = kore_strhash(domain);
+	if ((dom = domain_table_find(hash, domain, NULL)) != NULL)
+		return (dom);
 
-	TAILQ_FOREACH(dom, &domains, list) {
-		if (!strcmp(dom->domain, domain))
+	/*
+	 * No exact match, try "*.example.com" style entries from the
+	 * most to the least specific suffix of the requested name.
+	 */
+	star = kore_strhash("*");
+	for (p = strchr(domain, '.'); p != NULL; p = strchr(p + 1, '.')) {
+		hash = kore_strhash_seed(star, p);
+		if ((dom = domain_table_find(hash, "*", p)) != NULL)
 			return (dom);
 	}
 
@@ -272,3 +308,67 @@ domain_x509_verify(int ok, X509_STORE_CTX *ctx)
 	return (ok);
 }
 #endif
+
+static struct kore_domain *
+domain_table_find(u_int32_t hash, const char *name, const char *suffix)
+{
+	size_t			len;
+	u_int32_t		idx, mask;
+	struct domain_slot	*slot;
+
+	len = strlen(name);
+	mask = domain_table_size - 1;
+
+	for (idx = hash & mask;; idx = (idx + 1) & mask) {
+		slot = &domain_table[idx];
+		if (slot->dom == NULL)
+			return (NULL);
+		if (slot->hash != hash)
+			continue;
+
+		if (suffix == NULL) {
+			if (!strcmp(slot->dom->domain, name))
+				return (slot->dom);
+		} else {
+			if (!strncmp(slot->dom->domain, name, len) &&
+			    !strcmp(slot->dom->domain + len, suffix))
+				return (slot->dom);
+		}
+	}
+}
+
+static void
+domain_table_insert(struct kore_domain *dom)
+{
+	struct domain_slot	*old;
+	u_int32_t		i, idx, mask, size, hash;
+
+	if ((domain_table_count + 1) * 2 > domain_table_size) {
+		old = domain_table;
+		size = domain_table_size;
+
+		domain_table_size <<= 1;
+		domain_table = kore_calloc(domain_table_size,
+		    sizeof(struct domain_slot));
+		memset(domain_table, 0,
+		    domain_table_size * sizeof(struct domain_slot));
+
+		domain_table_count = 0;
+		for (i = 0; i < size; i++) {
+			if (old[i].dom != NULL)
+				domain_table_insert(old[i].dom);
+		}
+
+		kore_mem_free(old);
+	}
+
+	hash = kore_strhash(dom->domain);
+	mask = domain_table_size - 1;
+
+	for (idx = hash & mask; domain_table[idx].dom != NULL;)
+		idx = (idx + 1) & mask;
+
+	domain_table[idx].dom = dom;
+	domain_table[idx].hash = hash;
+	domain_table_count++;
+}
@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2015 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <limits.h>
+
+#include "kore.h"
+#include "http.h"
+
+#define FILEMAP_BUCKETS		256
+#define FILEMAP_CACHE_MAX	512
+#define FILEMAP_CHECK_MS	1000
+#define FILEMAP_INDEX		"index.html"
+
+#define FILEMAP_RANGE_NONE	0
+#define FILEMAP_RANGE_OK	1
+#define FILEMAP_RANGE_BAD	2
+
+/*
+ * An open file and what we know about it. Entries stay open between
+ * requests, every FILEMAP_CHECK_MS the path is stat()ed again and the
+ * entry is dropped if the file changed. Responses still sending from a
+ * dropped entry hold a reference, the fd is closed once they are done.
+ */
+struct filemap_entry {
+	char				*path;
+	u_int32_t			hash;
+	int				fd;
+	int				refs;
+	int				removed;
+	struct stat			st;
+	u_int64_t			checked;
+	const char			*type;
+	char				etag[48];
+	char				modified[32];
+
+	LIST_ENTRY(filemap_entry)	hlist;
+	TAILQ_ENTRY(filemap_entry)	lru;
+};
+
+static int	filemap_path(struct http_request *, char *, size_t);
+static int	filemap_range(struct http_request *, struct filemap_entry *,
+		    off_t *, u_int64_t *);
+static int	filemap_sent(struct netbuf *);
+static void	filemap_remove(struct filemap_entry *);
+static void	filemap_release(struct filemap_entry *);
+static void	filemap_free(struct filemap_entry *);
+static struct filemap_entry	*filemap_open(const char *);
+
+static struct {
+	const char		*ext;
+	const char		*type;
+} media_types[] = {
+	{ "html",	"text/html" },
+	{ "htm",	"text/html" },
+	{ "css",	"text/css" },
+	{ "txt",	"text/plain" },
+	{ "js",		"application/javascript" },
+	{ "json",	"application/json" },
+	{ "xml",	"application/xml" },
+	{ "pdf",	"application/pdf" },
+	{ "svg",	"image/svg+xml" },
+	{ "png",	"image/png" },
+	{ "jpg",	"image/jpeg" },
+	{ "jpeg",	"image/jpeg" },
+	{ "gif",	"image/gif" },
+	{ "ico",	"image/x-icon" },
+	{ "woff",	"application/font-woff" },
+	{ "mp4",	"video/mp4" },
+	{ "webm",	"video/webm" },
+	{ NULL,		NULL },
+};
+
+static LIST_HEAD(, filemap_entry)	filemap_buckets[FILEMAP_BUCKETS];
+static TAILQ_HEAD(filemap_entry_lru, filemap_entry)	filemap_lru;
+static u_int32_t			filemap_count = 0;
+
+struct http_filemap_stats		http_filemap_stats;
+
+void
+http_filemap_init(void)
+{
+	int		i;
+
+	for (i = 0; i < FILEMAP_BUCKETS; i++)
+		LIST_INIT(&filemap_buckets[i]);
+
+	TAILQ_INIT(&filemap_lru);
+	memset(&http_filemap_stats, 0, sizeof(http_filemap_stats));
+}
+
+void
+http_filemap_flush(void)
+{
+	struct filemap_entry	*f;
+
+	while ((f = TAILQ_FIRST(&filemap_lru)) != NULL)
+		filemap_remove(f);
+}
+
+/*
+ * The page handler for filemap entries. Serves the file below the
+ * handler its root that the rest of the path points to, plain
+ * connections get it straight from the page cache via sendfile().
+ */
+int
+http_filemap_serve(struct http_request *req)
+{
+	off_t			off;
+	u_int64_t		len;
+	int			status;
+	char			path[MAXPATHLEN], range[96];
+	struct filemap_entry	*f;
+
+	if (req->method != HTTP_METHOD_GET && req->method != HTTP_METHOD_HEAD) {
+		http_response_header(req, "allow", "GET, HEAD");
+		http_response(req, 405, NULL, 0);
+		return (KORE_RESULT_OK);
+	}
+
+	if (!filemap_path(req, path, sizeof(path)) ||
+	    (f = filemap_open(path)) == NULL) {
+		http_response(req, 404, NULL, 0);
+		return (KORE_RESULT_OK);
+	}
+
+	http_response_header(req, "last-modified", f->modified);
+	http_response_header(req, "etag", f->etag);
+	http_response_header(req, "accept-ranges", "bytes");
+
+	if (http_not_modified(req, f->etag, f->st.st_mtime)) {
+		http_response(req, 304, NULL, 0);
+		return (KORE_RESULT_OK);
+	}
+
+	off = 0;
+	len = f->st.st_size;
+	status = HTTP_STATUS_OK;
+
+	switch (filemap_range(req, f, &off, &len)) {
+	case FILEMAP_RANGE_NONE:
+		break;
+	case FILEMAP_RANGE_OK:
+		status = 206;
+		(void)snprintf(range, sizeof(range),
+		    "bytes %jd-%jd/%jd", (intmax_t)off,
+		    (intmax_t)(off + len - 1), (intmax_t)f->st.st_size);
+		http_response_header(req, "content-range", range);
+		break;
+	case FILEMAP_RANGE_BAD:
+		(void)snprintf(range, sizeof(range), "bytes */%jd",
+		    (intmax_t)f->st.st_size);
+		http_response_header(req, "content-range", range);
+		http_response(req, 416, NULL, 0);
+		return (KORE_RESULT_OK);
+	}
+
+	if (f->type != NULL)
+		http_response_header(req, "content-type", f->type);
+
+	f->refs++;
+	if (!http_response_fd_shared(req, status, f->fd, off, len,
+	    filemap_sent, f))
+		filemap_release(f);
+
+	return (KORE_RESULT_OK);
+}
+
+/* Looks up the media type for a file extension, NULL if unknown. */
+const char *
+http_media_type(const char *ext)
+{
+	int		i;
+
+	for (i = 0; media_types[i].ext != NULL; i++) {
+		if (!strcasecmp(media_types[i].ext, ext))
+			return (media_types[i].type);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Maps the request path onto the handler its root. No path segment may
+ * be "..", a path naming a directory gets its index file.
+ */
+static int
+filemap_path(struct http_request *req, char *out, size_t len)
+{
+	int		l;
+	const char	*rel, *p;
+
+	rel = req->path + strlen(req->hdlr->path);
+	while (*rel == '/')
+		rel++;
+
+	for (p = rel; *p != '\0'; p++) {
+		if ((p == rel || *(p - 1) == '/') && p[0] == '.' &&
+		    p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+			return (KORE_RESULT_ERROR);
+	}
+
+	if (*rel == '\0' || *(p - 1) == '/') {
+		l = snprintf(out, len, "%s/%s%s", req->hdlr->root, rel,
+		    FILEMAP_INDEX);
+	} else {
+		l = snprintf(out, len, "%s/%s", req->hdlr->root, rel);
+	}
+
+	if (l == -1 || (size_t)l >= len)
+		return (KORE_RESULT_ERROR);
+
+	return (KORE_RESULT_OK);
+}
+
+static struct filemap_entry *
+filemap_open(const char *path)
+{
+	int			fd;
+	u_int32_t		hash;
+	const char		*ext;
+	struct stat		st;
+	struct filemap_entry	*f;
+	char			*date;
+	u_int64_t		now;
+
+	hash = kore_strhash(path);
+	now = kore_time_ms();
+	LIST_FOREACH(f, &filemap_buckets[hash % FILEMAP_BUCKETS], hlist) {
+		if (f->hash == hash && !strcmp(f->path, path))
+			break;
+	}
+
+	if (f != NULL && now - f->checked >= FILEMAP_CHECK_MS) {
+		if (stat(path, &st) == -1 || st.st_ino != f->st.st_ino ||
+		    st.st_dev != f->st.st_dev || st.st_size != f->st.st_size ||
+		    st.st_mtime != f->st.st_mtime) {
+			http_filemap_stats.stale++;
+			filemap_remove(f);
+			f = NULL;
+		} else {
+			f->checked = now;
+		}
+	}
+
+	if (f != NULL) {
+		http_filemap_stats.hits++;
+		TAILQ_REMOVE(&filemap_lru, f, lru);
+		TAILQ_INSERT_HEAD(&filemap_lru, f, lru);
+		return (f);
+	}
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (NULL);
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return (NULL);
+	}
+
+	http_filemap_stats.opens++;
+	if (filemap_count >= FILEMAP_CACHE_MAX)
+		filemap_remove(TAILQ_LAST(&filemap_lru, filemap_entry_lru));
+
+	f = kore_malloc(sizeof(*f));
+	f->fd = fd;
+	f->st = st;
+	f->refs = 0;
+	f->hash = hash;
+	f->removed = 0;
+	f->checked = now;
+	f->path = kore_strdup(path);
+
+	f->type = NULL;
+	if ((ext = strrchr(path, '.')) != NULL && strchr(ext, '/') == NULL)
+		f->type = http_media_type(ext + 1);
+
+	(void)snprintf(f->etag, sizeof(f->etag), "\"%jx-%jx\"",
+	    (uintmax_t)st.st_mtime, (uintmax_t)st.st_size);
+
+	f->modified[0] = '\0';
+	if ((date = kore_time_to_date(st.st_mtime)) != NULL)
+		(void)kore_strlcpy(f->modified, date, sizeof(f->modified));
+
+	LIST_INSERT_HEAD(&filemap_buckets[hash % FILEMAP_BUCKETS], f, hlist);
+	TAILQ_INSERT_HEAD(&filemap_lru, f, lru);
+	filemap_count++;
+
+	return (f);
+}
+
+/*
+ * Only a single byte range is honoured, anything we do not understand
+ * gets the whole file as the RFC allows.
+ */
+static int
+filemap_range(struct http_request *req, struct filemap_entry *f,
+    off_t *off, u_int64_t *len)
+{
+	long long		first, last, size;
+	char			*range, *ifr, *dash;
+	int			r, err, match;
+
+	if (!http_request_header(req, "range", &range))
+		return (FILEMAP_RANGE_NONE);
+
+	r = FILEMAP_RANGE_NONE;
+	size = f->st.st_size;
+
+	if (strncmp(range, "bytes=", 6) || strchr(range, ',') != NULL ||
+	    (dash = strchr(range + 6, '-')) == NULL)
+		goto out;
+
+	/* A stale range must not be spliced into a newer file. */
+	if (http_request_header(req, "if-range", &ifr)) {
+		match = !strcmp(ifr, f->etag) || !strcmp(ifr, f->modified);
+		kore_mem_free(ifr);
+		if (!match)
+			goto out;
+	}
+
+	*dash = '\0';
+	if (range[6] == '\0') {
+		last = kore_strtonum(dash + 1, 10, 0, LLONG_MAX, &err);
+		if (err != KORE_RESULT_OK)
+			goto out;
+
+		if (last == 0) {
+			r = FILEMAP_RANGE_BAD;
+			goto out;
+		}
+
+		first = (last >= size) ? 0 : size - last;
+		last = size - 1;
+	} else {
+		first = kore_strtonum(range + 6, 10, 0, LLONG_MAX, &err);
+		if (err != KORE_RESULT_OK)
+			goto out;
+
+		if (dash[1] == '\0') {
+			last = size - 1;
+		} else {
+			last = kore_strtonum(dash + 1, 10, 0, LLONG_MAX, &err);
+			if (err != KORE_RESULT_OK || last < first)
+				goto out;
+			if (last >= size)
+				last = size - 1;
+		}
+	}
+
+	if (first >= size) {
+		r = FILEMAP_RANGE_BAD;
+		goto out;
+	}
+
+	*off = first;
+	*len = (last - first) + 1;
+	r = FILEMAP_RANGE_OK;
+
+out:
+	kore_mem_free(range);
+	return (r);
+}
+
+static int
+filemap_sent(struct netbuf *nb)
+{
+	filemap_release(nb->extra);
+	return (KORE_RESULT_OK);
+}
+
+static void
+filemap_remove(struct filemap_entry *f)
+{
+	LIST_REMOVE(f, hlist);
+	TAILQ_REMOVE(&filemap_lru, f, lru);
+	filemap_count--;
+
+	f->removed = 1;
+	if (f->refs == 0)
+		filemap_free(f);
+}
+
+static void
+filemap_release(struct filemap_entry *f)
+{
+	if (--f->refs == 0 && f->removed)
+		filemap_free(f);
+}
+
+static void
+filemap_free(struct filemap_entry *f)
+{
+	close(f->fd);
+	kore_mem_free(f->path);
+	kore_mem_free(f);
+}
@@ -17,6 +17,7 @@
 #include <sys/param.h>
 
 #include <ctype.h>
+#include <fcntl.h>
 #include <inttypes.h>
 
 #include "spdy.h"
@@ -31,36 +32,156 @@
 #include "tasks.h"
 #endif
 
+/* Status lines are kept for 100 up to 599. */
+#define HTTP_STATUS_LINES	500
+
 static int		http_body_recv(struct netbuf *);
+static int		http_body_chunked_recv(struct netbuf *);
+static int		http_body_chunked(struct http_request *,
+			    const u_int8_t *, size_t, size_t *);
+static void		http_body_fail(struct http_request *, int);
+static int		http_body_begin(struct http_request *, u_int64_t);
+static int		http_body_receiving(struct connection *);
+static int		http_body_spill(struct http_request *);
+static int		http_body_write(struct http_request *,
+			    const void *, size_t);
+static int		http_body_store(struct http_request *,
+			    const void *, size_t);
+static void		http_body_unblock(struct http_request *);
+static int		http_multipart_run(struct http_multipart *);
+static int		http_multipart_part(struct http_multipart *, char *);
+static int		http_multipart_emit(struct http_multipart *,
+			    const u_int8_t *, size_t);
+static int		http_multipart_form_begin(struct http_multipart *);
+static int		http_multipart_form_data(struct http_multipart *,
+			    const u_int8_t *, size_t);
+static int		http_multipart_form_end(struct http_multipart *);
+static u_int8_t		*http_body_load(struct http_request *,
+			    u_int32_t *);
+static int		http_request_busy(struct connection *);
+static void		http_pipeline_next(struct connection *);
 static void		http_error_response(struct connection *,
 			    struct spdy_stream *, int);
 static void		http_argument_add(struct http_request *, const char *,
 			    void *, u_int32_t, int);
+static struct http_arg	*http_argument_find(struct http_request *,
+			    const char *, u_int32_t);
 static void		http_file_add(struct http_request *, const char *,
 			    const char *, u_int8_t *, u_int32_t);
+static char		*http_request_strndup(struct http_request *,
+			    const char *, size_t);
+static int		http_arena_owns(struct http_request *, const void *);
+static void		http_arena_release(struct http_request *);
+static void		http_compress(struct http_request *, int,
+			    void **, u_int32_t *);
+static int		http_compress_accept(struct http_request *);
+static int		http_compress_type(struct http_request *);
+static int		http_compress_match(const char *, size_t,
+			    const char *, size_t);
+static z_stream		*http_compress_stream(int);
 static void		http_response_normal(struct http_request *,
-			    struct connection *, int, void *, u_int32_t);
+			    struct connection *, int, void *, u_int64_t);
 static void		http_response_spdy(struct http_request *,
 			    struct connection *, struct spdy_stream *,
-			    int, void *, u_int32_t);
+			    int, void *, u_int64_t);
+static void		http_response_init(void);
+static void		http_response_date(void);
+static void		http_response_append(const char *, const char *);
+static void		http_response_content_length(u_int64_t);
+
+struct multipart_form {
+	int			*count;
+	struct kore_buf		*part;
+};
 
 static struct kore_buf			*header_buf;
+static u_int32_t			http_pipelined = 0;
 static char				http_version[32];
 static u_int16_t			http_version_len;
 static char				http_version_spdy[32];
+
+/* Holds bytes read past a chunked body while its netbuf is reset. */
+static u_int8_t				http_body_tail[HTTP_BODY_CHUNK];
+
+/*
+ * Response header lines that only depend on the configuration are
+ * formatted once by http_response_init(), the date line once a second.
+ */
+struct http_status_line {
+	char			*line;
+	u_int32_t		len;
+};
+
+static struct http_status_line	http_status_lines[HTTP_STATUS_LINES];
+static char			http_keepalive_hdr[80];
+static u_int32_t		http_keepalive_hdr_len;
+static char			http_hsts_spdy[64];
+static char			http_hsts_hdr[96];
+static u_int32_t		http_hsts_hdr_len;
+static char			http_date_spdy[32];
+static char			http_date_hdr[48];
+static u_int32_t		http_date_hdr_len;
+static time_t			http_date_last = 0;
 static TAILQ_HEAD(, http_request)	http_requests;
 static TAILQ_HEAD(, http_request)	http_requests_sleeping;
 static struct kore_pool			http_request_pool;
-static struct kore_pool			http_header_pool;
 static struct kore_pool			http_host_pool;
 static struct kore_pool			http_path_pool;
 
+/*
+ * Request scoped memory comes from a bump arena that is released in one
+ * go by http_request_free(). Standard chunks are kept on a per-worker
+ * freelist, larger allocations get a chunk of their own.
+ */
+struct http_arena {
+	struct http_arena	*next;
+	size_t			size;
+	size_t			off;
+};
+
+#define HTTP_ARENA_CHUNK	4096
+#define HTTP_ARENA_SIZE		(HTTP_ARENA_CHUNK - sizeof(struct http_arena))
+#define HTTP_ARENA_LARGE	(HTTP_ARENA_SIZE / 4)
+#define HTTP_ARENA_FREE_MAX	256
+
+static struct http_arena		*http_arena_free = NULL;
+static u_int32_t			http_arena_free_count = 0;
+
+struct http_compress_type {
+	char				*type;
+	size_t				len;
+	TAILQ_ENTRY(http_compress_type)	list;
+};
+
+static TAILQ_HEAD(, http_compress_type)	http_compress_types =
+    TAILQ_HEAD_INITIALIZER(http_compress_types);
+
+/* Used when no http_compress_type was configured. */
+static const char *http_compress_defaults[] = {
+	"text/*",
+	"application/json",
+	"application/javascript",
+	"application/xml",
+	"image/svg+xml",
+	NULL
+};
+
+/* One stream per encoding per worker, reset for every response. */
+static z_stream				http_zstreams[HTTP_COMPRESS_MAX];
+static int				http_zstreams_ready[HTTP_COMPRESS_MAX];
+static u_int8_t				*http_zbuf = NULL;
+static size_t				http_zbuf_len = 0;
+
 int		http_request_count = 0;
 u_int32_t	http_request_limit = HTTP_REQUEST_LIMIT;
 u_int64_t	http_hsts_enable = HTTP_HSTS_ENABLE;
 u_int16_t	http_header_max = HTTP_HEADER_MAX_LEN;
 u_int16_t	http_keepalive_time = HTTP_KEEPALIVE_TIME;
 u_int64_t	http_body_max = HTTP_BODY_MAX_LEN;
+u_int64_t	http_body_disk_offload = 0;
+char		*http_body_disk_path = HTTP_BODY_DISK_PATH;
+u_int32_t	http_compress_min = HTTP_COMPRESS_MIN_LEN;
+int		http_compress_level = HTTP_COMPRESS_LEVEL;
 
 void
 http_init(void)
@@ -89,13 +210,15 @@ http_init(void)
 	prealloc = MIN((worker_max_connections / 10), 1000);
 	kore_pool_init(&http_request_pool, "http_request_pool",
 	    sizeof(struct http_request), prealloc);
-	kore_pool_init(&http_header_pool, "http_header_pool",
-	    sizeof(struct http_header), prealloc * HTTP_REQ_HEADER_MAX);
 
 	kore_pool_init(&http_host_pool,
 	    "http_host_pool", KORE_DOMAINNAME_LEN, prealloc);
 	kore_pool_init(&http_path_pool,
 	    "http_path_pool", HTTP_URI_LEN, prealloc);
+
+	http_response_init();
+	http_cache_init();
+	http_filemap_init();
 }
 
 int
@@ -104,8 +227,10 @@ http_request_new(struct connection *c, struct spdy_stream *s, const char *host,
     struct http_request **out)
 {
 	char				*p;
+	const char			*agent;
 	struct http_request		*req;
 	int				m, flags;
+	u_int32_t			alen;
 	size_t				hostlen, pathlen;
 
 	kore_debug("http_request_new(%p, %p, %s, %s, %s, %s)", c, s,
@@ -155,13 +280,23 @@ http_request_new(struct connection *c, struct spdy_stream *s, const char *host,
 	req->stream = s;
 	req->method = m;
 	req->hdlr = NULL;
+	req->route = NULL;
 	req->agent = NULL;
 	req->flags = flags;
 	req->fsm_state = 0;
+	req->hbuf = NULL;
+	req->hdr_count = 0;
+	req->hbuf_pool = NULL;
 	req->http_body = NULL;
+	req->http_body_fd = -1;
+	req->http_body_length = 0;
+	req->http_body_offset = 0;
+	req->http_body_received = 0;
+	req->http_chunk_state = 0;
+	req->http_chunk_left = 0;
 	req->hdlr_extra = NULL;
 	req->query_string = NULL;
-	req->multipart_body = NULL;
+	req->arena = NULL;
 
 	if ((p = strrchr(host, ':')) != NULL)
 		*p = '\0';
@@ -178,13 +313,15 @@ http_request_new(struct connection *c, struct spdy_stream *s, const char *host,
 		*(req->query_string)++ = '\0';
 
 	TAILQ_INIT(&(req->resp_headers));
-	TAILQ_INIT(&(req->req_headers));
-	TAILQ_INIT(&(req->arguments));
+	req->args = NULL;
+	req->args_mask = 0;
 	TAILQ_INIT(&(req->files));
 
 	if (s != NULL) {
-		if (!http_request_header(req, "user-agent", &(req->agent)))
-			req->agent = kore_strdup("unknown");
+		if (http_request_header_ref(req, "user-agent", &agent, &alen))
+			req->agent = http_request_strndup(req, agent, alen);
+		else
+			req->agent = http_request_strndup(req, "unknown", 7);
 	}
 
 #if defined(KORE_USE_TASKS)
@@ -236,33 +373,43 @@ http_process(void)
 	struct http_request		*req, *next;
 
 	count = 0;
-	for (req = TAILQ_FIRST(&http_requests); req != NULL; req = next) {
-		if (count >= http_request_limit)
-			break;
 
-		next = TAILQ_NEXT(req, list);
-		if (req->flags & HTTP_REQUEST_DELETE) {
-			http_request_free(req);
-			continue;
-		}
+	/*
+	 * Pipelined requests are parsed once the request before them is
+	 * done, without any network event to wake us up. Go around again
+	 * for those instead of leaving them until the next event.
+	 */
+	do {
+		http_pipelined = 0;
+		for (req = TAILQ_FIRST(&http_requests);
+		    req != NULL; req = next) {
+			if (count >= http_request_limit)
+				break;
+
+			next = TAILQ_NEXT(req, list);
+			if (req->flags & HTTP_REQUEST_DELETE) {
+				http_request_free(req);
+				continue;
+			}
 
-		/* Sleeping requests should be in http_requests_sleeping. */
-		if (req->flags & HTTP_REQUEST_SLEEPING)
-			fatal("http_process: sleeping request on list");
+			/* Sleeping requests belong on http_requests_sleeping. */
+			if (req->flags & HTTP_REQUEST_SLEEPING)
+				fatal("http_process: sleeping request on list");
 
-		if (!(req->flags & HTTP_REQUEST_COMPLETE))
-			continue;
+			if (!(req->flags & HTTP_REQUEST_COMPLETE))
+				continue;
 
-		count++;
-		http_process_request(req, 0);
-	}
+			count++;
+			http_process_request(req, 0);
+		}
+	} while (http_pipelined != 0 && count < http_request_limit);
 }
 
 void
 http_process_request(struct http_request *req, int retry_only)
 {
 	struct kore_module_handle	*hdlr;
-	int				r, (*cb)(struct http_request *);
+	int				r, first, (*cb)(struct http_request *);
 
 	kore_debug("http_process_request: %p->%p (%s)",
 	    req->owner, req, req->path);
@@ -272,6 +419,8 @@ http_process_request(struct http_request *req, int retry_only)
 
 	if (req->hdlr != NULL)
 		hdlr = req->hdlr;
+	else if (req->route != NULL)
+		hdlr = req->route;
 	else
 		hdlr = kore_module_handler_find(req->host, req->path);
 
@@ -286,7 +435,14 @@ http_process_request(struct http_request *req, int retry_only)
 
 		switch (r) {
 		case KORE_RESULT_OK:
+			first = (req->hdlr != hdlr);
 			req->hdlr = hdlr;
+
+			/* A cached response stands in for the handler. */
+			if (first && (hdlr->flags & HANDLER_CACHE) &&
+			    http_cache_lookup(req))
+				break;
+
 			cb = hdlr->addr;
 			worker->active_hdlr = hdlr;
 			r = cb(req);
@@ -330,6 +486,20 @@ http_process_request(struct http_request *req, int retry_only)
 		kore_accesslog(req);
 
 	req->flags |= HTTP_REQUEST_DELETE;
+
+	if (req->owner->proto == CONN_PROTO_HTTP)
+		http_pipeline_next(req->owner);
+}
+
+void
+http_compress_type_add(const char *type)
+{
+	struct http_compress_type	*ct;
+
+	ct = kore_malloc(sizeof(*ct));
+	ct->type = kore_strdup(type);
+	ct->len = strlen(type);
+	TAILQ_INSERT_TAIL(&http_compress_types, ct, list);
 }
 
 void
@@ -340,12 +510,63 @@ http_response_header(struct http_request *req,
 
 	kore_debug("http_response_header(%p, %s, %s)", req, header, value);
 
-	hdr = kore_pool_get(&http_header_pool);
-	hdr->header = kore_strdup(header);
-	hdr->value = kore_strdup(value);
+	hdr = http_request_alloc(req, sizeof(*hdr));
+	hdr->header = http_request_strndup(req, header, strlen(header));
+	hdr->value = http_request_strndup(req, value, strlen(value));
 	TAILQ_INSERT_TAIL(&(req->resp_headers), hdr, list);
 }
 
+/*
+ * Allocate memory that lives for as long as the request does. It is not
+ * zeroed and must not be passed to kore_mem_free(), it is released along
+ * with the request. A hdlr_extra allocated here is not freed twice.
+ */
+void *
+http_request_alloc(struct http_request *req, size_t len)
+{
+	u_int8_t		*p;
+	struct http_arena	*a;
+
+	len = (len + 7) & ~((size_t)7);
+
+	if (len > HTTP_ARENA_LARGE) {
+		a = kore_malloc(sizeof(*a) + len);
+		a->size = len;
+		a->off = len;
+
+		/* Keep the room left in the current chunk usable. */
+		if (req->arena != NULL) {
+			a->next = req->arena->next;
+			req->arena->next = a;
+		} else {
+			a->next = NULL;
+			req->arena = a;
+		}
+
+		return (a + 1);
+	}
+
+	if (req->arena == NULL || req->arena->size - req->arena->off < len) {
+		if ((a = http_arena_free) != NULL) {
+			http_arena_free = a->next;
+			http_arena_free_count--;
+		} else {
+			a = kore_malloc(HTTP_ARENA_CHUNK);
+			a->size = HTTP_ARENA_SIZE;
+		}
+
+		a->off = 0;
+		a->next = req->arena;
+		req->arena = a;
+	}
+
+	a = req->arena;
+	p = (u_int8_t *)(a + 1) + a->off;
+	a->off += len;
+
+	return (p);
+}
+
 void
 http_request_free(struct http_request *req)
 {
@@ -356,9 +577,7 @@ http_request_free(struct http_request *req)
 #if defined(KORE_USE_PGSQL)
 	struct kore_pgsql	*pgsql;
 #endif
-	struct http_file	*f, *fnext;
-	struct http_arg		*q, *qnext;
-	struct http_header	*hdr, *next;
+	struct http_file	*f;
 
 #if defined(KORE_USE_TASKS)
 	pending_tasks = 0;
@@ -398,58 +617,32 @@ http_request_free(struct http_request *req)
 	TAILQ_REMOVE(&http_requests, req, list);
 	TAILQ_REMOVE(&(req->owner->http_requests), req, olist);
 
-	for (hdr = TAILQ_FIRST(&(req->resp_headers)); hdr != NULL; hdr = next) {
-		next = TAILQ_NEXT(hdr, list);
-
-		TAILQ_REMOVE(&(req->resp_headers), hdr, list);
-		kore_mem_free(hdr->header);
-		kore_mem_free(hdr->value);
-		kore_pool_put(&http_header_pool, hdr);
-	}
-
-	for (hdr = TAILQ_FIRST(&(req->req_headers)); hdr != NULL; hdr = next) {
-		next = TAILQ_NEXT(hdr, list);
-
-		TAILQ_REMOVE(&(req->req_headers), hdr, list);
-		kore_mem_free(hdr->header);
-		kore_mem_free(hdr->value);
-		kore_pool_put(&http_header_pool, hdr);
-	}
-
-	for (q = TAILQ_FIRST(&(req->arguments)); q != NULL; q = qnext) {
-		qnext = TAILQ_NEXT(q, list);
-
-		TAILQ_REMOVE(&(req->arguments), q, list);
-		kore_mem_free(q->name);
-
-		if (q->value != NULL)
-			kore_mem_free(q->value);
-		if (q->s_value != NULL)
-			kore_mem_free(q->s_value);
-
-		kore_mem_free(q);
+	if (req->hbuf != NULL) {
+		if (req->hbuf_pool != NULL)
+			kore_pool_put(req->hbuf_pool, req->hbuf);
+		else
+			kore_mem_free(req->hbuf);
 	}
 
-	for (f = TAILQ_FIRST(&(req->files)); f != NULL; f = fnext) {
-		fnext = TAILQ_NEXT(f, list);
-		TAILQ_REMOVE(&(req->files), f, list);
+	TAILQ_FOREACH(f, &(req->files), list)
+		kore_mem_free(f->data);
 
-		kore_mem_free(f->filename);
-		kore_mem_free(f->name);
-		kore_mem_free(f);
-	}
+	/* The handler is done before its streamed body came in. */
+	if (http_body_receiving(req->owner) && req->owner->rnb->extra == req)
+		req->owner->rnb->extra = NULL;
 
 	if (req->http_body != NULL)
 		kore_buf_free(req->http_body);
-	if (req->multipart_body != NULL)
-		kore_mem_free(req->multipart_body);
+	if (req->http_body_fd != -1)
+		(void)close(req->http_body_fd);
 
-	if (req->agent != NULL)
-		kore_mem_free(req->agent);
 	if (req->hdlr_extra != NULL &&
-	    !(req->flags & HTTP_REQUEST_RETAIN_EXTRA))
+	    !(req->flags & HTTP_REQUEST_RETAIN_EXTRA) &&
+	    !http_arena_owns(req, req->hdlr_extra))
 		kore_mem_free(req->hdlr_extra);
 
+	http_arena_release(req);
+
 	kore_pool_put(&http_request_pool, req);
 	http_request_count--;
 }
@@ -461,6 +654,14 @@ http_response(struct http_request *req, int status, void *d, u_int32_t l)
 
 	req->status = status;
 
+	/* A cache hit was compressed, if at all, before it was stored. */
+	if (req->hdlr != NULL && (req->hdlr->flags & HANDLER_COMPRESS) &&
+	    !(req->flags & HTTP_REQUEST_CACHE_HIT))
+		http_compress(req, status, &d, &l);
+
+	if (req->flags & HTTP_REQUEST_CACHE_STORE)
+		http_cache_store(req, status, d, l);
+
 	switch (req->owner->proto) {
 	case CONN_PROTO_SPDY:
 		http_response_spdy(req, req->owner, req->stream, status, d, l);
@@ -502,54 +703,290 @@ http_response_stream(struct http_request *req, int status, void *base,
 	}
 }
 
+void
+http_response_fd(struct http_request *req, int status, int fd, off_t off,
+    u_int64_t len)
+{
+	if (!http_response_fd_shared(req, status, fd, off, len, NULL, NULL))
+		close(fd);
+}
+
+/*
+ * Send len bytes of fd from off without taking ownership of fd. Returns 1
+ * if the file was queued, cb is then called with arg in nb->extra once
+ * the connection no longer needs fd. Returns 0 if no body was sent.
+ */
+int
+http_response_fd_shared(struct http_request *req, int status, int fd,
+    off_t off, u_int64_t len, int (*cb)(struct netbuf *), void *arg)
+{
+	struct netbuf		*nb;
+
+	req->status = status;
+
+	switch (req->owner->proto) {
+	case CONN_PROTO_SPDY:
+		http_response_spdy(req, req->owner,
+		    req->stream, status, NULL, len);
+		break;
+	case CONN_PROTO_HTTP:
+		http_response_normal(req, req->owner, status, NULL, len);
+		break;
+	default:
+		fatal("http_response_fd_shared() bad proto %d",
+		    req->owner->proto);
+		/* NOTREACHED. */
+	}
+
+	if (req->method == HTTP_METHOD_HEAD || len == 0)
+		return (0);
+
+	net_send_fd(req->owner, fd, off, len, req->stream, cb, &nb);
+	nb->extra = arg;
+
+	return (1);
+}
+
+/*
+ * Start a response of unknown length. The body is sent with
+ * http_response_chunked_append() using chunked transfer-encoding on
+ * HTTP/1.1 and as data frames on SPDY, the connection stays usable
+ * afterwards. The handler may return KORE_RESULT_RETRY in between
+ * appends to produce the body over several calls, and must call
+ * http_response_chunked_end() before it returns KORE_RESULT_OK.
+ */
+void
+http_response_chunked_begin(struct http_request *req, int status)
+{
+	req->status = status;
+	req->flags |= HTTP_REQUEST_CHUNKED;
+
+	switch (req->owner->proto) {
+	case CONN_PROTO_SPDY:
+		req->stream->flags |= SPDY_NO_CLOSE;
+		http_response_spdy(req, req->owner,
+		    req->stream, status, NULL, 0);
+		break;
+	case CONN_PROTO_HTTP:
+		req->flags |= HTTP_REQUEST_NO_CONTENT_LENGTH;
+		http_response_header(req, "transfer-encoding", "chunked");
+		http_response_normal(req, req->owner, status, NULL, 0);
+		break;
+	default:
+		fatal("http_response_chunked_begin() bad proto %d",
+		    req->owner->proto);
+		/* NOTREACHED. */
+	}
+}
+
+void
+http_response_chunked_append(struct http_request *req, const void *d,
+    size_t len)
+{
+	int			l;
+	char			hex[32];
+	struct spdy_stream	*s = req->stream;
+
+	if (!(req->flags & HTTP_REQUEST_CHUNKED))
+		fatal("http_response_chunked_append() without begin");
+
+	/* A zero length chunk would end the body. */
+	if (len == 0 || req->method == HTTP_METHOD_HEAD)
+		return;
+
+	switch (req->owner->proto) {
+	case CONN_PROTO_SPDY:
+		if (s == NULL)
+			return;
+		if (s->send_size == 0)
+			s->flags |= SPDY_DATAFRAME_PRELUDE;
+		s->send_size += len;
+		net_send_queue(req->owner, d, len, s, NETBUF_LAST_CHAIN);
+		break;
+	case CONN_PROTO_HTTP:
+		if (!kore_snprintf(hex, sizeof(hex), &l, "%zx\r\n", len))
+			fatal("http_response_chunked_append(): snprintf");
+		net_send_queue_hint(req->owner, hex, l, l + len + 2,
+		    NULL, NETBUF_LAST_CHAIN);
+		net_send_queue(req->owner, d, len, NULL, NETBUF_LAST_CHAIN);
+		net_send_queue(req->owner, "\r\n", 2, NULL, NETBUF_LAST_CHAIN);
+		break;
+	default:
+		fatal("http_response_chunked_append() bad proto %d",
+		    req->owner->proto);
+		/* NOTREACHED. */
+	}
+
+	/* Get it on the wire now, not when the handler is done. */
+	if (!net_send_flush(req->owner))
+		kore_connection_disconnect(req->owner);
+}
+
+void
+http_response_chunked_end(struct http_request *req)
+{
+	struct spdy_stream	*s = req->stream;
+
+	if (!(req->flags & HTTP_REQUEST_CHUNKED))
+		fatal("http_response_chunked_end() without begin");
+
+	req->flags &= ~HTTP_REQUEST_CHUNKED;
+
+	switch (req->owner->proto) {
+	case CONN_PROTO_SPDY:
+		if (s == NULL)
+			return;
+
+		/* The last data frame going out closes the stream. */
+		s->flags &= ~SPDY_NO_CLOSE;
+		if (s->send_size == 0) {
+			spdy_frame_send(req->owner,
+			    SPDY_DATA_FRAME, FLAG_FIN, 0, s, 0);
+			spdy_stream_close(req->owner, s, SPDY_KEEP_NETBUFS);
+		}
+		break;
+	case CONN_PROTO_HTTP:
+		if (req->method != HTTP_METHOD_HEAD) {
+			net_send_queue(req->owner, "0\r\n\r\n", 5,
+			    NULL, NETBUF_LAST_CHAIN);
+		}
+		break;
+	default:
+		fatal("http_response_chunked_end() bad proto %d",
+		    req->owner->proto);
+		/* NOTREACHED. */
+	}
+}
+
+/*
+ * Sends an asset built in by kore build. The gzip variant goes to clients
+ * that accept it, a matching if-none-match gets a 304 instead.
+ */
+void
+http_response_asset(struct http_request *req, const struct http_asset *asset)
+{
+	int		gzip;
+
+	gzip = 0;
+	if (asset->gz_data != NULL) {
+		if (!(req->hdlr->flags & HANDLER_COMPRESS))
+			http_response_header(req, "vary", "accept-encoding");
+		if (http_compress_accept(req) & (1 << HTTP_COMPRESS_GZIP))
+			gzip = 1;
+	}
+
+	http_response_header(req, "etag", gzip ? asset->gz_etag : asset->etag);
+
+	if (http_etag_match(req, asset->etag) ||
+	    http_etag_match(req, asset->gz_etag)) {
+		http_response(req, 304, NULL, 0);
+		return;
+	}
+
+	if (asset->type != NULL)
+		http_response_header(req, "content-type", asset->type);
+
+	if (gzip) {
+		http_response_header(req, "content-encoding", "gzip");
+		http_response(req, 200, asset->gz_data, asset->gz_len);
+	} else {
+		http_response(req, 200, asset->data, asset->len);
+	}
+}
+
 int
 http_request_header(struct http_request *req, const char *header, char **out)
 {
-	int			r;
-	struct http_header	*hdr;
+	const char		*value;
+	u_int32_t		len;
+
+	if (!http_request_header_ref(req, header, &value, &len))
+		return (KORE_RESULT_ERROR);
+
+	*out = kore_malloc(len + 1);
+	memcpy(*out, value, len);
+	(*out)[len] = '\0';
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Look up a request header without copying it, the value is only valid
+ * for as long as the request is and is not NUL-terminated.
+ */
+int
+http_request_header_ref(struct http_request *req, const char *header,
+    const char **out, u_int32_t *len)
+{
+	u_int8_t		i;
+	size_t			hlen;
+	struct http_header_ref	*hdr;
 
 	if (req->owner->proto == CONN_PROTO_SPDY) {
-		r = spdy_stream_get_header(req->stream->hblock, header, out);
-	} else {
-		TAILQ_FOREACH(hdr, &(req->req_headers), list) {
-			if (!strcasecmp(hdr->header, header)) {
-				r = strlen(hdr->value) + 1;
-				*out = kore_malloc(r);
-				kore_strlcpy(*out, hdr->value, r);
-				return (KORE_RESULT_OK);
-			}
-		}
+		return (spdy_stream_header_ref(req->stream->hblock,
+		    header, out, len));
+	}
 
-		r = KORE_RESULT_ERROR;
+	hlen = strlen(header);
+	for (i = 0; i < req->hdr_count; i++) {
+		hdr = &req->hdrs[i];
+		if (hdr->name_len != hlen ||
+		    strncasecmp((char *)req->hbuf + hdr->name, header, hlen))
+			continue;
+
+		*out = (const char *)req->hbuf + hdr->value;
+		*len = hdr->value_len;
+		return (KORE_RESULT_OK);
 	}
 
-	return (r);
+	return (KORE_RESULT_ERROR);
 }
 
 int
 http_header_recv(struct netbuf *nb)
 {
-	size_t			len;
-	u_int64_t		clen;
-	struct http_header	*hdr;
-	struct http_request	*req;
-	u_int8_t		*end_headers;
-	int			h, i, v, skip, bytes_left;
-	char			*request[4], *host[3], *hbuf;
-	char			*p, *headers[HTTP_REQ_HEADER_MAX];
-	struct connection	*c = (struct connection *)nb->owner;
+	size_t				len, used;
+	u_int64_t			clen;
+	const char			*value;
+	struct http_header_ref		*hdr;
+	struct http_request		*req;
+	u_int8_t			*end_headers;
+	u_int32_t			total, vlen;
+	int				h, i, v, skip, bytes_left;
+	char				*request[4], *host[3], *hbuf;
+	char				*p, *headers[HTTP_REQ_HEADER_MAX];
+	char				num[32];
+	struct connection		*c = (struct connection *)nb->owner;
 
 	kore_debug("http_header_recv(%p)", nb);
 
 	if (nb->b_len < 4)
 		return (KORE_RESULT_OK);
 
+	/*
+	 * A pipelined request, keep its bytes until the response for the
+	 * current one was queued. Stop reading once the buffer is full,
+	 * http_pipeline_next() picks up from here.
+	 */
+	if (http_request_busy(c)) {
+		if (nb->s_off == nb->b_len) {
+			c->flags |= CONN_READ_BLOCK;
+			c->flags &= ~CONN_READ_POSSIBLE;
+		}
+		return (KORE_RESULT_OK);
+	}
+
+	/* Only look at what came in since the last partial read. */
 	skip = 4;
-	end_headers = kore_mem_find(nb->buf, nb->s_off, "\r\n\r\n", 4);
+	end_headers = kore_mem_find(nb->buf + nb->scan_off,
+	    nb->s_off - nb->scan_off, "\r\n\r\n", 4);
 	if (end_headers == NULL) {
-		end_headers = kore_mem_find(nb->buf, nb->s_off, "\n\n", 2);
-		if (end_headers == NULL)
+		end_headers = kore_mem_find(nb->buf + nb->scan_off,
+		    nb->s_off - nb->scan_off, "\n\n", 2);
+		if (end_headers == NULL) {
+			nb->scan_off = (nb->s_off > 3) ? nb->s_off - 3 : 0;
 			return (KORE_RESULT_OK);
+		}
 		skip = 2;
 	}
 
@@ -603,6 +1040,19 @@ http_header_recv(struct netbuf *nb)
 	    request[0], request[1], request[2], &req))
 		return (KORE_RESULT_OK);
 
+	/*
+	 * Look the handler up once, the body setup needs it before the
+	 * request runs. It only becomes req->hdlr after authentication.
+	 */
+	req->route = kore_module_handler_find(req->host, req->path);
+
+	/*
+	 * The request keeps the receive buffer, its headers point into it.
+	 * Pipelined bytes are handed back to the connection further down.
+	 */
+	total = nb->s_off;
+	req->hbuf = net_recv_detach(c, &req->hbuf_pool);
+
 	for (i = 1; i < h; i++) {
 		if (i == skip)
 			continue;
@@ -613,42 +1063,81 @@ http_header_recv(struct netbuf *nb)
 			continue;
 		}
 
+		hdr = &req->hdrs[req->hdr_count++];
+		hdr->name = headers[i] - hbuf;
+		hdr->name_len = p - headers[i];
+
 		*(p++) = '\0';
 		if (*p == ' ')
 			p++;
-		hdr = kore_pool_get(&http_header_pool);
-		hdr->header = kore_strdup(headers[i]);
-		hdr->value = kore_strdup(p);
-		TAILQ_INSERT_TAIL(&(req->req_headers), hdr, list);
+
+		hdr->value = p - hbuf;
+		hdr->value_len = strlen(p);
 
 		if (req->agent == NULL &&
-		    !strcasecmp(hdr->header, "user-agent"))
-			req->agent = kore_strdup(hdr->value);
+		    !strcasecmp(headers[i], "user-agent"))
+			req->agent = http_request_strndup(req, p, strlen(p));
 	}
 
-	if (req->flags & HTTP_REQUEST_EXPECT_BODY) {
-		if (!http_request_header(req, "content-length", &p)) {
+	if ((req->flags & HTTP_REQUEST_EXPECT_BODY) &&
+	    http_request_header_ref(req, "transfer-encoding", &value, &vlen)) {
+		/* Takes precedence over any content-length that was sent. */
+		if (vlen != 7 || strncasecmp(value, "chunked", 7)) {
+			kore_debug("transfer-encoding unsupported: %.*s",
+			    (int)vlen, value);
+			http_body_fail(req, 501);
+			return (KORE_RESULT_OK);
+		}
+
+		if (!http_body_begin(req, 0)) {
+			req->flags |= HTTP_REQUEST_DELETE;
+			http_error_response(req->owner, NULL, 500);
+			return (KORE_RESULT_OK);
+		}
+
+		req->http_chunk_state = HTTP_CHUNK_SIZE;
+		h = http_body_chunked(req, end_headers, total - len, &used);
+		if (h != 0) {
+			http_body_fail(req, h);
+			return (KORE_RESULT_OK);
+		}
+
+		len += used;
+		if (req->flags & HTTP_REQUEST_EXPECT_BODY) {
+			net_recv_reset(c, HTTP_BODY_CHUNK,
+			    http_body_chunked_recv);
+			c->rnb->extra = req;
+			c->rnb->flags |= NETBUF_CALL_CB_ALWAYS;
+			return (KORE_RESULT_OK);
+		}
+	} else if (req->flags & HTTP_REQUEST_EXPECT_BODY) {
+		if (!http_request_header_ref(req, "content-length",
+		    &value, &vlen)) {
 			kore_debug("expected body but no content-length");
 			req->flags |= HTTP_REQUEST_DELETE;
 			http_error_response(req->owner, NULL, 411);
 			return (KORE_RESULT_OK);
 		}
 
-		clen = kore_strtonum(p, 10, 0, LONG_MAX, &v);
+		v = KORE_RESULT_ERROR;
+		if (vlen < sizeof(num)) {
+			memcpy(num, value, vlen);
+			num[vlen] = '\0';
+			clen = kore_strtonum(num, 10, 0, LONG_MAX, &v);
+		}
+
 		if (v == KORE_RESULT_ERROR) {
-			kore_debug("content-length invalid: %s", p);
-			kore_mem_free(p);
+			kore_debug("content-length invalid: %.*s",
+			    (int)vlen, value);
 			req->flags |= HTTP_REQUEST_DELETE;
 			http_error_response(req->owner, NULL, 411);
 			return (KORE_RESULT_OK);
 		}
 
-		kore_mem_free(p);
-
 		if (clen == 0) {
 			req->flags |= HTTP_REQUEST_COMPLETE;
 			req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
-			return (KORE_RESULT_OK);
+			goto done;
 		}
 
 		if (clen > http_body_max) {
@@ -659,26 +1148,43 @@ http_header_recv(struct netbuf *nb)
 			return (KORE_RESULT_OK);
 		}
 
-		req->http_body = kore_buf_create(clen);
-		kore_buf_append(req->http_body, end_headers,
-		    (nb->s_off - len));
+		if (!http_body_begin(req, clen)) {
+			req->flags |= HTTP_REQUEST_DELETE;
+			http_error_response(req->owner, NULL, 500);
+			return (KORE_RESULT_OK);
+		}
+
+		/* Anything past the body belongs to the next request. */
+		skip = MIN(clen, total - len);
+		req->http_body_length = clen;
+
+		if (!http_body_store(req, end_headers, skip)) {
+			req->flags |= HTTP_REQUEST_DELETE;
+			http_error_response(req->owner, NULL, 500);
+			return (KORE_RESULT_OK);
+		}
 
-		bytes_left = clen - (nb->s_off - len);
+		len += skip;
+		bytes_left = clen - skip;
 		if (bytes_left > 0) {
 			kore_debug("%ld/%ld (%ld - %ld) more bytes for body",
-			    bytes_left, clen, nb->s_off, len);
-			net_recv_reset(c, bytes_left, http_body_recv);
+			    bytes_left, clen, total, len);
+			net_recv_reset(c, MIN(bytes_left, HTTP_BODY_CHUNK),
+			    http_body_recv);
 			c->rnb->extra = req;
-			c->rnb->flags &= ~NETBUF_CALL_CB_ALWAYS;
-		} else if (bytes_left == 0) {
-			req->flags |= HTTP_REQUEST_COMPLETE;
-			req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
-		} else {
-			kore_debug("bytes_left would become zero (%ld)", clen);
-			http_error_response(req->owner, NULL, 500);
+			c->rnb->flags |= NETBUF_CALL_CB_ALWAYS;
+			return (KORE_RESULT_OK);
 		}
+
+		req->flags |= HTTP_REQUEST_COMPLETE;
+		req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
 	}
 
+done:
+	/* Pipelined bytes go back to the connection for the next request. */
+	if (total > len)
+		net_recv_fill(c, req->hbuf + len, total - len);
+
 	return (KORE_RESULT_OK);
 }
 
@@ -690,7 +1196,7 @@ http_populate_arguments(struct http_request *req)
 	char			*query, *args[HTTP_MAX_QUERY_ARGS], *val[3];
 
 	if (req->method == HTTP_METHOD_POST) {
-		if (req->http_body == NULL)
+		if (req->http_body == NULL && req->http_body_fd == -1)
 			return (0);
 		query = http_body_text(req);
 	} else {
@@ -729,49 +1235,44 @@ http_argument_get(struct http_request *req, const char *name,
 	if (len != NULL)
 		*len = 0;
 
-	TAILQ_FOREACH(q, &(req->arguments), list) {
-		if (!strcmp(q->name, name)) {
-			switch (type) {
-			case HTTP_ARG_TYPE_RAW:
-				if (len != NULL)
-					*len = q->len;
-				*out = q->value;
-				return (KORE_RESULT_OK);
-			case HTTP_ARG_TYPE_BYTE:
-				COPY_ARG_TYPE(*(u_int8_t *)q->value,
-				    len, u_int8_t);
-				return (KORE_RESULT_OK);
-			case HTTP_ARG_TYPE_INT16:
-				COPY_AS_INTTYPE(SHRT_MIN, SHRT_MAX, int16_t);
-				return (KORE_RESULT_OK);
-			case HTTP_ARG_TYPE_UINT16:
-				COPY_AS_INTTYPE(0, USHRT_MAX, u_int16_t);
-				return (KORE_RESULT_OK);
-			case HTTP_ARG_TYPE_INT32:
-				COPY_AS_INTTYPE(INT_MIN, INT_MAX, int32_t);
-				return (KORE_RESULT_OK);
-			case HTTP_ARG_TYPE_UINT32:
-				COPY_AS_INTTYPE(0, UINT_MAX, u_int32_t);
-				return (KORE_RESULT_OK);
-			case HTTP_ARG_TYPE_INT64:
-				COPY_AS_INTTYPE_64(int64_t, 1);
-				return (KORE_RESULT_OK);
-			case HTTP_ARG_TYPE_UINT64:
-				COPY_AS_INTTYPE_64(u_int64_t, 0);
-				return (KORE_RESULT_OK);
-			case HTTP_ARG_TYPE_STRING:
-				CACHE_STRING();
-				*out = q->s_value;
-				if (len != NULL)
-					*len = q->s_len - 1;
-				return (KORE_RESULT_OK);
-			default:
-				return (KORE_RESULT_ERROR);
-			}
-		}
-	}
+	if ((q = http_argument_find(req, name, kore_strhash(name))) == NULL)
+		return (KORE_RESULT_ERROR);
 
-	return (KORE_RESULT_ERROR);
+	switch (type) {
+	case HTTP_ARG_TYPE_RAW:
+		if (len != NULL)
+			*len = q->len;
+		*out = q->value;
+		return (KORE_RESULT_OK);
+	case HTTP_ARG_TYPE_BYTE:
+		COPY_ARG_TYPE(*(u_int8_t *)q->value, len, u_int8_t);
+		return (KORE_RESULT_OK);
+	case HTTP_ARG_TYPE_INT16:
+		COPY_AS_INTTYPE(SHRT_MIN, SHRT_MAX, int16_t);
+		return (KORE_RESULT_OK);
+	case HTTP_ARG_TYPE_UINT16:
+		COPY_AS_INTTYPE(0, USHRT_MAX, u_int16_t);
+		return (KORE_RESULT_OK);
+	case HTTP_ARG_TYPE_INT32:
+		COPY_AS_INTTYPE(INT_MIN, INT_MAX, int32_t);
+		return (KORE_RESULT_OK);
+	case HTTP_ARG_TYPE_UINT32:
+		COPY_AS_INTTYPE(0, UINT_MAX, u_int32_t);
+		return (KORE_RESULT_OK);
+	case HTTP_ARG_TYPE_INT64:
+		COPY_AS_INTTYPE_64(int64_t, 1);
+		return (KORE_RESULT_OK);
+	case HTTP_ARG_TYPE_UINT64:
+		COPY_AS_INTTYPE_64(u_int64_t, 0);
+		return (KORE_RESULT_OK);
+	case HTTP_ARG_TYPE_STRING:
+		*out = q->value;
+		if (len != NULL)
+			*len = q->len;
+		return (KORE_RESULT_OK);
+	default:
+		return (KORE_RESULT_ERROR);
+	}
 }
 
 int
@@ -843,150 +1344,133 @@ http_file_lookup(struct http_request *req, const char *name, char **fname,
 int
 http_populate_multipart_form(struct http_request *req, int *v)
 {
-	int		h, i, c, l;
-	u_int32_t	blen, slen, len;
-	u_int8_t	*s, *end, *e, *end_headers, *data;
-	char		*d, *val, *type, *boundary, *fname;
-	char		*headers[5], *args[5], *opt[5], *name;
+	ssize_t			r;
+	int			ret;
+	struct multipart_form	form;
+	struct http_multipart	*mp;
+	u_int8_t		chunk[HTTP_MULTIPART_BUF];
 
 	*v = 0;
 
 	if (req->method != HTTP_METHOD_POST)
 		return (KORE_RESULT_ERROR);
 
-	if (!http_request_header(req, "content-type", &type))
-		return (KORE_RESULT_ERROR);
-
-	h = kore_split_string(type, ";", args, 3);
-	if (h != 2) {
-		kore_mem_free(type);
+	mp = kore_malloc(sizeof(*mp));
+	if (!http_multipart_init(mp, req)) {
+		kore_mem_free(mp);
 		return (KORE_RESULT_ERROR);
 	}
 
-	if (strcasecmp(args[0], "multipart/form-data")) {
-		kore_mem_free(type);
-		return (KORE_RESULT_ERROR);
-	}
+	form.count = v;
+	form.part = kore_buf_create(1024);
 
-	if ((val = strchr(args[1], '=')) == NULL) {
-		kore_mem_free(type);
-		return (KORE_RESULT_ERROR);
-	}
+	mp->arg = &form;
+	mp->begin = http_multipart_form_begin;
+	mp->data = http_multipart_form_data;
+	mp->end = http_multipart_form_end;
 
-	val++;
-	slen = strlen(val);
-	boundary = kore_malloc(slen + 3);
-	if (!kore_snprintf(boundary, slen + 3, &l, "--%s", val)) {
-		kore_mem_free(boundary);
-		kore_mem_free(type);
-		return (KORE_RESULT_ERROR);
+	ret = KORE_RESULT_ERROR;
+	while ((r = http_body_read(req, chunk, sizeof(chunk))) > 0) {
+		if (!http_multipart_feed(mp, chunk, r))
+			goto cleanup;
 	}
 
-	slen = l;
-	kore_mem_free(type);
+	if (r == 0)
+		ret = http_multipart_done(mp);
 
-	req->multipart_body = http_body_bytes(req, &blen);
-	if (slen < 3 || blen < (slen * 2)) {
-		kore_mem_free(boundary);
-		return (KORE_RESULT_ERROR);
-	}
-
-	end = req->multipart_body + blen - 2;
-	if (end < req->multipart_body || (end - 2) < req->multipart_body) {
-		kore_mem_free(boundary);
-		return (KORE_RESULT_ERROR);
-	}
+cleanup:
+	kore_buf_free(form.part);
+	kore_mem_free(mp);
 
-	if (memcmp((end - slen - 2), boundary, slen) ||
-	    memcmp((end - 2), "--", 2)) {
-		kore_mem_free(boundary);
-		return (KORE_RESULT_ERROR);
-	}
+	return (ret);
+}
 
-	s = req->multipart_body + slen + 2;
-	while (s < end) {
-		e = kore_mem_find(s, end - s, boundary, slen);
-		if (e == NULL) {
-			kore_mem_free(boundary);
-			return (KORE_RESULT_ERROR);
-		}
+int
+http_multipart_init(struct http_multipart *mp, struct http_request *req)
+{
+	u_int32_t	vlen;
+	const char	*value;
+	int		h, i, l;
+	char		*args[5], *val, type[256];
 
-		*(e - 2) = '\0';
-		end_headers = kore_mem_find(s, (e - 2) - s, "\r\n\r\n", 4);
-		if (end_headers == NULL) {
-			kore_mem_free(boundary);
-			return (KORE_RESULT_ERROR);
-		}
+	memset(mp, 0, sizeof(*mp));
+	mp->fd = -1;
+	mp->req = req;
 
-		*end_headers = '\0';
-		data = end_headers + 4;
+	if (!http_request_header_ref(req, "content-type", &value, &vlen))
+		return (KORE_RESULT_ERROR);
 
-		h = kore_split_string((char *)s, "\r\n", headers, 5);
-		for (i = 0; i < h; i++) {
-			c = kore_split_string(headers[i], ":", args, 5);
-			if (c != 2)
-				continue;
+	if (vlen >= sizeof(type))
+		return (KORE_RESULT_ERROR);
 
-			/* Ignore other headers for now. */
-			if (strcasecmp(args[0], "content-disposition"))
-				continue;
+	memcpy(type, value, vlen);
+	type[vlen] = '\0';
 
-			for (d = args[1]; isspace(*d); d++)
-				;
+	h = kore_split_string(type, ";", args, 5);
+	if (h < 2 || strcasecmp(args[0], "multipart/form-data"))
+		return (KORE_RESULT_ERROR);
 
-			c = kore_split_string(d, ";", opt, 5);
-			if (c < 2)
-				continue;
+	val = NULL;
+	for (i = 1; i < h; i++) {
+		while (isspace(*(unsigned char *)args[i]))
+			args[i]++;
+		if (!strncasecmp(args[i], "boundary=", 9)) {
+			val = args[i] + 9;
+			break;
+		}
+	}
 
-			if (strcasecmp(opt[0], "form-data"))
-				continue;
+	if (val == NULL)
+		return (KORE_RESULT_ERROR);
 
-			if ((val = strchr(opt[1], '=')) == NULL)
-				continue;
-			if (strlen(val) < 3)
-				continue;
+	if (*val == '"') {
+		val++;
+		val[strcspn(val, "\"")] = '\0';
+	}
 
-			val++;
-			kore_strip_chars(val, '"', &name);
+	l = strlen(val);
+	if (l == 0 || l > HTTP_MULTIPART_BOUNDARY_MAX)
+		return (KORE_RESULT_ERROR);
 
-			if (opt[2] == NULL) {
-				*v = *v + 1;
-				http_argument_add(req, name,
-				    data, (e - 2) - data, HTTP_ARG_TYPE_STRING);
-				kore_mem_free(name);
-				continue;
-			}
+	/* Every delimiter but the first follows a line break. */
+	memcpy(mp->delim, "\r\n--", 4);
+	memcpy(mp->delim + 4, val, l);
+	mp->dlen = l + 4;
 
-			for (d = opt[2]; isspace(*d); d++)
-				;
+	memcpy(mp->buf, "\r\n", 2);
+	mp->len = 2;
+	mp->state = HTTP_MULTIPART_STATE_PREAMBLE;
 
-			len = MIN(strlen("filename="), strlen(d));
-			if (!strncasecmp(d, "filename=", len)) {
-				if ((val = strchr(d, '=')) == NULL) {
-					kore_mem_free(name);
-					continue;
-				}
+	return (KORE_RESULT_OK);
+}
 
-				val++;
-				kore_strip_chars(val, '"', &fname);
-				if (strlen(fname) > 0) {
-					*v = *v + 1;
-					http_file_add(req, name, fname,
-					    data, (e - 2) - data);
-				}
+int
+http_multipart_feed(struct http_multipart *mp, const void *data, size_t len)
+{
+	size_t		n;
+	const u_int8_t	*d;
 
-				kore_mem_free(fname);
-			} else {
-				kore_debug("got unknown: %s", opt[2]);
-			}
+	d = data;
+	while (len > 0) {
+		n = MIN(len, sizeof(mp->buf) - mp->len);
+		memcpy(mp->buf + mp->len, d, n);
 
-			kore_mem_free(name);
-		}
+		d += n;
+		len -= n;
+		mp->len += n;
 
-		s = e + slen + 2;
+		if (!http_multipart_run(mp))
+			return (KORE_RESULT_ERROR);
 	}
 
-	kore_mem_free(boundary);
+	return (KORE_RESULT_OK);
+}
+
+int
+http_multipart_done(struct http_multipart *mp)
+{
+	if (mp->state != HTTP_MULTIPART_STATE_END)
+		return (KORE_RESULT_ERROR);
 
 	return (KORE_RESULT_OK);
 }
@@ -1009,13 +1493,10 @@ http_body_text(struct http_request *req)
 	u_int8_t	*data;
 	char		*text;
 
-	if (req->http_body == NULL)
+	if ((data = http_body_bytes(req, &len)) == NULL)
 		return (NULL);
 
-	data = kore_buf_release(req->http_body, &len);
-	req->http_body = NULL;
 	len++;
-
 	text = kore_malloc(len);
 	kore_strlcpy(text, (char *)data, len);
 	kore_mem_free(data);
@@ -1028,6 +1509,9 @@ http_body_bytes(struct http_request *req, u_int32_t *len)
 {
 	u_int8_t	*data;
 
+	if (req->http_body_fd != -1)
+		return (http_body_load(req, len));
+
 	if (req->http_body == NULL)
 		return (NULL);
 
@@ -1037,6 +1521,75 @@ http_body_bytes(struct http_request *req, u_int32_t *len)
 	return (data);
 }
 
+/*
+ * Copy up to len bytes of the body into out, returns the number of
+ * bytes copied, 0 once there is nothing left or -1 on error.
+ *
+ * For a streamed body that has not fully arrived yet a return of 0
+ * means nothing came in so far, the request is put to sleep and the
+ * handler should return KORE_RESULT_RETRY. It is woken up when more
+ * data arrives. Handlers should read until 0 is returned, the body is
+ * not read from the socket while too much of it is still buffered.
+ */
+ssize_t
+http_body_read(struct http_request *req, void *out, size_t len)
+{
+	ssize_t		r;
+	u_int64_t	avail;
+
+	if (req->http_body_fd != -1) {
+		avail = req->http_body_received - req->http_body_offset;
+		if ((len = MIN(len, avail)) == 0)
+			return (0);
+
+		for (;;) {
+			r = pread(req->http_body_fd, out, len,
+			    req->http_body_offset);
+			if (r == -1) {
+				if (errno == EINTR)
+					continue;
+				kore_log(LOG_ERR, "pread(http_body): %s",
+				    errno_s);
+				return (-1);
+			}
+			break;
+		}
+
+		req->http_body_offset += r;
+		return (r);
+	}
+
+	if (req->http_body == NULL)
+		return (0);
+
+	if (req->flags & HTTP_REQUEST_BODY_STREAM) {
+		/* Consumed data is dropped, the buffer only holds news. */
+		if ((len = MIN(len, req->http_body->offset)) == 0) {
+			if (req->flags & HTTP_REQUEST_EXPECT_BODY)
+				http_request_sleep(req);
+			return (0);
+		}
+
+		memcpy(out, req->http_body->data, len);
+		memmove(req->http_body->data, req->http_body->data + len,
+		    req->http_body->offset - len);
+		req->http_body->offset -= len;
+		req->http_body_offset += len;
+
+		http_body_unblock(req);
+		return (len);
+	}
+
+	avail = req->http_body->offset - req->http_body_offset;
+	if ((len = MIN(len, avail)) == 0)
+		return (0);
+
+	memcpy(out, req->http_body->data + req->http_body_offset, len);
+	req->http_body_offset += len;
+
+	return (len);
+}
+
 int
 http_state_run(struct http_state *states, u_int8_t elm,
     struct http_request *req)
@@ -1076,10 +1629,16 @@ http_state_run(struct http_state *states, u_int8_t elm,
 	return (KORE_RESULT_OK);
 }
 
+/*
+ * Arguments go into an open addressing table with as many slots as the
+ * parameter table of the handler. Only arguments matching one of its
+ * specs are kept, so the table never fills up.
+ */
 static void
 http_argument_add(struct http_request *req, const char *name,
     void *value, u_int32_t len, int type)
 {
+	u_int32_t			hash, slot, size;
 	struct http_arg			*q;
 	struct kore_handler_params	*p;
 
@@ -1088,29 +1647,58 @@ http_argument_add(struct http_request *req, const char *name,
 		return;
 	}
 
-	TAILQ_FOREACH(p, &(req->hdlr->params), list) {
-		if (p->method != req->method)
-			continue;
+	hash = kore_strhash(name);
+	p = kore_module_handler_param(req->hdlr, req->method, name, hash);
+	if (p == NULL)
+		return;
 
-		if (!strcmp(p->name, name)) {
-			if (type == HTTP_ARG_TYPE_STRING) {
-				http_argument_urldecode(value);
-				len = strlen(value);
-			}
+	if (type == HTTP_ARG_TYPE_STRING) {
+		http_argument_urldecode(value);
+		len = strlen(value);
+	}
 
-			if (kore_validator_check(req, p->validator, value)) {
-				q = kore_malloc(sizeof(struct http_arg));
-				q->len = len;
-				q->s_value = NULL;
-				q->name = kore_strdup(name);
-				q->value = kore_malloc(len);
-				memcpy(q->value, value, len);
-				TAILQ_INSERT_TAIL(&(req->arguments), q, list);
-			}
+	if (!kore_validator_check(req, p->validator, value))
+		return;
+
+	if (req->args == NULL) {
+		size = req->hdlr->params_mask + 1;
+		req->args = http_request_alloc(req,
+		    size * sizeof(struct http_arg));
+		memset(req->args, 0, size * sizeof(struct http_arg));
+		req->args_mask = req->hdlr->params_mask;
+	}
 
+	/* The first occurrence of an argument wins. */
+	slot = hash & req->args_mask;
+	while ((q = &(req->args[slot]))->name != NULL) {
+		if (q->hash == hash && !strcmp(q->name, name))
 			return;
-		}
+		slot = (slot + 1) & req->args_mask;
+	}
+
+	q->name = p->name;
+	q->hash = hash;
+	q->len = len;
+	q->value = http_request_strndup(req, value, len);
+}
+
+static struct http_arg *
+http_argument_find(struct http_request *req, const char *name, u_int32_t hash)
+{
+	u_int32_t		slot;
+	struct http_arg		*q;
+
+	if (req->args == NULL)
+		return (NULL);
+
+	slot = hash & req->args_mask;
+	while ((q = &(req->args[slot]))->name != NULL) {
+		if (q->hash == hash && !strcmp(q->name, name))
+			return (q);
+		slot = (slot + 1) & req->args_mask;
 	}
+
+	return (NULL);
 }
 
 static void
@@ -1119,200 +1707,777 @@ http_file_add(struct http_request *req, const char *name, const char *filename,
 {
 	struct http_file	*f;
 
-	f = kore_malloc(sizeof(struct http_file));
+	f = http_request_alloc(req, sizeof(struct http_file));
 	f->len = len;
 	f->data = data;
-	f->name = kore_strdup(name);
-	f->filename = kore_strdup(filename);
+	f->name = http_request_strndup(req, name, strlen(name));
+	f->filename = http_request_strndup(req, filename, strlen(filename));
 
 	TAILQ_INSERT_TAIL(&(req->files), f, list);
 }
 
-static int
-http_body_recv(struct netbuf *nb)
+static char *
+http_request_strndup(struct http_request *req, const char *str, size_t len)
 {
-	struct http_request	*req = (struct http_request *)nb->extra;
-
-	kore_buf_append(req->http_body, nb->buf, nb->s_off);
+	char		*p;
 
-	req->flags |= HTTP_REQUEST_COMPLETE;
-	req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
-
-	nb->extra = NULL;
-	kore_debug("received all body data for request %p", req);
+	p = http_request_alloc(req, len + 1);
+	memcpy(p, str, len);
+	p[len] = '\0';
 
-	return (KORE_RESULT_OK);
+	return (p);
 }
 
-static void
-http_error_response(struct connection *c, struct spdy_stream *s, int status)
+static int
+http_arena_owns(struct http_request *req, const void *ptr)
 {
-	kore_debug("http_error_response(%p, %p, %d)", c, s, status);
+	uintptr_t		addr, start;
+	struct http_arena	*a;
 
-	switch (c->proto) {
-	case CONN_PROTO_SPDY:
-		http_response_spdy(NULL, c, s, status, NULL, 0);
-		break;
-	case CONN_PROTO_HTTP:
-		if (s != NULL)
-			kore_log(LOG_NOTICE, "http_error_response: s != NULL");
-		http_response_normal(NULL, c, status, NULL, 0);
-		break;
-	default:
-		fatal("http_error_response() bad proto %d", c->proto);
-		/* NOTREACHED. */
+	addr = (uintptr_t)ptr;
+	for (a = req->arena; a != NULL; a = a->next) {
+		start = (uintptr_t)(a + 1);
+		if (addr >= start && addr < start + a->size)
+			return (KORE_RESULT_OK);
 	}
+
+	return (KORE_RESULT_ERROR);
 }
 
 static void
-http_response_spdy(struct http_request *req, struct connection *c,
-    struct spdy_stream *s, int status, void *d, u_int32_t len)
+http_arena_release(struct http_request *req)
 {
-	u_int32_t			hlen;
-	struct http_header		*hdr;
-	u_int8_t			*htext;
-	struct spdy_header_block	*hblock;
-	char				sbuf[512];
-
-	(void)snprintf(sbuf, sizeof(sbuf), "%d %s",
-	    status, http_status_text(status));
+	struct http_arena	*a, *next;
 
-	hblock = spdy_header_block_create(SPDY_HBLOCK_NORMAL);
-	spdy_header_block_add(hblock, ":status", sbuf);
-	spdy_header_block_add(hblock, ":version", "HTTP/1.1");
-	spdy_header_block_add(hblock, ":server", http_version_spdy);
+	for (a = req->arena; a != NULL; a = next) {
+		next = a->next;
 
-	if (http_hsts_enable) {
-		(void)snprintf(sbuf, sizeof(sbuf),
-		    "max-age=%" PRIu64 "; includeSubDomains", http_hsts_enable);
-		spdy_header_block_add(hblock,
-		    ":strict-transport-security", sbuf);
+		if (a->size == HTTP_ARENA_SIZE &&
+		    http_arena_free_count < HTTP_ARENA_FREE_MAX) {
+			a->next = http_arena_free;
+			http_arena_free = a;
+			http_arena_free_count++;
+		} else {
+			kore_mem_free(a);
+		}
 	}
 
-	if (req != NULL) {
-		TAILQ_FOREACH(hdr, &(req->resp_headers), list)
-			spdy_header_block_add(hblock, hdr->header, hdr->value);
-	}
+	req->arena = NULL;
+}
 
-	htext = spdy_header_block_release(c, hblock, &hlen);
-	if (htext == NULL) {
-		spdy_session_teardown(c, SPDY_SESSION_ERROR_INTERNAL);
-		return;
+static int
+http_body_recv(struct netbuf *nb)
+{
+	u_int64_t		left;
+	struct http_request	*req = (struct http_request *)nb->extra;
+
+	/*
+	 * The handler of a streamed body is already gone, drop the rest.
+	 * The connection is closed once the response went out.
+	 */
+	if (req == NULL) {
+		nb->s_off = 0;
+		return (KORE_RESULT_OK);
 	}
 
-	spdy_frame_send(c, SPDY_CTRL_FRAME_SYN_REPLY, 0, hlen, s, 0);
-	net_send_queue(c, htext, hlen, NULL, NETBUF_LAST_CHAIN);
-	kore_mem_free(htext);
+	if (!http_body_store(req, nb->buf, nb->s_off))
+		return (KORE_RESULT_ERROR);
 
-	if (len > 0 && req != NULL && req->method != HTTP_METHOD_HEAD) {
-		s->send_size += len;
-		s->flags |= SPDY_DATAFRAME_PRELUDE;
+	if (req->flags & HTTP_REQUEST_BODY_STREAM)
+		http_request_wakeup(req);
 
-		if (d != NULL)
-			net_send_queue(c, d, len, s, NETBUF_LAST_CHAIN);
-	}
+	left = req->http_body_length - req->http_body_received;
+	if (left > 0) {
+		nb->s_off = 0;
+		nb->b_len = MIN(left, HTTP_BODY_CHUNK);
 
-	if ((req != NULL && req->method == HTTP_METHOD_HEAD) ||
-	    (len == 0 && !(s->flags & SPDY_NO_CLOSE))) {
-		spdy_frame_send(c, SPDY_DATA_FRAME, FLAG_FIN, 0, s, 0);
-		spdy_stream_close(c, s, SPDY_KEEP_NETBUFS);
+		/* Wait for the handler to catch up before reading more. */
+		if ((req->flags & HTTP_REQUEST_BODY_STREAM) &&
+		    req->http_body->offset >= HTTP_BODY_CHUNK) {
+			req->owner->flags |= CONN_READ_BLOCK;
+			req->owner->flags &= ~CONN_READ_POSSIBLE;
+		}
+
+		return (KORE_RESULT_OK);
 	}
-}
 
-static void
-http_response_normal(struct http_request *req, struct connection *c,
-    int status, void *d, u_int32_t len)
-{
-	struct http_header	*hdr;
-	char			*conn;
-	int			connection_close;
+	req->flags |= HTTP_REQUEST_COMPLETE;
+	req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
 
-	header_buf->offset = 0;
+	nb->extra = NULL;
+	kore_debug("received all body data for request %p", req);
 
-	kore_buf_appendf(header_buf, "HTTP/1.1 %d %s\r\n",
-	    status, http_status_text(status));
-	kore_buf_append(header_buf, http_version, http_version_len);
+	/* Anything that follows is the next, pipelined, request. */
+	net_recv_reset(nb->owner, http_header_max, http_header_recv);
+	nb->flags |= NETBUF_CALL_CB_ALWAYS;
 
-	if (c->flags & CONN_CLOSE_EMPTY)
-		connection_close = 1;
-	else
-		connection_close = 0;
+	return (KORE_RESULT_OK);
+}
 
-	if (connection_close == 0 && req != NULL) {
-		if (http_request_header(req, "connection", &conn)) {
-			if ((*conn == 'c' || *conn == 'C') &&
-			    !strcasecmp(conn, "close"))
-				connection_close = 1;
-			kore_mem_free(conn);
-		}
-	}
+static int
+http_body_chunked_recv(struct netbuf *nb)
+{
+	int			status;
+	size_t			used;
+	struct http_request	*req = (struct http_request *)nb->extra;
 
-	/* Note that req CAN be NULL. */
-	if (req != NULL && req->owner->proto != CONN_PROTO_WEBSOCKET) {
-		if (http_keepalive_time && connection_close == 0) {
-			kore_buf_appendf(header_buf,
-			    "connection: keep-alive\r\n");
-			kore_buf_appendf(header_buf,
-			    "keep-alive: timeout=%d\r\n", http_keepalive_time);
-		} else {
-			c->flags |= CONN_CLOSE_EMPTY;
-			kore_buf_appendf(header_buf, "connection: close\r\n");
-		}
+	/* As in http_body_recv(), the handler no longer wants the rest. */
+	if (req == NULL) {
+		nb->s_off = 0;
+		return (KORE_RESULT_OK);
 	}
 
-	if (http_hsts_enable) {
-		kore_buf_appendf(header_buf, "strict-transport-security: ");
-		kore_buf_appendf(header_buf,
-		    "max-age=%" PRIu64 "; includeSubDomains\r\n",
-		    http_hsts_enable);
+	status = http_body_chunked(req, nb->buf, nb->s_off, &used);
+	if (status != 0) {
+		http_body_fail(req, status);
+		return (KORE_RESULT_OK);
 	}
 
-	if (req != NULL) {
-		TAILQ_FOREACH(hdr, &(req->resp_headers), list) {
-			kore_buf_appendf(header_buf, "%s: %s\r\n",
-			    hdr->header, hdr->value);
-		}
+	if (req->flags & HTTP_REQUEST_BODY_STREAM)
+		http_request_wakeup(req);
 
-		if (status != 204 && status >= 200 &&
-		    !(req->flags & HTTP_REQUEST_NO_CONTENT_LENGTH)) {
-			kore_buf_appendf(header_buf,
-			    "content-length: %d\r\n", len);
-		}
-	} else {
-		if (status != 204 && status >= 200) {
-			kore_buf_appendf(header_buf,
-			    "content-length: %d\r\n", len);
+	if (req->flags & HTTP_REQUEST_EXPECT_BODY) {
+		nb->s_off = 0;
+
+		if ((req->flags & HTTP_REQUEST_BODY_STREAM) &&
+		    req->http_body->offset >= HTTP_BODY_CHUNK) {
+			req->owner->flags |= CONN_READ_BLOCK;
+			req->owner->flags &= ~CONN_READ_POSSIBLE;
 		}
+
+		return (KORE_RESULT_OK);
 	}
 
-	kore_buf_append(header_buf, "\r\n", 2);
-	net_send_queue(c, header_buf->data, header_buf->offset,
-	    NULL, NETBUF_LAST_CHAIN);
+	nb->extra = NULL;
+	kore_debug("received all chunked body data for request %p", req);
 
-	if (d != NULL && req != NULL && req->method != HTTP_METHOD_HEAD)
-		net_send_queue(c, d, len, NULL, NETBUF_LAST_CHAIN);
+	/*
+	 * The last chunk may have been read together with the start
+	 * of the next request, move those bytes over to the new buffer.
+	 */
+	used = nb->s_off - used;
+	memcpy(http_body_tail, nb->buf + nb->s_off - used, used);
 
-	if (!(c->flags & CONN_CLOSE_EMPTY))
-		net_recv_reset(c, http_header_max, http_header_recv);
+	net_recv_reset(nb->owner, MAX(http_header_max, used),
+	    http_header_recv);
+	nb->flags |= NETBUF_CALL_CB_ALWAYS;
+	if (used > 0)
+		net_recv_fill(nb->owner, http_body_tail, used);
+
+	return (KORE_RESULT_OK);
 }
 
-const char *
-http_status_text(int status)
+/*
+ * Decode len bytes of a chunked body, storing the chunk data as it is
+ * found. Stops at the end of the body, *used holds how many bytes were
+ * part of it. Returns 0 or the status to fail the request with.
+ */
+static int
+http_body_chunked(struct http_request *req, const u_int8_t *d, size_t len,
+    size_t *used)
 {
-	char		*r;
+	u_int8_t	ch;
+	size_t		off, n;
+
+	off = 0;
+	while (off < len && req->http_chunk_state != HTTP_CHUNK_DONE) {
+		if (req->http_chunk_state == HTTP_CHUNK_DATA) {
+			n = MIN(req->http_chunk_left, len - off);
+			if (!http_body_store(req, d + off, n))
+				return (HTTP_STATUS_INTERNAL_ERROR);
+
+			off += n;
+			req->http_chunk_left -= n;
+			if (req->http_chunk_left == 0)
+				req->http_chunk_state = HTTP_CHUNK_DATA_CR;
+			continue;
+		}
 
-	switch (status) {
-	case HTTP_STATUS_CONTINUE:
-		r = "Continue";
-		break;
-	case HTTP_STATUS_SWITCHING_PROTOCOLS:
-		r = "Switching Protocols";
-		break;
-	case HTTP_STATUS_OK:
-		r = "OK";
-		break;
-	case HTTP_STATUS_CREATED:
-		r = "Created";
+		ch = d[off++];
+
+		switch (req->http_chunk_state) {
+		case HTTP_CHUNK_SIZE:
+		case HTTP_CHUNK_HEX:
+			if (isxdigit(ch)) {
+				/* Checked per digit, the size cannot wrap. */
+				if (req->http_chunk_left > (http_body_max >> 4))
+					goto toolarge;
+				req->http_chunk_left <<= 4;
+				req->http_chunk_left |= isdigit(ch) ?
+				    ch - '0' : tolower(ch) - 'a' + 10;
+				req->http_chunk_state = HTTP_CHUNK_HEX;
+				continue;
+			}
+
+			if (req->http_chunk_state == HTTP_CHUNK_SIZE)
+				return (HTTP_STATUS_BAD_REQUEST);
+
+			if (ch == '\r') {
+				req->http_chunk_state = HTTP_CHUNK_LF;
+				continue;
+			}
+
+			if (ch != '\n') {
+				if (ch != ';' && ch != ' ' && ch != '\t')
+					return (HTTP_STATUS_BAD_REQUEST);
+				/* Chunk extensions are ignored. */
+				req->http_chunk_state = HTTP_CHUNK_EXT;
+				continue;
+			}
+			break;
+		case HTTP_CHUNK_EXT:
+			if (ch != '\n')
+				continue;
+			break;
+		case HTTP_CHUNK_LF:
+			if (ch != '\n')
+				return (HTTP_STATUS_BAD_REQUEST);
+			break;
+		case HTTP_CHUNK_DATA_CR:
+			if (ch == '\r') {
+				req->http_chunk_state = HTTP_CHUNK_DATA_LF;
+				continue;
+			}
+			/* FALLTHROUGH */
+		case HTTP_CHUNK_DATA_LF:
+			if (ch != '\n')
+				return (HTTP_STATUS_BAD_REQUEST);
+			req->http_chunk_state = HTTP_CHUNK_SIZE;
+			continue;
+		case HTTP_CHUNK_TRAILER:
+			/* Skip trailer fields up to the empty line. */
+			if (ch == '\n') {
+				if (req->http_chunk_left == 0)
+					req->http_chunk_state = HTTP_CHUNK_DONE;
+				req->http_chunk_left = 0;
+			} else if (ch != '\r') {
+				req->http_chunk_left++;
+			}
+			continue;
+		default:
+			fatal("http_body_chunked: bad state %d",
+			    req->http_chunk_state);
+		}
+
+		/* End of a chunk size line. */
+		if (req->http_chunk_left == 0) {
+			req->http_chunk_state = HTTP_CHUNK_TRAILER;
+			continue;
+		}
+
+		if (req->http_chunk_left >
+		    http_body_max - req->http_body_received)
+			goto toolarge;
+
+		req->http_chunk_state = HTTP_CHUNK_DATA;
+	}
+
+	if (req->http_chunk_state == HTTP_CHUNK_DONE) {
+		req->flags |= HTTP_REQUEST_COMPLETE;
+		req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
+	}
+
+	*used = off;
+
+	return (0);
+
+toolarge:
+	kore_log(LOG_NOTICE, "chunked body too large (> %" PRIu64 ")",
+	    http_body_max);
+	return (HTTP_STATUS_REQUEST_ENTITY_TOO_LARGE);
+}
+
+/*
+ * A chunked body that cannot be taken, what follows on the connection
+ * can not be trusted so it is closed after the error went out.
+ */
+static void
+http_body_fail(struct http_request *req, int status)
+{
+	struct connection	*c = req->owner;
+
+	c->rnb->extra = NULL;
+	req->flags |= HTTP_REQUEST_DELETE;
+	http_request_wakeup(req);
+
+	/* A streaming handler may have started its response already. */
+	if (req->status != 0) {
+		kore_connection_disconnect(c);
+		return;
+	}
+
+	c->flags |= CONN_CLOSE_EMPTY;
+	http_error_response(c, NULL, status);
+}
+
+/*
+ * Pick where the body goes. Streaming handlers run right away and read
+ * it as it comes in, large bodies for the others go to disk. A clen of
+ * 0 means the length is not known yet, see http_body_store().
+ */
+static int
+http_body_begin(struct http_request *req, u_int64_t clen)
+{
+	if (clen == 0)
+		clen = HTTP_BODY_CHUNK;
+
+	if (req->route != NULL && (req->route->flags & HANDLER_BODY_STREAM)) {
+		req->flags |= HTTP_REQUEST_BODY_STREAM;
+		req->flags |= HTTP_REQUEST_COMPLETE;
+		req->http_body = kore_buf_create(MIN(clen, HTTP_BODY_CHUNK));
+	} else if (http_body_disk_offload > 0 &&
+	    clen > http_body_disk_offload) {
+		return (http_body_spill(req));
+	} else {
+		req->http_body = kore_buf_create(clen);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http_body_receiving(struct connection *c)
+{
+	if (c->rnb == NULL)
+		return (0);
+
+	return (c->rnb->cb == http_body_recv ||
+	    c->rnb->cb == http_body_chunked_recv);
+}
+
+static int
+http_body_spill(struct http_request *req)
+{
+	int		l;
+	char		path[MAXPATHLEN];
+
+	if (!kore_snprintf(path, sizeof(path), &l, "%s/http_body.XXXXXX",
+	    http_body_disk_path))
+		return (KORE_RESULT_ERROR);
+
+	if ((req->http_body_fd = mkstemp(path)) == -1) {
+		kore_log(LOG_ERR, "mkstemp(%s): %s", path, errno_s);
+		return (KORE_RESULT_ERROR);
+	}
+
+	/* Nobody else needs to see it, it goes away with the fd. */
+	(void)unlink(path);
+
+	/* What was kept in memory so far goes first. */
+	if (req->http_body != NULL) {
+		if (!http_body_write(req, req->http_body->data,
+		    req->http_body->offset))
+			return (KORE_RESULT_ERROR);
+
+		kore_buf_free(req->http_body);
+		req->http_body = NULL;
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http_body_store(struct http_request *req, const void *data, size_t len)
+{
+	/* A body of unknown length goes to disk once it grows too large. */
+	if (req->http_body_fd == -1 &&
+	    !(req->flags & HTTP_REQUEST_BODY_STREAM) &&
+	    http_body_disk_offload > 0 &&
+	    req->http_body_received + len > http_body_disk_offload) {
+		if (!http_body_spill(req))
+			return (KORE_RESULT_ERROR);
+	}
+
+	req->http_body_received += len;
+
+	if (req->http_body_fd == -1) {
+		kore_buf_append(req->http_body, data, len);
+		return (KORE_RESULT_OK);
+	}
+
+	return (http_body_write(req, data, len));
+}
+
+static int
+http_body_write(struct http_request *req, const void *data, size_t len)
+{
+	ssize_t		r;
+	size_t		off;
+
+	off = 0;
+	while (off < len) {
+		r = write(req->http_body_fd, (const u_int8_t *)data + off,
+		    len - off);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			kore_log(LOG_ERR, "write(http_body): %s", errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+
+		off += r;
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+http_body_unblock(struct http_request *req)
+{
+	struct connection	*c = req->owner;
+
+	if (!(c->flags & CONN_READ_BLOCK) || !http_body_receiving(c) ||
+	    req->http_body->offset >= HTTP_BODY_CHUNK)
+		return;
+
+	c->flags &= ~CONN_READ_BLOCK;
+	c->flags |= CONN_READ_POSSIBLE;
+
+	if (!net_recv_flush(c))
+		kore_connection_disconnect(c);
+}
+
+static u_int8_t *
+http_body_load(struct http_request *req, u_int32_t *len)
+{
+	ssize_t		r;
+	u_int8_t	*data;
+	u_int64_t	off;
+
+	data = kore_malloc(req->http_body_received + 1);
+
+	off = 0;
+	while (off < req->http_body_received) {
+		r = pread(req->http_body_fd, data + off,
+		    req->http_body_received - off, off);
+		if (r == -1 && errno == EINTR)
+			continue;
+
+		if (r <= 0) {
+			kore_log(LOG_ERR, "pread(http_body): %s",
+			    (r == 0) ? "short read" : errno_s);
+			kore_mem_free(data);
+			return (NULL);
+		}
+
+		off += r;
+	}
+
+	*len = req->http_body_received;
+	return (data);
+}
+
+static int
+http_request_busy(struct connection *c)
+{
+	struct http_request	*req;
+
+	TAILQ_FOREACH(req, &(c->http_requests), olist) {
+		if (!(req->flags & HTTP_REQUEST_DELETE))
+			return (1);
+	}
+
+	return (0);
+}
+
+static void
+http_pipeline_next(struct connection *c)
+{
+	if (c->state != CONN_STATE_ESTABLISHED ||
+	    (c->flags & CONN_CLOSE_EMPTY) || c->rnb == NULL ||
+	    c->rnb->cb != http_header_recv)
+		return;
+
+	if (c->rnb->s_off > 0) {
+		if (http_header_recv(c->rnb) != KORE_RESULT_OK) {
+			kore_connection_disconnect(c);
+			return;
+		}
+
+		if (http_request_busy(c)) {
+			http_pipelined++;
+			kore_connection_start_idletimer(c);
+		}
+	}
+
+	if (c->flags & CONN_READ_BLOCK) {
+		c->flags &= ~CONN_READ_BLOCK;
+		c->flags |= CONN_READ_POSSIBLE;
+		if (!net_recv_flush(c))
+			kore_connection_disconnect(c);
+	}
+}
+
+static void
+http_error_response(struct connection *c, struct spdy_stream *s, int status)
+{
+	kore_debug("http_error_response(%p, %p, %d)", c, s, status);
+
+	switch (c->proto) {
+	case CONN_PROTO_SPDY:
+		http_response_spdy(NULL, c, s, status, NULL, 0);
+		break;
+	case CONN_PROTO_HTTP:
+		if (s != NULL)
+			kore_log(LOG_NOTICE, "http_error_response: s != NULL");
+		http_response_normal(NULL, c, status, NULL, 0);
+		break;
+	default:
+		fatal("http_error_response() bad proto %d", c->proto);
+		/* NOTREACHED. */
+	}
+}
+
+static void
+http_response_spdy(struct http_request *req, struct connection *c,
+    struct spdy_stream *s, int status, void *d, u_int64_t len)
+{
+	u_int32_t			hlen;
+	struct http_header		*hdr;
+	u_int8_t			*htext;
+	struct spdy_header_block	*hblock;
+	char				sbuf[512];
+
+	(void)snprintf(sbuf, sizeof(sbuf), "%d %s",
+	    status, http_status_text(status));
+
+	hblock = spdy_header_block_create(SPDY_HBLOCK_NORMAL);
+	spdy_header_block_add(hblock, ":status", sbuf);
+	spdy_header_block_add(hblock, ":version", "HTTP/1.1");
+	spdy_header_block_add(hblock, ":server", http_version_spdy);
+
+	http_response_date();
+	spdy_header_block_add(hblock, "date", http_date_spdy);
+
+	if (http_hsts_enable) {
+		spdy_header_block_add(hblock,
+		    ":strict-transport-security", http_hsts_spdy);
+	}
+
+	if (req != NULL) {
+		TAILQ_FOREACH(hdr, &(req->resp_headers), list)
+			spdy_header_block_add(hblock, hdr->header, hdr->value);
+	}
+
+	htext = spdy_header_block_release(c, hblock, &hlen);
+	if (htext == NULL) {
+		spdy_session_teardown(c, SPDY_SESSION_ERROR_INTERNAL);
+		return;
+	}
+
+	spdy_frame_send(c, SPDY_CTRL_FRAME_SYN_REPLY, 0, hlen, s, 0);
+	net_send_queue(c, htext, hlen, NULL, NETBUF_LAST_CHAIN);
+	kore_mem_free(htext);
+
+	if (len > 0 && req != NULL && req->method != HTTP_METHOD_HEAD) {
+		s->send_size += len;
+		s->flags |= SPDY_DATAFRAME_PRELUDE;
+
+		if (d != NULL)
+			net_send_queue(c, d, len, s, NETBUF_LAST_CHAIN);
+	}
+
+	if ((req != NULL && req->method == HTTP_METHOD_HEAD) ||
+	    (len == 0 && !(s->flags & SPDY_NO_CLOSE))) {
+		spdy_frame_send(c, SPDY_DATA_FRAME, FLAG_FIN, 0, s, 0);
+		spdy_stream_close(c, s, SPDY_KEEP_NETBUFS);
+	}
+}
+
+static void
+http_response_normal(struct http_request *req, struct connection *c,
+    int status, void *d, u_int64_t len)
+{
+	struct http_header	*hdr;
+	const char		*conn;
+	u_int32_t		clen;
+	int			connection_close;
+	struct http_status_line	*sl;
+
+	header_buf->offset = 0;
+
+	if (status >= HTTP_STATUS_CONTINUE &&
+	    status < HTTP_STATUS_CONTINUE + HTTP_STATUS_LINES &&
+	    http_status_lines[status - HTTP_STATUS_CONTINUE].line != NULL) {
+		sl = &http_status_lines[status - HTTP_STATUS_CONTINUE];
+		kore_buf_append(header_buf, sl->line, sl->len);
+	} else {
+		kore_buf_appendf(header_buf, "HTTP/1.1 %d %s\r\n",
+		    status, http_status_text(status));
+	}
+
+	kore_buf_append(header_buf, http_version, http_version_len);
+
+	http_response_date();
+	kore_buf_append(header_buf, http_date_hdr, http_date_hdr_len);
+
+	/* A streamed body the handler did not read to the end. */
+	if (http_body_receiving(c))
+		c->flags |= CONN_CLOSE_EMPTY;
+
+	if (c->flags & CONN_CLOSE_EMPTY)
+		connection_close = 1;
+	else
+		connection_close = 0;
+
+	if (connection_close == 0 && req != NULL) {
+		if (http_request_header_ref(req, "connection", &conn, &clen) &&
+		    clen == 5 && !strncasecmp(conn, "close", 5))
+			connection_close = 1;
+	}
+
+	/* Note that req CAN be NULL. */
+	if (req != NULL && req->owner->proto != CONN_PROTO_WEBSOCKET) {
+		if (http_keepalive_time && connection_close == 0) {
+			kore_buf_append(header_buf, http_keepalive_hdr,
+			    http_keepalive_hdr_len);
+		} else {
+			c->flags |= CONN_CLOSE_EMPTY;
+			kore_buf_append(header_buf,
+			    "connection: close\r\n", 19);
+		}
+	}
+
+	if (http_hsts_enable)
+		kore_buf_append(header_buf, http_hsts_hdr, http_hsts_hdr_len);
+
+	if (req != NULL) {
+		TAILQ_FOREACH(hdr, &(req->resp_headers), list)
+			http_response_append(hdr->header, hdr->value);
+
+		if (status != 204 && status >= 200 &&
+		    !(req->flags & HTTP_REQUEST_NO_CONTENT_LENGTH))
+			http_response_content_length(len);
+	} else {
+		if (status != 204 && status >= 200)
+			http_response_content_length(len);
+	}
+
+	kore_buf_append(header_buf, "\r\n", 2);
+
+	/* Keep the body in the netbuf of the header, one write for both. */
+	if (d != NULL && req != NULL && req->method != HTTP_METHOD_HEAD) {
+		net_send_queue_hint(c, header_buf->data, header_buf->offset,
+		    header_buf->offset + len, NULL, NETBUF_LAST_CHAIN);
+		net_send_queue(c, d, len, NULL, NETBUF_LAST_CHAIN);
+	} else {
+		net_send_queue(c, header_buf->data, header_buf->offset,
+		    NULL, NETBUF_LAST_CHAIN);
+	}
+
+	/* Pipelined requests stay in the buffer, see http_header_recv(). */
+	if (!(c->flags & CONN_CLOSE_EMPTY) && (req == NULL ||
+	    c->rnb->cb != http_header_recv || c->rnb->s_off == 0))
+		net_recv_reset(c, http_header_max, http_header_recv);
+}
+
+static void
+http_response_init(void)
+{
+	int		i, l;
+	const char	*text;
+	char		line[96];
+
+	for (i = 0; i < HTTP_STATUS_LINES; i++) {
+		text = http_status_text(HTTP_STATUS_CONTINUE + i);
+		if (*text == '\0')
+			continue;
+
+		l = snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\n",
+		    HTTP_STATUS_CONTINUE + i, text);
+		if (l == -1 || (size_t)l >= sizeof(line))
+			fatal("http_response_init(): status line too long");
+
+		http_status_lines[i].line = kore_strdup(line);
+		http_status_lines[i].len = l;
+	}
+
+	l = snprintf(http_keepalive_hdr, sizeof(http_keepalive_hdr),
+	    "connection: keep-alive\r\nkeep-alive: timeout=%d\r\n",
+	    http_keepalive_time);
+	if (l == -1 || (size_t)l >= sizeof(http_keepalive_hdr))
+		fatal("http_response_init(): keep-alive header too long");
+	http_keepalive_hdr_len = l;
+
+	if (http_hsts_enable) {
+		(void)snprintf(http_hsts_spdy, sizeof(http_hsts_spdy),
+		    "max-age=%" PRIu64 "; includeSubDomains", http_hsts_enable);
+		l = snprintf(http_hsts_hdr, sizeof(http_hsts_hdr),
+		    "strict-transport-security: %s\r\n", http_hsts_spdy);
+		if (l == -1 || (size_t)l >= sizeof(http_hsts_hdr))
+			fatal("http_response_init(): hsts header too long");
+		http_hsts_hdr_len = l;
+	}
+}
+
+/* The date header only changes once a second, so is kept formatted. */
+static void
+http_response_date(void)
+{
+	time_t		now;
+	char		*date;
+	int		l;
+
+	now = time(NULL);
+	if (now == http_date_last)
+		return;
+
+	if ((date = kore_time_to_date(now)) == NULL)
+		return;
+
+	l = snprintf(http_date_hdr, sizeof(http_date_hdr),
+	    "date: %s\r\n", date);
+	if (l == -1 || (size_t)l >= sizeof(http_date_hdr))
+		return;
+
+	kore_strlcpy(http_date_spdy, date, sizeof(http_date_spdy));
+	http_date_hdr_len = l;
+	http_date_last = now;
+}
+
+static void
+http_response_append(const char *name, const char *value)
+{
+	kore_buf_append(header_buf, name, strlen(name));
+	kore_buf_append(header_buf, ": ", 2);
+	kore_buf_append(header_buf, value, strlen(value));
+	kore_buf_append(header_buf, "\r\n", 2);
+}
+
+/* The content-length line, without going through vsnprintf(). */
+static void
+http_response_content_length(u_int64_t len)
+{
+	char		num[20], *p;
+
+	p = num + sizeof(num);
+	do {
+		*--p = '0' + (len % 10);
+		len /= 10;
+	} while (len != 0);
+
+	kore_buf_append(header_buf, "content-length: ", 16);
+	kore_buf_append(header_buf, p, (num + sizeof(num)) - p);
+	kore_buf_append(header_buf, "\r\n", 2);
+}
+
+const char *
+http_status_text(int status)
+{
+	char		*r;
+
+	switch (status) {
+	case HTTP_STATUS_CONTINUE:
+		r = "Continue";
+		break;
+	case HTTP_STATUS_SWITCHING_PROTOCOLS:
+		r = "Switching Protocols";
+		break;
+	case HTTP_STATUS_OK:
+		r = "OK";
+		break;
+	case HTTP_STATUS_CREATED:
+		r = "Created";
 		break;
 	case HTTP_STATUS_ACCEPTED:
 		r = "Accepted";
@@ -1429,3 +2594,502 @@ http_status_text(int status)
 
 	return (r);
 }
+
+static int
+http_multipart_run(struct http_multipart *mp)
+{
+	u_int8_t	*base, *p;
+	size_t		off, avail, n;
+
+	off = 0;
+
+	for (;;) {
+		base = mp->buf + off;
+		avail = mp->len - off;
+
+		switch (mp->state) {
+		case HTTP_MULTIPART_STATE_PREAMBLE:
+		case HTTP_MULTIPART_STATE_DATA:
+			p = kore_mem_find(base, avail, mp->delim, mp->dlen);
+			if (p == NULL) {
+				/* Hold back what may be a partial delimiter. */
+				if (avail < mp->dlen)
+					goto out;
+
+				n = avail - (mp->dlen - 1);
+				if (mp->state == HTTP_MULTIPART_STATE_DATA &&
+				    !http_multipart_emit(mp, base, n))
+					return (KORE_RESULT_ERROR);
+
+				off += n;
+				goto out;
+			}
+
+			n = p - base;
+			if (mp->state == HTTP_MULTIPART_STATE_DATA) {
+				if (!http_multipart_emit(mp, base, n))
+					return (KORE_RESULT_ERROR);
+				if (mp->end != NULL && !mp->end(mp))
+					return (KORE_RESULT_ERROR);
+			}
+
+			off += n + mp->dlen;
+			mp->state = HTTP_MULTIPART_STATE_DELIM;
+			break;
+		case HTTP_MULTIPART_STATE_DELIM:
+			if (avail < 2)
+				goto out;
+
+			if (!memcmp(base, "--", 2)) {
+				mp->state = HTTP_MULTIPART_STATE_END;
+			} else if (!memcmp(base, "\r\n", 2)) {
+				mp->state = HTTP_MULTIPART_STATE_HEADERS;
+			} else {
+				return (KORE_RESULT_ERROR);
+			}
+
+			off += 2;
+			break;
+		case HTTP_MULTIPART_STATE_HEADERS:
+			if (avail < 2)
+				goto out;
+
+			/* A part without any headers. */
+			if (!memcmp(base, "\r\n", 2)) {
+				*base = '\0';
+				n = 2;
+			} else {
+				p = kore_mem_find(base, avail, "\r\n\r\n", 4);
+				if (p == NULL)
+					goto more;
+
+				*p = '\0';
+				n = (p - base) + 4;
+			}
+
+			if (!http_multipart_part(mp, (char *)base))
+				return (KORE_RESULT_ERROR);
+
+			off += n;
+			mp->state = HTTP_MULTIPART_STATE_DATA;
+			break;
+		case HTTP_MULTIPART_STATE_END:
+			/* The epilogue is ignored. */
+			off = mp->len;
+			goto out;
+		default:
+			fatal("http_multipart_run: bad state %d", mp->state);
+		}
+	}
+
+more:
+	/* The part headers must fit in the buffer. */
+	if (mp->state == HTTP_MULTIPART_STATE_HEADERS && off == 0 &&
+	    mp->len == sizeof(mp->buf))
+		return (KORE_RESULT_ERROR);
+
+out:
+	memmove(mp->buf, mp->buf + off, mp->len - off);
+	mp->len -= off;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http_multipart_part(struct http_multipart *mp, char *headers)
+{
+	int		h, i, j, c;
+	char		*lines[10], *opt[5], *p, *val;
+
+	mp->fd = -1;
+	mp->file = 0;
+	mp->name[0] = '\0';
+	mp->filename[0] = '\0';
+
+	h = kore_split_string(headers, "\r\n", lines, 10);
+	for (i = 0; i < h; i++) {
+		if ((p = strchr(lines[i], ':')) == NULL)
+			continue;
+
+		*(p++) = '\0';
+		if (strcasecmp(lines[i], "content-disposition"))
+			continue;
+
+		c = kore_split_string(p, ";", opt, 5);
+		for (j = 1; j < c; j++) {
+			for (p = opt[j]; isspace(*(unsigned char *)p); p++)
+				;
+
+			if ((val = strchr(p, '=')) == NULL)
+				continue;
+
+			*(val++) = '\0';
+			if (*val == '"') {
+				val++;
+				val[strcspn(val, "\"")] = '\0';
+			}
+
+			if (!strcasecmp(p, "name")) {
+				kore_strlcpy(mp->name, val, sizeof(mp->name));
+			} else if (!strcasecmp(p, "filename")) {
+				mp->file = 1;
+				kore_strlcpy(mp->filename, val,
+				    sizeof(mp->filename));
+			}
+		}
+
+		break;
+	}
+
+	if (mp->begin != NULL && !mp->begin(mp))
+		return (KORE_RESULT_ERROR);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http_multipart_emit(struct http_multipart *mp, const u_int8_t *d, size_t len)
+{
+	ssize_t		r;
+
+	if (mp->fd == -1) {
+		if (len > 0 && mp->data != NULL)
+			return (mp->data(mp, d, len));
+		return (KORE_RESULT_OK);
+	}
+
+	while (len > 0) {
+		if ((r = write(mp->fd, d, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			kore_log(LOG_ERR, "write(multipart): %s", errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+
+		d += r;
+		len -= r;
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http_multipart_form_begin(struct http_multipart *mp)
+{
+	struct multipart_form	*form = mp->arg;
+
+	form->part->offset = 0;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http_multipart_form_data(struct http_multipart *mp, const u_int8_t *d,
+    size_t len)
+{
+	struct multipart_form	*form = mp->arg;
+
+	kore_buf_append(form->part, d, len);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http_multipart_form_end(struct http_multipart *mp)
+{
+	u_int8_t		*data;
+	u_int32_t		len;
+	struct multipart_form	*form = mp->arg;
+
+	if (mp->name[0] == '\0')
+		return (KORE_RESULT_OK);
+
+	if (!mp->file) {
+		kore_buf_append(form->part, "\0", 1);
+		http_argument_add(mp->req, mp->name, form->part->data,
+		    form->part->offset - 1, HTTP_ARG_TYPE_STRING);
+		*form->count += 1;
+		return (KORE_RESULT_OK);
+	}
+
+	if (mp->filename[0] == '\0')
+		return (KORE_RESULT_OK);
+
+	/* The file keeps the data, start over for the next part. */
+	data = kore_buf_release(form->part, &len);
+	form->part = kore_buf_create(1024);
+
+	http_file_add(mp->req, mp->name, mp->filename, data, len);
+	*form->count += 1;
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Compress a response body for a handler that allows it, if the client
+ * accepts it and it is worth it. On success *d points to the compressed
+ * body, it stays valid until the next response is compressed.
+ */
+static void
+http_compress(struct http_request *req, int status, void **d, u_int32_t *len)
+{
+	int			r, enc, accept;
+	uLong			bound;
+	z_stream		*zs;
+	struct http_header	*hdr;
+
+	/* The response depends on accept-encoding, caches must know. */
+	http_response_header(req, "vary", "accept-encoding");
+
+	if (*d == NULL || *len < http_compress_min || status < 200 ||
+	    status == 204 || status == 206 || status == 304)
+		return;
+
+	TAILQ_FOREACH(hdr, &(req->resp_headers), list) {
+		if (!strcasecmp(hdr->header, "content-encoding"))
+			return;
+	}
+
+	if (!http_compress_type(req))
+		return;
+
+	accept = http_compress_accept(req);
+	for (enc = 0; enc < HTTP_COMPRESS_MAX; enc++) {
+		if (accept & (1 << enc))
+			break;
+	}
+
+	if (enc == HTTP_COMPRESS_MAX)
+		return;
+
+	if ((zs = http_compress_stream(enc)) == NULL)
+		return;
+
+	/* Sized so a single deflate() call always finishes. */
+	bound = deflateBound(zs, *len);
+	if (bound > http_zbuf_len) {
+		http_zbuf = kore_realloc(http_zbuf, bound);
+		http_zbuf_len = bound;
+	}
+
+	zs->next_in = *d;
+	zs->avail_in = *len;
+	zs->next_out = http_zbuf;
+	zs->avail_out = http_zbuf_len;
+
+	r = deflate(zs, Z_FINISH);
+	if (r != Z_STREAM_END) {
+		kore_log(LOG_NOTICE, "deflate(): %d", r);
+		(void)deflateReset(zs);
+		return;
+	}
+
+	kore_debug("http_compress(%p): %u -> %lu", req, *len, zs->total_out);
+
+	if (zs->total_out < *len) {
+		http_response_header(req, "content-encoding",
+		    (enc == HTTP_COMPRESS_GZIP) ? "gzip" : "deflate");
+		*d = http_zbuf;
+		*len = zs->total_out;
+	}
+
+	(void)deflateReset(zs);
+}
+
+/*
+ * Returns the encodings the accept-encoding header allows as a mask of
+ * 1 << HTTP_COMPRESS_*, any non zero q-value counts.
+ */
+static int
+http_compress_accept(struct http_request *req)
+{
+	const char	*value, *end, *p, *tok, *q;
+	u_int32_t	vlen;
+	size_t		tlen;
+	int		i, zero, accept[HTTP_COMPRESS_MAX], any, mask;
+
+	if (!http_request_header_ref(req, "accept-encoding", &value, &vlen))
+		return (0);
+
+	any = -1;
+	for (i = 0; i < HTTP_COMPRESS_MAX; i++)
+		accept[i] = -1;
+
+	end = value + vlen;
+	for (p = value; p < end; p++) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+
+		tok = p;
+		while (p < end && *p != ',' && *p != ';' &&
+		    *p != ' ' && *p != '\t')
+			p++;
+		tlen = p - tok;
+
+		zero = 0;
+		while (p < end && *p != ',') {
+			if (*p == 'q' && p + 1 < end && p[1] == '=') {
+				q = p + 2;
+				zero = (q < end && *q == '0');
+				for (q++; q < end && zero && *q != ',' &&
+				    *q != ' ' && *q != ';'; q++) {
+					if (*q != '.' && *q != '0')
+						zero = 0;
+				}
+			}
+			p++;
+		}
+
+		if (tlen == 4 && !strncasecmp(tok, "gzip", 4))
+			accept[HTTP_COMPRESS_GZIP] = !zero;
+		else if (tlen == 7 && !strncasecmp(tok, "deflate", 7))
+			accept[HTTP_COMPRESS_DEFLATE] = !zero;
+		else if (tlen == 1 && *tok == '*')
+			any = !zero;
+	}
+
+	mask = 0;
+	for (i = 0; i < HTTP_COMPRESS_MAX; i++) {
+		if (accept[i] == 1 || (accept[i] == -1 && any == 1))
+			mask |= 1 << i;
+	}
+
+	return (mask);
+}
+
+/* Does etag appear in the if-none-match header, weak or not. */
+int
+http_etag_match(struct http_request *req, const char *etag)
+{
+	const char	*value, *end, *p, *tok;
+	u_int32_t	vlen;
+	size_t		len;
+
+	if (!http_request_header_ref(req, "if-none-match", &value, &vlen))
+		return (0);
+
+	len = strlen(etag);
+	end = value + vlen;
+
+	for (p = value; p < end; p++) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+
+		if (end - p >= 2 && p[0] == 'W' && p[1] == '/')
+			p += 2;
+
+		tok = p;
+		while (p < end && *p != ',' && *p != ' ' && *p != '\t')
+			p++;
+
+		if ((size_t)(p - tok) == len && !memcmp(tok, etag, len))
+			return (1);
+		if (p - tok == 1 && *tok == '*')
+			return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * Can a response with the given etag and modification time, NULL and 0
+ * when unknown, be answered with a 304. If-none-match wins,
+ * if-modified-since only counts without it.
+ */
+int
+http_not_modified(struct http_request *req, const char *etag, time_t mtime)
+{
+	char		*date;
+	time_t		since;
+	const char	*value;
+	u_int32_t	vlen;
+
+	if (http_request_header_ref(req, "if-none-match", &value, &vlen))
+		return (etag != NULL && http_etag_match(req, etag));
+
+	if (mtime == 0 || !http_request_header(req, "if-modified-since", &date))
+		return (0);
+
+	since = kore_date_to_time(date);
+	kore_mem_free(date);
+
+	return (since != 0 && mtime <= since);
+}
+
+static int
+http_compress_type(struct http_request *req)
+{
+	int				i;
+	size_t				len;
+	const char			*type;
+	struct http_header		*hdr;
+	struct http_compress_type	*ct;
+
+	type = NULL;
+	TAILQ_FOREACH(hdr, &(req->resp_headers), list) {
+		if (!strcasecmp(hdr->header, "content-type")) {
+			type = hdr->value;
+			break;
+		}
+	}
+
+	/* Without a content-type the body could already be compressed. */
+	if (type == NULL)
+		return (0);
+
+	len = strcspn(type, "; \t");
+
+	if (TAILQ_EMPTY(&http_compress_types)) {
+		for (i = 0; http_compress_defaults[i] != NULL; i++) {
+			if (http_compress_match(http_compress_defaults[i],
+			    strlen(http_compress_defaults[i]), type, len))
+				return (1);
+		}
+
+		return (0);
+	}
+
+	TAILQ_FOREACH(ct, &http_compress_types, list) {
+		if (http_compress_match(ct->type, ct->len, type, len))
+			return (1);
+	}
+
+	return (0);
+}
+
+/* Matches type against pattern, a * subtype in the pattern takes any. */
+static int
+http_compress_match(const char *pattern, size_t plen, const char *type,
+    size_t tlen)
+{
+	if (plen > 2 && pattern[plen - 2] == '/' && pattern[plen - 1] == '*')
+		return (tlen > plen - 1 &&
+		    !strncasecmp(pattern, type, plen - 1));
+
+	return (plen == tlen && !strncasecmp(pattern, type, plen));
+}
+
+static z_stream *
+http_compress_stream(int enc)
+{
+	int		r, bits;
+	z_stream	*zs = &http_zstreams[enc];
+
+	if (http_zstreams_ready[enc])
+		return (zs);
+
+	/* 15 bits of window for zlib, 16 more turns on the gzip wrapper. */
+	bits = (enc == HTTP_COMPRESS_GZIP) ? 15 + 16 : 15;
+
+	memset(zs, 0, sizeof(*zs));
+	r = deflateInit2(zs, http_compress_level, Z_DEFLATED, bits, 8,
+	    Z_DEFAULT_STRATEGY);
+	if (r != Z_OK) {
+		kore_log(LOG_ERR, "deflateInit2(): %d", r);
+		return (NULL);
+	}
+
+	http_zstreams_ready[enc] = 1;
+
+	return (zs);
+}
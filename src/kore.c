@@ -22,6 +22,13 @@
 #include <signal.h>
 
 #include "kore.h"
+#include "http.h"
+
+#if defined(SO_REUSEPORT_LB)
+#define KORE_SO_REUSEPORT	SO_REUSEPORT_LB
+#elif defined(__linux__) && defined(SO_REUSEPORT)
+#define KORE_SO_REUSEPORT	SO_REUSEPORT
+#endif
 
 volatile sig_atomic_t			sig_recv;
 
@@ -37,6 +44,7 @@ char			*chroot_path = NULL;
 int			skip_runas = 0;
 char			*runas_user = NULL;
 u_int32_t		kore_socket_backlog = 5000;
+u_int8_t		kore_socket_reuseport = 0;
 char			*kore_pidfile = KORE_PIDFILE_DEFAULT;
 char			*kore_tls_cipher_list = KORE_DEFAULT_CIPHER_LIST;
 
@@ -45,6 +53,7 @@ static void	version(void);
 static void	kore_server_start(void);
 static void	kore_write_kore_pid(void);
 static void	kore_server_sslstart(void);
+static int	kore_server_reuseport(int);
 
 static void
 usage(void)
@@ -250,6 +259,9 @@ kore_server_bind(const char *ip, const char *port)
 	if (l->addrtype != AF_INET && l->addrtype != AF_INET6)
 		fatal("getaddrinfo(): unknown address family %d", l->addrtype);
 
+	l->addrlen = results->ai_addrlen;
+	memcpy(&(l->addr), results->ai_addr, l->addrlen);
+
 	if ((l->fd = socket(results->ai_family, SOCK_STREAM, 0)) == -1) {
 		kore_mem_free(l);
 		freeaddrinfo(results);
@@ -276,6 +288,14 @@ kore_server_bind(const char *ip, const char *port)
 		return (KORE_RESULT_ERROR);
 	}
 
+	if (kore_socket_reuseport && !kore_server_reuseport(l->fd)) {
+		close(l->fd);
+		kore_mem_free(l);
+		freeaddrinfo(results);
+		printf("failed to set SO_REUSEPORT: %s\n", errno_s);
+		return (KORE_RESULT_ERROR);
+	}
+
 	if (bind(l->fd, results->ai_addr, results->ai_addrlen) == -1) {
 		close(l->fd);
 		kore_mem_free(l);
@@ -287,7 +307,12 @@ kore_server_bind(const char *ip, const char *port)
 
 	freeaddrinfo(results);
 
-	if (listen(l->fd, kore_socket_backlog) == -1) {
+	/*
+	 * With SO_REUSEPORT the parent only holds on to the address,
+	 * each worker listens on its own socket (kore_server_worker_bind).
+	 */
+	if (!kore_socket_reuseport &&
+	    listen(l->fd, kore_socket_backlog) == -1) {
 		close(l->fd);
 		kore_mem_free(l);
 		kore_debug("listen(): %s", errno_s);
@@ -309,12 +334,65 @@ kore_server_bind(const char *ip, const char *port)
 	return (KORE_RESULT_OK);
 }
 
+void
+kore_server_worker_bind(void)
+{
+	struct listener		*l;
+	int			fd, on;
+
+	LIST_FOREACH(l, &listeners, list) {
+		if ((fd = socket(l->addrtype, SOCK_STREAM, 0)) == -1)
+			fatal("socket(): %s", errno_s);
+
+		if (!kore_connection_nonblock(fd, 1))
+			fatal("failed to make listener non blocking");
+
+		on = 1;
+		if (setsockopt(fd, SOL_SOCKET,
+		    SO_REUSEADDR, (const char *)&on, sizeof(on)) == -1)
+			fatal("setsockopt(SO_REUSEADDR): %s", errno_s);
+
+		if (!kore_server_reuseport(fd))
+			fatal("setsockopt(SO_REUSEPORT): %s", errno_s);
+
+		if (bind(fd, (struct sockaddr *)&(l->addr), l->addrlen) == -1)
+			fatal("worker bind(): %s", errno_s);
+
+		if (listen(fd, kore_socket_backlog) == -1)
+			fatal("worker listen(): %s", errno_s);
+
+		/* The parent keeps its own copy of the original socket. */
+		close(l->fd);
+		l->fd = fd;
+	}
+}
+
 void
 kore_signal(int sig)
 {
 	sig_recv = sig;
 }
 
+static int
+kore_server_reuseport(int fd)
+{
+#if defined(KORE_SO_REUSEPORT)
+	int		on;
+
+	on = 1;
+	if (setsockopt(fd, SOL_SOCKET,
+	    KORE_SO_REUSEPORT, (const char *)&on, sizeof(on)) == -1) {
+		kore_debug("setsockopt(): %s", errno_s);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+#else
+	errno = EOPNOTSUPP;
+	return (KORE_RESULT_ERROR);
+#endif
+}
+
 static void
 kore_server_sslstart(void)
 {
@@ -368,6 +446,7 @@ kore_server_start(void)
 			case SIGHUP:
 				kore_worker_dispatch_signal(sig_recv);
 				kore_module_reload(0);
+				http_cache_shm_flush();
 				break;
 			case SIGINT:
 			case SIGQUIT:
@@ -14,8 +14,10 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/param.h>
 #include <sys/epoll.h>
 #include <sys/prctl.h>
+#include <sys/sendfile.h>
 
 #include <sched.h>
 
@@ -29,9 +31,11 @@
 #include "tasks.h"
 #endif
 
+#if !defined(KORE_USE_URING)
 static int			efd = -1;
 static u_int32_t		event_count = 0;
 static struct epoll_event	*events = NULL;
+#endif
 
 void
 kore_platform_init(void)
@@ -61,6 +65,7 @@ kore_platform_worker_setcpu(struct kore_worker *kw)
 	}
 }
 
+#if !defined(KORE_USE_URING)
 void
 kore_platform_event_init(void)
 {
@@ -126,24 +131,7 @@ kore_platform_event_wait(u_int64_t timer)
 		switch (type) {
 		case KORE_TYPE_LISTENER:
 			l = (struct listener *)events[i].data.ptr;
-
-			while (worker_active_connections <
-			    worker_max_connections) {
-				if (worker_accept_threshold != 0 &&
-				    r >= worker_accept_threshold)
-					break;
-
-				if (!kore_connection_accept(l, &c)) {
-					r = 1;
-					break;
-				}
-
-				if (c == NULL)
-					break;
-
-				r++;
-				kore_platform_event_all(c->fd, c);
-			}
+			r += kore_connection_accept_batch(l);
 			break;
 		case KORE_TYPE_CONNECTION:
 			c = (struct connection *)events[i].data.ptr;
@@ -238,6 +226,7 @@ kore_platform_disable_accept(void)
 			fatal("kore_platform_disable_accept: %s", errno_s);
 	}
 }
+#endif /* !KORE_USE_URING */
 
 void
 kore_platform_proctitle(char *title)
@@ -246,3 +235,32 @@ kore_platform_proctitle(char *title)
 		kore_debug("prctl(): %s", errno_s);
 	}
 }
+
+int
+kore_platform_sendfile(struct connection *c, struct netbuf *nb)
+{
+	ssize_t		sent;
+	size_t		len;
+
+	len = MIN(nb->fd_len, INT_MAX);
+	if ((sent = sendfile(c->fd, nb->fd, &nb->fd_off, len)) == -1) {
+		switch (errno) {
+		case EINTR:
+		case EAGAIN:
+			c->flags &= ~CONN_WRITE_POSSIBLE;
+			return (KORE_RESULT_OK);
+		default:
+			kore_debug("sendfile(): %s", errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	if (sent == 0) {
+		kore_debug("sendfile(): file truncated");
+		return (KORE_RESULT_ERROR);
+	}
+
+	nb->fd_len -= sent;
+
+	return (KORE_RESULT_OK);
+}
@@ -17,11 +17,48 @@
 #include <sys/stat.h>
 
 #include <dlfcn.h>
+#include <time.h>
 
 #include "kore.h"
+#include "http.h"
+
+/*
+ * Per domain route index, rebuilt from dom->handlers whenever the
+ * configuration is loaded or the modules are reloaded. Static paths
+ * live in an open addressed hash table, dynamic paths are kept in
+ * configuration order together with the literal prefix their regex
+ * is anchored on so most of them are rejected without a regexec().
+ * The order field is the position of the handler in the configuration,
+ * a static hit only wins if no earlier dynamic handler matches.
+ */
+struct route_static {
+	u_int32_t			hash;
+	u_int32_t			order;
+	struct kore_module_handle	*hdlr;
+};
+
+struct route_dynamic {
+	u_int32_t			order;
+	size_t				plen;
+	char				*prefix;
+	struct kore_module_handle	*hdlr;
+};
+
+struct kore_route_table {
+	u_int32_t			mask;
+	u_int32_t			dcount;
+	struct route_static		*statics;
+	struct route_dynamic		*dynamics;
+};
+
+static char		*route_prefix(const char *);
+static void		route_table_free(struct kore_route_table *);
+static void		route_table_build(struct kore_domain *);
 
 static TAILQ_HEAD(, kore_module)	modules;
 
+struct kore_route_stats			route_stats;
+
 void
 kore_module_init(void)
 {
@@ -123,6 +160,8 @@ kore_module_reload(int cbs)
 
 	TAILQ_FOREACH(dom, &domains, list) {
 		TAILQ_FOREACH(hdlr, &(dom->handlers), list) {
+			if (hdlr->type == HANDLER_TYPE_FILEMAP)
+				continue;
 			hdlr->addr = kore_module_getsym(hdlr->func);
 			if (hdlr->func == NULL)
 				fatal("no function '%s' found", hdlr->func);
@@ -130,6 +169,7 @@ kore_module_reload(int cbs)
 		}
 	}
 
+	kore_module_routes_build();
 	kore_validator_reload();
 }
 
@@ -173,7 +213,14 @@ kore_module_handler_new(const char *path, const char *domain,
 	hdlr = kore_malloc(sizeof(*hdlr));
 	hdlr->auth = ap;
 	hdlr->dom = dom;
+	hdlr->flags = 0;
 	hdlr->errors = 0;
+	hdlr->cache_ttl = 0;
+	memset(hdlr->cache_vary, 0, sizeof(hdlr->cache_vary));
+	hdlr->root = NULL;
+	hdlr->params_count = 0;
+	hdlr->params_mask = 0;
+	hdlr->params_table = NULL;
 	hdlr->addr = addr;
 	hdlr->type = type;
 	TAILQ_INIT(&(hdlr->params));
@@ -192,29 +239,203 @@ kore_module_handler_new(const char *path, const char *domain,
 	}
 
 	TAILQ_INSERT_TAIL(&(dom->handlers), hdlr, list);
+
+	if (dom->routes != NULL) {
+		route_table_free(dom->routes);
+		dom->routes = NULL;
+	}
+
 	return (KORE_RESULT_OK);
 }
 
+/*
+ * A filemap serves the files under root for every path below the given
+ * one, with http_filemap_serve() standing in for a module callback.
+ */
+int
+kore_module_filemap_new(const char *path, const char *domain,
+    const char *root, const char *auth)
+{
+	size_t				len;
+	struct kore_auth		*ap;
+	struct kore_domain		*dom;
+	struct kore_module_handle	*hdlr;
+
+	kore_debug("kore_module_filemap_new(%s, %s, %s, %s)", path,
+	    domain, root, auth);
+
+	if (path[0] != '/' || root[0] == '\0')
+		return (KORE_RESULT_ERROR);
+
+	if ((dom = kore_domain_lookup(domain)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (auth != NULL) {
+		if ((ap = kore_auth_lookup(auth)) == NULL)
+			fatal("no authentication block '%s' found", auth);
+	} else {
+		ap = NULL;
+	}
+
+	hdlr = kore_malloc(sizeof(*hdlr));
+	memset(hdlr, 0, sizeof(*hdlr));
+	hdlr->auth = ap;
+	hdlr->dom = dom;
+	hdlr->addr = http_filemap_serve;
+	hdlr->type = HANDLER_TYPE_FILEMAP;
+	TAILQ_INIT(&(hdlr->params));
+	hdlr->path = kore_strdup(path);
+	hdlr->func = kore_strdup("filemap");
+	hdlr->root = kore_strdup(root);
+
+	len = strlen(hdlr->root);
+	while (len > 1 && hdlr->root[len - 1] == '/')
+		hdlr->root[--len] = '\0';
+
+	TAILQ_INSERT_TAIL(&(dom->handlers), hdlr, list);
+
+	if (dom->routes != NULL) {
+		route_table_free(dom->routes);
+		dom->routes = NULL;
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Besides the list, the parameter specs of a handler are kept in an open
+ * addressing table on their name hash. It is rebuilt for every spec
+ * added, which only happens while parsing the configuration.
+ */
+void
+kore_module_handler_param_add(struct kore_module_handle *hdlr,
+    struct kore_handler_params *p)
+{
+	struct kore_handler_params	*e;
+	u_int32_t			size, slot;
+
+	p->hash = kore_strhash(p->name);
+	TAILQ_INSERT_TAIL(&(hdlr->params), p, list);
+	hdlr->params_count++;
+
+	if (hdlr->params_table != NULL)
+		kore_mem_free(hdlr->params_table);
+
+	size = 8;
+	while (size < hdlr->params_count * 2)
+		size <<= 1;
+
+	hdlr->params_mask = size - 1;
+	hdlr->params_table = kore_calloc(size, sizeof(*hdlr->params_table));
+	memset(hdlr->params_table, 0, size * sizeof(*hdlr->params_table));
+
+	/* Inserted in list order, so the first duplicate is found first. */
+	TAILQ_FOREACH(e, &(hdlr->params), list) {
+		slot = e->hash & hdlr->params_mask;
+		while (hdlr->params_table[slot] != NULL)
+			slot = (slot + 1) & hdlr->params_mask;
+		hdlr->params_table[slot] = e;
+	}
+}
+
+struct kore_handler_params *
+kore_module_handler_param(struct kore_module_handle *hdlr, int method,
+    const char *name, u_int32_t hash)
+{
+	struct kore_handler_params	*p;
+	u_int32_t			slot;
+
+	if (hdlr->params_table == NULL)
+		return (NULL);
+
+	slot = hash & hdlr->params_mask;
+	while ((p = hdlr->params_table[slot]) != NULL) {
+		if (p->hash == hash && p->method == method &&
+		    !strcmp(p->name, name))
+			return (p);
+		slot = (slot + 1) & hdlr->params_mask;
+	}
+
+	return (NULL);
+}
+
+void
+kore_module_routes_build(void)
+{
+	struct kore_domain	*dom;
+
+	TAILQ_FOREACH(dom, &domains, list)
+		route_table_build(dom);
+}
+
 struct kore_module_handle *
 kore_module_handler_find(const char *domain, const char *path)
 {
+	struct timespec			start, end;
+	struct route_static		*rs;
+	struct route_dynamic		*rd;
+	struct kore_route_table		*rt;
 	struct kore_domain		*dom;
 	struct kore_module_handle	*hdlr;
+	u_int32_t			i, hash, order;
 
 	if ((dom = kore_domain_lookup(domain)) == NULL)
 		return (NULL);
 
-	TAILQ_FOREACH(hdlr, &(dom->handlers), list) {
-		if (hdlr->type == HANDLER_TYPE_STATIC) {
-			if (!strcmp(hdlr->path, path))
-				return (hdlr);
-		} else {
-			if (!regexec(&(hdlr->rctx), path, 0, NULL, 0))
-				return (hdlr);
+	if (dom->routes == NULL)
+		route_table_build(dom);
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &start);
+
+	hdlr = NULL;
+	order = UINT32_MAX;
+	rt = dom->routes;
+
+	if (rt->statics != NULL) {
+		hash = kore_strhash(path);
+		for (i = hash & rt->mask;; i = (i + 1) & rt->mask) {
+			rs = &(rt->statics[i]);
+			if (rs->hdlr == NULL)
+				break;
+			if (rs->hash == hash && !strcmp(rs->hdlr->path, path)) {
+				hdlr = rs->hdlr;
+				order = rs->order;
+				break;
+			}
 		}
 	}
 
-	return (NULL);
+	for (i = 0; i < rt->dcount; i++) {
+		rd = &(rt->dynamics[i]);
+		if (rd->order > order)
+			break;
+		if (rd->plen > 0 && strncmp(path, rd->prefix, rd->plen))
+			continue;
+
+		/* A filemap owns everything below its path. */
+		if (rd->hdlr->type == HANDLER_TYPE_FILEMAP) {
+			if (path[rd->plen] == '\0' || path[rd->plen] == '/' ||
+			    rd->prefix[rd->plen - 1] == '/') {
+				hdlr = rd->hdlr;
+				break;
+			}
+			continue;
+		}
+
+		route_stats.regexec_calls++;
+		if (!regexec(&(rd->hdlr->rctx), path, 0, NULL, 0)) {
+			hdlr = rd->hdlr;
+			break;
+		}
+	}
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &end);
+
+	route_stats.lookups++;
+	route_stats.lookup_ns += (end.tv_sec - start.tv_sec) * 1000000000 +
+	    (end.tv_nsec - start.tv_nsec);
+
+	return (hdlr);
 }
 
 void *
@@ -231,3 +452,143 @@ kore_module_getsym(const char *symbol)
 
 	return (NULL);
 }
+
+/*
+ * Returns the literal string a regex is anchored on, or NULL if it has
+ * none we can rely on. We only look at the leading run of ordinary
+ * characters after a '^' and drop the last one if it is followed by a
+ * quantifier. Any alternation in the pattern disqualifies it.
+ */
+static char *
+route_prefix(const char *regex)
+{
+	const char	*p;
+	size_t		len;
+	char		*prefix;
+
+	if (regex[0] != '^' || strchr(regex, '|') != NULL)
+		return (NULL);
+
+	for (p = regex + 1; *p != '\0'; p++) {
+		if (strchr(".[]()*+?{}^$\\", *p) != NULL)
+			break;
+	}
+
+	len = p - (regex + 1);
+	if (len > 0 && (*p == '*' || *p == '?' || *p == '{' || *p == '+'))
+		len--;
+
+	if (len == 0)
+		return (NULL);
+
+	prefix = kore_malloc(len + 1);
+	memcpy(prefix, regex + 1, len);
+	prefix[len] = '\0';
+
+	return (prefix);
+}
+
+static void
+route_table_free(struct kore_route_table *rt)
+{
+	u_int32_t	i;
+
+	for (i = 0; i < rt->dcount; i++) {
+		if (rt->dynamics[i].prefix != NULL)
+			kore_mem_free(rt->dynamics[i].prefix);
+	}
+
+	if (rt->statics != NULL)
+		kore_mem_free(rt->statics);
+	if (rt->dynamics != NULL)
+		kore_mem_free(rt->dynamics);
+
+	kore_mem_free(rt);
+}
+
+static void
+route_table_build(struct kore_domain *dom)
+{
+	struct route_static		*rs;
+	struct route_dynamic		*rd;
+	struct kore_route_table		*rt;
+	struct kore_module_handle	*hdlr;
+	u_int32_t			i, hash, order, nstatic, size, slot;
+
+	if (dom->routes != NULL)
+		route_table_free(dom->routes);
+
+	rt = kore_malloc(sizeof(*rt));
+	rt->mask = 0;
+	rt->dcount = 0;
+	rt->statics = NULL;
+	rt->dynamics = NULL;
+
+	nstatic = 0;
+	TAILQ_FOREACH(hdlr, &(dom->handlers), list) {
+		if (hdlr->type == HANDLER_TYPE_STATIC)
+			nstatic++;
+		else
+			rt->dcount++;
+	}
+
+	if (nstatic > 0) {
+		size = 8;
+		while (size < nstatic * 2)
+			size <<= 1;
+
+		rt->mask = size - 1;
+		rt->statics = kore_calloc(size, sizeof(struct route_static));
+		memset(rt->statics, 0, size * sizeof(struct route_static));
+	}
+
+	if (rt->dcount > 0) {
+		rt->dynamics = kore_calloc(rt->dcount,
+		    sizeof(struct route_dynamic));
+	}
+
+	i = 0;
+	order = 0;
+	TAILQ_FOREACH(hdlr, &(dom->handlers), list) {
+		if (hdlr->type == HANDLER_TYPE_DYNAMIC) {
+			rd = &(rt->dynamics[i++]);
+			rd->hdlr = hdlr;
+			rd->order = order++;
+			rd->prefix = route_prefix(hdlr->path);
+			rd->plen = (rd->prefix != NULL) ? strlen(rd->prefix) : 0;
+			continue;
+		}
+
+		if (hdlr->type == HANDLER_TYPE_FILEMAP) {
+			rd = &(rt->dynamics[i++]);
+			rd->hdlr = hdlr;
+			rd->order = order++;
+			rd->prefix = kore_strdup(hdlr->path);
+			rd->plen = strlen(rd->prefix);
+			continue;
+		}
+
+		hash = kore_strhash(hdlr->path);
+		for (slot = hash & rt->mask;; slot = (slot + 1) & rt->mask) {
+			rs = &(rt->statics[slot]);
+			if (rs->hdlr == NULL) {
+				rs->hash = hash;
+				rs->hdlr = hdlr;
+				rs->order = order;
+				break;
+			}
+
+			/* A duplicate path never wins over the first one. */
+			if (rs->hash == hash && !strcmp(rs->hdlr->path,
+			    hdlr->path))
+				break;
+		}
+
+		order++;
+	}
+
+	dom->routes = rt;
+
+	kore_debug("domain %s: %u static, %u dynamic routes", dom->domain,
+	    nstatic, rt->dcount);
+}
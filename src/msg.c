@@ -129,7 +129,8 @@ kore_msg_send(u_int16_t dst, u_int8_t id, void *data, u_int32_t len)
 	m.length = len;
 	m.src = worker->id;
 
-	net_send_queue(worker->msg[1], &m, sizeof(m), NULL, NETBUF_LAST_CHAIN);
+	net_send_queue_hint(worker->msg[1], &m, sizeof(m), sizeof(m) + len,
+	    NULL, NETBUF_LAST_CHAIN);
 	net_send_queue(worker->msg[1], data, len, NULL, NETBUF_LAST_CHAIN);
 	net_send_flush(worker->msg[1]);
 }
@@ -15,6 +15,7 @@
  */
 
 #include <sys/param.h>
+#include <sys/uio.h>
 
 #if defined(__linux__)
 #include <endian.h>
@@ -27,33 +28,89 @@
 #endif
 
 #include "kore.h"
+#include "http.h"
+
+static int	net_sendv(struct connection *);
+static void	net_recv_buf_get(struct netbuf *);
+static void	net_recv_buf_put(struct netbuf *);
+static void	net_recv_idle(void);
+static void	net_send_buf_alloc(struct netbuf *, u_int32_t);
+static int	net_send_fd_read(struct netbuf *);
+#if defined(KORE_USE_SENDFILE)
+static int	net_send_fd_file(struct connection *);
+#endif
+
+/*
+ * Receive buffers are only attached to a connection while it is reading
+ * a message. Idle connections keep their netbuf but not its buffer, which
+ * goes back into rb_pool until the connection becomes readable again.
+ */
+static struct kore_pool		rb_pool;
+
+/*
+ * Send buffers come from per-worker size classes, a netbuf remembers the
+ * pool it took its buffer from. Only payloads larger than the biggest
+ * class are allocated on their own.
+ */
+static struct kore_pool		send_pools[NET_SEND_CLASSES];
+static const u_int32_t		send_sizes[NET_SEND_CLASSES] = {
+	256, 1024, 8192, 65536
+};
+static const u_int32_t		send_elms[NET_SEND_CLASSES] = {
+	1000, 250, 64, 8
+};
 
 struct kore_pool		nb_pool;
+struct net_stats		net_stats;
+u_int8_t			net_send_strategy = NET_SEND_WRITE;
 
 void
 net_init(void)
 {
+	int		i;
+	char		name[32];
+
 	kore_pool_init(&nb_pool, "nb_pool", sizeof(struct netbuf), 1000);
+	kore_pool_init(&rb_pool, "rb_pool", http_header_max, 100);
+
+	for (i = 0; i < NET_SEND_CLASSES; i++) {
+		(void)snprintf(name, sizeof(name), "send_pool_%u",
+		    send_sizes[i]);
+		kore_pool_init(&send_pools[i], name, send_sizes[i],
+		    send_elms[i]);
+	}
 }
 
 void
 net_send_queue(struct connection *c, const void *data, u_int32_t len,
     struct spdy_stream *s, int before)
+{
+	net_send_queue_hint(c, data, len, len, s, before);
+}
+
+/*
+ * Queue data, if a new netbuf is needed its buffer is sized for at least
+ * hint bytes so whatever is queued right after it can share it.
+ */
+void
+net_send_queue_hint(struct connection *c, const void *data, u_int32_t len,
+    u_int32_t hint, struct spdy_stream *s, int before)
 {
 	const u_int8_t		*d;
 	struct netbuf		*nb;
 	u_int32_t		avail;
 
-	kore_debug("net_send_queue(%p, %p, %d, %p, %d)",
-	    c, data, len, s, before);
+	kore_debug("net_send_queue_hint(%p, %p, %d, %d, %p, %d)",
+	    c, data, len, hint, s, before);
 
 	d = data;
 	if (before == NETBUF_LAST_CHAIN) {
 		nb = TAILQ_LAST(&(c->send_queue), netbuf_head);
-		if (nb != NULL && !(nb->flags & NETBUF_IS_STREAM) &&
+		if (nb != NULL && nb->type == NETBUF_SEND &&
+		    !(nb->flags & NETBUF_IS_STREAM) &&
 		    nb->stream == s && nb->b_len < nb->m_len) {
 			avail = nb->m_len - nb->b_len;
-			if (len < avail) {
+			if (len <= avail) {
 				memcpy(nb->buf + nb->b_len, d, len);
 				nb->b_len += len;
 				return;
@@ -78,12 +135,7 @@ net_send_queue(struct connection *c, const void *data, u_int32_t len,
 	nb->b_len = len;
 	nb->type = NETBUF_SEND;
 
-	if (nb->b_len < NETBUF_SEND_PAYLOAD_MAX)
-		nb->m_len = NETBUF_SEND_PAYLOAD_MAX;
-	else
-		nb->m_len = nb->b_len;
-
-	nb->buf = kore_malloc(nb->m_len);
+	net_send_buf_alloc(nb, MAX(len, hint));
 	if (len > 0)
 		memcpy(nb->buf, d, nb->b_len);
 
@@ -110,6 +162,7 @@ net_send_stream(struct connection *c, void *data, u_int32_t len,
 	nb->stream = s;
 	nb->b_len = len;
 	nb->m_len = nb->b_len;
+	nb->pool = NULL;
 	nb->type = NETBUF_SEND;
 	nb->flags  = NETBUF_IS_STREAM;
 
@@ -118,6 +171,40 @@ net_send_stream(struct connection *c, void *data, u_int32_t len,
 		*out = nb;
 }
 
+/*
+ * Queue len bytes of fd from off. Without a cb the fd is closed once it
+ * was sent, otherwise the cb is called and the fd left alone.
+ */
+void
+net_send_fd(struct connection *c, int fd, off_t off, u_int64_t len,
+    struct spdy_stream *s, int (*cb)(struct netbuf *), struct netbuf **out)
+{
+	struct netbuf		*nb;
+
+	kore_debug("net_send_fd(%p, %d, %jd, %ju, %p)",
+	    c, fd, (intmax_t)off, (uintmax_t)len, s);
+
+	nb = kore_pool_get(&nb_pool);
+	nb->cb = cb;
+	nb->owner = c;
+	nb->s_off = 0;
+	nb->b_len = 0;
+	nb->m_len = 0;
+	nb->buf = NULL;
+	nb->pool = NULL;
+	nb->stream = s;
+	nb->flags = 0;
+	nb->type = NETBUF_SEND_FD;
+
+	nb->fd = fd;
+	nb->fd_off = off;
+	nb->fd_len = len;
+
+	TAILQ_INSERT_TAIL(&(c->send_queue), nb, list);
+	if (out != NULL)
+		*out = nb;
+}
+
 void
 net_recv_reset(struct connection *c, u_int32_t len, int (*cb)(struct netbuf *))
 {
@@ -129,14 +216,11 @@ net_recv_reset(struct connection *c, u_int32_t len, int (*cb)(struct netbuf *))
 	c->rnb->cb = cb;
 	c->rnb->s_off = 0;
 	c->rnb->b_len = len;
+	c->rnb->scan_off = 0;
 
-	if (c->rnb->b_len <= c->rnb->m_len &&
-	    c->rnb->m_len < (NETBUF_SEND_PAYLOAD_MAX / 2))
-		return;
-
-	kore_mem_free(c->rnb->buf);
-	c->rnb->m_len = len;
-	c->rnb->buf = kore_malloc(c->rnb->m_len);
+	/* The message is done, hand back the buffer until we read again. */
+	if (c->rnb->buf != NULL)
+		net_recv_buf_put(c->rnb);
 }
 
 void
@@ -153,17 +237,23 @@ net_recv_queue(struct connection *c, u_int32_t len, int flags,
 	c->rnb->owner = c;
 	c->rnb->s_off = 0;
 	c->rnb->b_len = len;
-	c->rnb->m_len = len;
+	c->rnb->m_len = 0;
+	c->rnb->scan_off = 0;
 	c->rnb->extra = NULL;
 	c->rnb->stream = NULL;
 	c->rnb->flags = flags;
 	c->rnb->type = NETBUF_RECV;
-	c->rnb->buf = kore_malloc(c->rnb->b_len);
+	c->rnb->buf = NULL;
+	c->rnb->pool = NULL;
+
+	net_recv_idle();
 }
 
 void
 net_recv_expand(struct connection *c, u_int32_t len, int (*cb)(struct netbuf *))
 {
+	u_int8_t	*buf;
+
 	kore_debug("net_recv_expand(): %p %d", c, len);
 
 	if (c->rnb->type != NETBUF_RECV)
@@ -171,8 +261,83 @@ net_recv_expand(struct connection *c, u_int32_t len, int (*cb)(struct netbuf *))
 
 	c->rnb->cb = cb;
 	c->rnb->b_len += len;
+
+	if (c->rnb->buf == NULL || c->rnb->b_len <= c->rnb->m_len)
+		return;
+
+	if (c->rnb->pool != NULL) {
+		buf = kore_malloc(c->rnb->b_len);
+		memcpy(buf, c->rnb->buf, c->rnb->s_off);
+		kore_pool_put(c->rnb->pool, c->rnb->buf);
+		c->rnb->pool = NULL;
+		c->rnb->buf = buf;
+	} else {
+		c->rnb->buf = kore_realloc(c->rnb->buf, c->rnb->b_len);
+	}
+
 	c->rnb->m_len = c->rnb->b_len;
-	c->rnb->buf = kore_realloc(c->rnb->buf, c->rnb->b_len);
+}
+
+void
+net_buf_release(struct netbuf *nb)
+{
+	if (nb->pool != NULL)
+		kore_pool_put(nb->pool, nb->buf);
+	else
+		kore_mem_free(nb->buf);
+
+	nb->buf = NULL;
+	nb->pool = NULL;
+}
+
+/*
+ * Hand the receive buffer over to the caller, the connection will borrow
+ * a new one when it reads again. The buffer goes back into *pool, or is
+ * freed if that is NULL.
+ */
+u_int8_t *
+net_recv_detach(struct connection *c, struct kore_pool **pool)
+{
+	u_int8_t	*buf;
+
+	if (c->rnb->buf == NULL)
+		fatal("net_recv_detach(): no buffer on %p", c);
+
+	buf = c->rnb->buf;
+	*pool = c->rnb->pool;
+
+	c->rnb->buf = NULL;
+	c->rnb->pool = NULL;
+	c->rnb->s_off = 0;
+	c->rnb->m_len = 0;
+	c->rnb->scan_off = 0;
+	net_recv_idle();
+
+	return (buf);
+}
+
+void
+net_recv_fill(struct connection *c, const void *data, u_int32_t len)
+{
+	if (len > c->rnb->b_len - c->rnb->s_off)
+		fatal("net_recv_fill(): %u bytes do not fit", len);
+
+	if (c->rnb->buf == NULL)
+		net_recv_buf_get(c->rnb);
+
+	memcpy(c->rnb->buf + c->rnb->s_off, data, len);
+	c->rnb->s_off += len;
+}
+
+void
+net_recv_free(struct connection *c)
+{
+	if (c->rnb->buf != NULL)
+		net_recv_buf_put(c->rnb);
+
+	net_stats.recv_idle--;
+	kore_pool_put(&nb_pool, c->rnb);
+	c->rnb = NULL;
 }
 
 int
@@ -182,6 +347,19 @@ net_send(struct connection *c)
 	u_int32_t		len, smin;
 
 	c->snb = TAILQ_FIRST(&(c->send_queue));
+	if (c->snb->type == NETBUF_SEND_FD) {
+#if defined(KORE_USE_SENDFILE)
+		if (c->write == net_write)
+			return (net_send_fd_file(c));
+#if defined(KORE_USE_URING)
+		if (c->write == net_write_uring)
+			return (net_send_fd_file(c));
+#endif
+#endif
+		if (!net_send_fd_read(c->snb))
+			return (KORE_RESULT_ERROR);
+	}
+
 	if (c->snb->b_len != 0) {
 		if (c->snb->stream != NULL &&
 		    (c->snb->stream->flags & SPDY_DATAFRAME_PRELUDE)) {
@@ -201,11 +379,14 @@ net_send(struct connection *c)
 
 		len = MIN(NETBUF_SEND_PAYLOAD_MAX, smin);
 
+		net_stats.send_calls++;
 		if (!c->write(c, len, &r))
 			return (KORE_RESULT_ERROR);
 		if (!(c->flags & CONN_WRITE_POSSIBLE))
 			return (KORE_RESULT_OK);
 
+		net_stats.send_bytes += r;
+
 		kore_debug("net_send(%p/%d/%d bytes), progress with %d",
 		    c->snb, c->snb->s_off, c->snb->b_len, r);
 
@@ -215,8 +396,10 @@ net_send(struct connection *c)
 			spdy_update_wsize(c, c->snb->stream, r);
 	}
 
-	if (c->snb->s_off == c->snb->b_len ||
+	if ((c->snb->s_off == c->snb->b_len &&
+	    (c->snb->type != NETBUF_SEND_FD || c->snb->fd_len == 0)) ||
 	    (c->snb->flags & NETBUF_FORCE_REMOVE)) {
+		net_stats.send_netbufs++;
 		net_remove_netbuf(&(c->send_queue), c->snb);
 		c->snb = NULL;
 	}
@@ -231,8 +414,15 @@ net_send_flush(struct connection *c)
 
 	while (!TAILQ_EMPTY(&(c->send_queue)) &&
 	    (c->flags & CONN_WRITE_POSSIBLE)) {
-		if (!net_send(c))
-			return (KORE_RESULT_ERROR);
+		/* Only plaintext connections can gather their netbufs. */
+		if (net_send_strategy == NET_SEND_WRITEV &&
+		    c->write == net_write) {
+			if (!net_sendv(c))
+				return (KORE_RESULT_ERROR);
+		} else {
+			if (!net_send(c))
+				return (KORE_RESULT_ERROR);
+		}
 	}
 
 	if ((c->flags & CONN_CLOSE_EMPTY) && TAILQ_EMPTY(&(c->send_queue)))
@@ -252,6 +442,8 @@ net_recv_flush(struct connection *c)
 		fatal("net_recv_flush(): c->rnb == NULL");
 
 	while (c->flags & CONN_READ_POSSIBLE) {
+		if (c->rnb->buf == NULL)
+			net_recv_buf_get(c->rnb);
 		if (!c->read(c, &r))
 			return (KORE_RESULT_ERROR);
 		if (!(c->flags & CONN_READ_POSSIBLE))
@@ -269,6 +461,10 @@ net_recv_flush(struct connection *c)
 		}
 	}
 
+	/* Nothing came in after all. */
+	if (c->rnb->buf != NULL && c->rnb->s_off == 0)
+		net_recv_buf_put(c->rnb);
+
 	return (KORE_RESULT_OK);
 }
 
@@ -287,8 +483,15 @@ net_remove_netbuf(struct netbuf_head *list, struct netbuf *nb)
 		return;
 	}
 
-	if (!(nb->flags & NETBUF_IS_STREAM)) {
-		kore_mem_free(nb->buf);
+	if (nb->type == NETBUF_SEND_FD) {
+		if (nb->buf != NULL)
+			net_buf_release(nb);
+		if (nb->cb != NULL)
+			(void)nb->cb(nb);
+		else
+			close(nb->fd);
+	} else if (!(nb->flags & NETBUF_IS_STREAM)) {
+		net_buf_release(nb);
 	} else if (nb->cb != NULL) {
 		(void)nb->cb(nb);
 	}
@@ -297,6 +500,139 @@ net_remove_netbuf(struct netbuf_head *list, struct netbuf *nb)
 	kore_pool_put(&nb_pool, nb);
 }
 
+static int
+net_sendv(struct connection *c)
+{
+	ssize_t			r;
+	u_int32_t		len;
+	int			iovcnt;
+	struct netbuf		*nb, *next;
+	struct iovec		iov[NET_SEND_IOV_MAX];
+
+	/* SPDY streams and files are handled by net_send(). */
+	nb = TAILQ_FIRST(&(c->send_queue));
+	if (nb->stream != NULL || nb->type != NETBUF_SEND)
+		return (net_send(c));
+
+	iovcnt = 0;
+	TAILQ_FOREACH(nb, &(c->send_queue), list) {
+		if (iovcnt == NET_SEND_IOV_MAX ||
+		    nb->stream != NULL || nb->type != NETBUF_SEND)
+			break;
+		if (nb->s_off == nb->b_len)
+			continue;
+
+		iov[iovcnt].iov_base = nb->buf + nb->s_off;
+		iov[iovcnt].iov_len = nb->b_len - nb->s_off;
+		iovcnt++;
+	}
+
+	kore_debug("net_sendv(%p): %d netbufs", c, iovcnt);
+
+	r = 0;
+	if (iovcnt > 0) {
+		net_stats.send_calls++;
+		if ((r = writev(c->fd, iov, iovcnt)) == -1) {
+			switch (errno) {
+			case EINTR:
+			case EAGAIN:
+				c->flags &= ~CONN_WRITE_POSSIBLE;
+				return (KORE_RESULT_OK);
+			default:
+				kore_debug("writev: %s", errno_s);
+				return (KORE_RESULT_ERROR);
+			}
+		}
+
+		net_stats.send_bytes += r;
+	}
+
+	/*
+	 * Advance over everything that went out in this write, a
+	 * netbuf callback may queue new data at the tail as we go.
+	 */
+	for (nb = TAILQ_FIRST(&(c->send_queue)); nb != NULL; nb = next) {
+		next = TAILQ_NEXT(nb, list);
+		if (nb->stream != NULL || nb->type != NETBUF_SEND)
+			break;
+
+		len = MIN((size_t)r, nb->b_len - nb->s_off);
+		nb->s_off += len;
+		r -= len;
+
+		if (nb->s_off != nb->b_len)
+			break;
+
+		net_stats.send_netbufs++;
+		net_remove_netbuf(&(c->send_queue), nb);
+	}
+
+	c->snb = NULL;
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Fill the bounce buffer of a file netbuf once everything in it went out,
+ * used for connections that cannot use sendfile() (TLS).
+ */
+static int
+net_send_fd_read(struct netbuf *nb)
+{
+	ssize_t			r;
+	size_t			len;
+
+	if (nb->s_off != nb->b_len || nb->fd_len == 0)
+		return (KORE_RESULT_OK);
+
+	if (nb->buf == NULL)
+		net_send_buf_alloc(nb, NETBUF_SEND_PAYLOAD_MAX);
+
+	len = MIN(nb->m_len, nb->fd_len);
+	if ((r = pread(nb->fd, nb->buf, len, nb->fd_off)) == -1) {
+		if (errno == EINTR)
+			return (KORE_RESULT_OK);
+		kore_debug("pread(): %s", errno_s);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (r == 0) {
+		kore_debug("net_send_fd_read(%p): file truncated", nb);
+		return (KORE_RESULT_ERROR);
+	}
+
+	nb->s_off = 0;
+	nb->b_len = r;
+	nb->fd_off += r;
+	nb->fd_len -= r;
+
+	return (KORE_RESULT_OK);
+}
+
+#if defined(KORE_USE_SENDFILE)
+static int
+net_send_fd_file(struct connection *c)
+{
+	u_int64_t		len;
+
+	len = c->snb->fd_len;
+
+	net_stats.send_calls++;
+	if (!kore_platform_sendfile(c, c->snb))
+		return (KORE_RESULT_ERROR);
+
+	net_stats.send_bytes += len - c->snb->fd_len;
+
+	if (c->snb->fd_len == 0) {
+		net_stats.send_netbufs++;
+		net_remove_netbuf(&(c->send_queue), c->snb);
+		c->snb = NULL;
+	}
+
+	return (KORE_RESULT_OK);
+}
+#endif
+
 #if !defined(KORE_NO_TLS)
 int
 net_write_ssl(struct connection *c, int len, int *written)
@@ -383,7 +719,12 @@ net_read(struct connection *c, int *bytes)
 
 	r = read(c->fd, (c->rnb->buf + c->rnb->s_off),
 	    (c->rnb->b_len - c->rnb->s_off));
-	if (r <= 0) {
+	if (r == 0) {
+		kore_debug("read(): peer closed connection");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (r <= -1) {
 		switch (errno) {
 		case EINTR:
 		case EAGAIN:
@@ -452,3 +793,58 @@ net_write64(u_int8_t *p, u_int64_t n)
 	r = htobe64(n);
 	memcpy(p, &r, sizeof(r));
 }
+
+static void
+net_recv_buf_get(struct netbuf *nb)
+{
+	if (nb->b_len <= rb_pool.elen) {
+		nb->pool = &rb_pool;
+		nb->buf = kore_pool_get(nb->pool);
+		nb->m_len = rb_pool.elen;
+	} else {
+		nb->buf = kore_malloc(nb->b_len);
+		nb->m_len = nb->b_len;
+	}
+
+	net_stats.recv_idle--;
+}
+
+static void
+net_recv_buf_put(struct netbuf *nb)
+{
+	net_buf_release(nb);
+	nb->m_len = 0;
+
+	net_recv_idle();
+}
+
+static void
+net_recv_idle(void)
+{
+	u_int64_t	saved;
+
+	/* Every idle connection used to hold on to its own buffer. */
+	net_stats.recv_idle++;
+	saved = net_stats.recv_idle * rb_pool.elen;
+	if (saved > net_stats.recv_saved_max)
+		net_stats.recv_saved_max = saved;
+}
+
+static void
+net_send_buf_alloc(struct netbuf *nb, u_int32_t len)
+{
+	int		i;
+
+	for (i = 0; i < NET_SEND_CLASSES; i++) {
+		if (len <= send_sizes[i]) {
+			nb->pool = &send_pools[i];
+			nb->buf = kore_pool_get(nb->pool);
+			nb->m_len = send_sizes[i];
+			return;
+		}
+	}
+
+	nb->pool = NULL;
+	nb->m_len = len;
+	nb->buf = kore_malloc(nb->m_len);
+}
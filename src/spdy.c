@@ -332,14 +332,13 @@ spdy_header_block_release(struct connection *c,
 }
 
 int
-spdy_stream_get_header(struct spdy_header_block *s,
-    const char *header, char **out)
+spdy_stream_header_ref(struct spdy_header_block *s,
+    const char *header, const char **out, u_int32_t *len)
 {
-	char			*cmp;
 	u_int8_t		*p, *end;
-	u_int32_t		i, nlen, vlen;
+	u_int32_t		i, hlen, nlen, vlen;
 
-	kore_debug("spdy_stream_get_header(%p, %s) <%d>", s, header,
+	kore_debug("spdy_stream_header_ref(%p, %s) <%d>", s, header,
 	    s->header_pairs);
 
 	p = s->header_block + 4;
@@ -350,6 +349,7 @@ spdy_stream_get_header(struct spdy_header_block *s,
 		return (KORE_RESULT_ERROR);
 	}
 
+	hlen = strlen(header);
 	for (i = 0; i < s->header_pairs; i++) {
 		nlen = net_read32(p);
 		if ((int)nlen < 0 || (p + nlen + 4) > end) {
@@ -363,11 +363,10 @@ spdy_stream_get_header(struct spdy_header_block *s,
 			return (KORE_RESULT_ERROR);
 		}
 
-		cmp = (char *)(p + 4);
-		if (!strncasecmp(cmp, header, nlen)) {
-			cmp = (char *)(p + nlen + 8);
-			*out = kore_malloc(vlen + 1);
-			kore_strlcpy(*out, cmp, vlen + 1);
+		if (nlen == hlen &&
+		    !strncasecmp((char *)(p + 4), header, nlen)) {
+			*out = (const char *)(p + nlen + 8);
+			*len = vlen;
 			return (KORE_RESULT_OK);
 		}
 
@@ -377,6 +376,23 @@ spdy_stream_get_header(struct spdy_header_block *s,
 	return (KORE_RESULT_ERROR);
 }
 
+int
+spdy_stream_get_header(struct spdy_header_block *s,
+    const char *header, char **out)
+{
+	const char		*value;
+	u_int32_t		vlen;
+
+	if (!spdy_stream_header_ref(s, header, &value, &vlen))
+		return (KORE_RESULT_ERROR);
+
+	*out = kore_malloc(vlen + 1);
+	memcpy(*out, value, vlen);
+	(*out)[vlen] = '\0';
+
+	return (KORE_RESULT_OK);
+}
+
 void
 spdy_session_teardown(struct connection *c, u_int8_t err)
 {
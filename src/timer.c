@@ -19,81 +19,236 @@
 
 #include "kore.h"
 
-TAILQ_HEAD(timerlist, kore_timer)	kore_timers;
+/*
+ * Timers live on a hierarchical timing wheel with a 1ms tick. The first
+ * wheel covers the next 256ms with one slot per tick, every further
+ * level covers 64 slots of the level below it. Inserting and removing a
+ * timer is O(1), timers on the higher levels cascade down as the wheel
+ * turns. Anything beyond the last level is parked at its far end and
+ * reinserted once its slot comes around.
+ */
+#define TIMER_WHEEL_BITS	8
+#define TIMER_WHEEL_SIZE	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK	(TIMER_WHEEL_SIZE - 1)
+#define TIMER_LEVEL_BITS	6
+#define TIMER_LEVEL_SIZE	(1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVEL_MASK	(TIMER_LEVEL_SIZE - 1)
+#define TIMER_LEVELS		4
+
+#define TIMER_LEVEL_SHIFT(n)	(TIMER_WHEEL_BITS + ((n) * TIMER_LEVEL_BITS))
+#define TIMER_RANGE_MAX		((1ULL << TIMER_LEVEL_SHIFT(TIMER_LEVELS)) - 1)
+
+#define TIMER_WAIT_MAX		100
+
+static void	timer_insert(struct kore_timer *);
+static void	timer_unlink(struct kore_timer *);
+static void	timer_move(struct kore_timer_list *, struct kore_timer_list *);
+
+static struct kore_timer_list	wheel[TIMER_WHEEL_SIZE];
+static struct kore_timer_list	levels[TIMER_LEVELS][TIMER_LEVEL_SIZE];
+static u_int64_t		wheel_tick = 0;
+static u_int32_t		timer_count = 0;
 
 void
 kore_timer_init(void)
 {
-	TAILQ_INIT(&kore_timers);
+	int		i, n;
+
+	for (i = 0; i < TIMER_WHEEL_SIZE; i++)
+		TAILQ_INIT(&wheel[i]);
+
+	for (n = 0; n < TIMER_LEVELS; n++) {
+		for (i = 0; i < TIMER_LEVEL_SIZE; i++)
+			TAILQ_INIT(&levels[n][i]);
+	}
+
+	timer_count = 0;
+	wheel_tick = kore_time_ms();
 }
 
 struct kore_timer *
 kore_timer_add(void (*cb)(void *, u_int64_t), u_int64_t interval,
     void *arg, int flags)
 {
-	struct kore_timer	*timer, *t;
+	struct kore_timer	*timer;
 
 	timer = kore_malloc(sizeof(*timer));
 
 	timer->cb = cb;
 	timer->arg = arg;
+	timer->slot = NULL;
 	timer->flags = flags;
 	timer->interval = interval;
 	timer->nextrun = kore_time_ms() + timer->interval;
 
-	TAILQ_FOREACH(t, &kore_timers, list) {
-		if (t->nextrun > timer->nextrun) {
-			TAILQ_INSERT_BEFORE(t, timer, list);
-			return (timer);
-		}
-	}
+	timer_insert(timer);
 
-	TAILQ_INSERT_TAIL(&kore_timers, timer, list);
 	return (timer);
 }
 
 void
 kore_timer_remove(struct kore_timer *timer)
 {
-	TAILQ_REMOVE(&kore_timers, timer, list);
+	timer_unlink(timer);
 	kore_mem_free(timer);
 }
 
+void
+kore_timer_setup(struct kore_timer *timer, void (*cb)(void *, u_int64_t),
+    void *arg)
+{
+	timer->cb = cb;
+	timer->arg = arg;
+	timer->slot = NULL;
+	timer->nextrun = 0;
+	timer->interval = 0;
+	timer->flags = KORE_TIMER_EMBEDDED;
+}
+
+void
+kore_timer_schedule(struct kore_timer *timer, u_int64_t when)
+{
+	timer_unlink(timer);
+
+	timer->nextrun = when;
+	timer_insert(timer);
+}
+
+void
+kore_timer_cancel(struct kore_timer *timer)
+{
+	timer_unlink(timer);
+}
+
 u_int64_t
 kore_timer_run(u_int64_t now)
 {
-	struct kore_timer	*timer, *t;
-	u_int64_t		next_timer;
+	struct kore_timer_list	expired;
+	struct kore_timer	*timer;
+	u_int64_t		idx, lidx;
+	int			i, n, limit;
+
+	if (timer_count == 0) {
+		wheel_tick = now + 1;
+		return (TIMER_WAIT_MAX);
+	}
 
-	next_timer = 100;
+	TAILQ_INIT(&expired);
 
-	while ((timer = TAILQ_FIRST(&kore_timers)) != NULL) {
-		if (timer->nextrun > now) {
-			next_timer = timer->nextrun - now;
-			break;
-		}
+	while (wheel_tick <= now) {
+		idx = wheel_tick & TIMER_WHEEL_MASK;
 
-		TAILQ_REMOVE(&kore_timers, timer, list);
-		timer->cb(timer->arg, now);
+		/* First slot again, pull in timers from the next level(s). */
+		if (idx == 0) {
+			for (n = 0; n < TIMER_LEVELS; n++) {
+				lidx = (wheel_tick >> TIMER_LEVEL_SHIFT(n)) &
+				    TIMER_LEVEL_MASK;
+				timer_move(&levels[n][lidx], &expired);
+				while ((timer = TAILQ_FIRST(&expired)) != NULL) {
+					timer_unlink(timer);
+					timer_insert(timer);
+				}
 
-		if (timer->flags & KORE_TIMER_ONESHOT) {
-			kore_mem_free(timer);
-		} else {
-			timer->nextrun = now + timer->interval;
-			TAILQ_FOREACH(t, &kore_timers, list) {
-				if (t->nextrun > timer->nextrun) {
-					TAILQ_INSERT_BEFORE(t, timer, list);
+				if (lidx != 0)
 					break;
-				}
 			}
+		}
+
+		wheel_tick++;
+		timer_move(&wheel[idx], &expired);
+
+		while ((timer = TAILQ_FIRST(&expired)) != NULL) {
+			timer_unlink(timer);
+
+			/* Parked out of range, not due yet. */
+			if (timer->nextrun > now) {
+				timer_insert(timer);
+				continue;
+			}
+
+			timer->cb(timer->arg, now);
+
+			/* Rescheduled or owned by the caller. */
+			if (timer->slot != NULL ||
+			    (timer->flags & KORE_TIMER_EMBEDDED))
+				continue;
+
+			if (timer->flags & KORE_TIMER_ONESHOT) {
+				kore_mem_free(timer);
+			} else {
+				timer->nextrun = now + timer->interval;
+				timer_insert(timer);
+			}
+		}
+	}
+
+	if (timer_count == 0)
+		return (TIMER_WAIT_MAX);
+
+	/* Sleep until the next used slot or the next cascade. */
+	limit = MIN(TIMER_WAIT_MAX,
+	    TIMER_WHEEL_SIZE - (wheel_tick & TIMER_WHEEL_MASK));
+	for (i = 0; i < limit; i++) {
+		if (!TAILQ_EMPTY(&wheel[(wheel_tick + i) & TIMER_WHEEL_MASK]))
+			break;
+	}
+
+	return ((wheel_tick + i) - now);
+}
+
+static void
+timer_insert(struct kore_timer *timer)
+{
+	int			n;
+	u_int64_t		delta, expires;
+	struct kore_timer_list	*slot;
+
+	expires = timer->nextrun;
+
+	if (expires < wheel_tick) {
+		slot = &wheel[wheel_tick & TIMER_WHEEL_MASK];
+	} else if ((delta = expires - wheel_tick) < TIMER_WHEEL_SIZE) {
+		slot = &wheel[expires & TIMER_WHEEL_MASK];
+	} else {
+		if (delta > TIMER_RANGE_MAX) {
+			delta = TIMER_RANGE_MAX;
+			expires = wheel_tick + delta;
+		}
 
-			if (t == NULL)
-				TAILQ_INSERT_TAIL(&kore_timers, timer, list);
+		for (n = 0; n < TIMER_LEVELS - 1; n++) {
+			if (delta < (1ULL << TIMER_LEVEL_SHIFT(n + 1)))
+				break;
 		}
+
+		slot = &levels[n][(expires >> TIMER_LEVEL_SHIFT(n)) &
+		    TIMER_LEVEL_MASK];
 	}
 
-	if (next_timer > 1)
-		next_timer -= 1;
+	timer->slot = slot;
+	TAILQ_INSERT_TAIL(slot, timer, list);
+	timer_count++;
+}
 
-	return (next_timer);
+static void
+timer_unlink(struct kore_timer *timer)
+{
+	if (timer->slot == NULL)
+		return;
+
+	TAILQ_REMOVE(timer->slot, timer, list);
+	timer->slot = NULL;
+	timer_count--;
+}
+
+static void
+timer_move(struct kore_timer_list *from, struct kore_timer_list *to)
+{
+	struct kore_timer	*timer;
+
+	/* Timers always know their list so callbacks can cancel them. */
+	while ((timer = TAILQ_FIRST(from)) != NULL) {
+		TAILQ_REMOVE(from, timer, list);
+		TAILQ_INSERT_TAIL(to, timer, list);
+		timer->slot = to;
+	}
 }
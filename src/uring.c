@@ -0,0 +1,914 @@
+/*
+ * Copyright (c) 2015 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * io_uring event backend, replaces the epoll code in linux.c when
+ * built with URING=1.
+ *
+ * Every watched descriptor but the listeners gets a poll request
+ * (multishot for the edge triggered connections). Adding, changing,
+ * rearming and removing those are queued as SQEs and handed to the
+ * kernel in the same io_uring_enter() call that waits for completions,
+ * so there are no epoll_ctl() calls on the hot path anymore.
+ *
+ * Plaintext connections also do their reads and writes on the ring. A
+ * recv is kept pending on each of them, the kernel picks a buffer from
+ * a provided buffer ring once data arrives. Queued netbufs go out as
+ * send requests. Both complete through net_read_uring() and
+ * net_write_uring(), so the netbuf callbacks run as they did with
+ * read() and write(). Their poll only watches for POLLOUT, which
+ * sendfile() still needs.
+ *
+ * Listeners keep accepts in flight instead, as many as the accept
+ * budget allows. Each has its own slot the kernel writes the peer
+ * address into, which a multishot accept would share between all the
+ * connections it takes. Accepted descriptors are set up through
+ * kore_connection_adopt().
+ *
+ * Completions carry the descriptor, a generation number and the
+ * operation rather than a pointer, any completion for a generation that
+ * was removed is stale and dropped. Accept completions are never stale,
+ * a descriptor the kernel accepted has to be picked up regardless.
+ */
+
+#include <sys/param.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include <endian.h>
+#include <poll.h>
+
+#include "kore.h"
+
+#if defined(KORE_USE_PGSQL)
+#include "pgsql.h"
+#endif
+
+#if defined(KORE_USE_TASKS)
+#include "tasks.h"
+#endif
+
+#define URING_ENTRIES_MAX	4096
+#define URING_GEN_MASK		0xffffff
+#define URING_UDATA(f, g, o)	\
+	(((u_int64_t)(f) << 32) | ((u_int64_t)(g) << 8) | (o))
+
+#define URING_OP_MASK		0x07
+#define URING_OP_IGNORE		0
+#define URING_OP_POLL		1
+#define URING_OP_RECV		2
+#define URING_OP_SEND		3
+#define URING_OP_ACCEPT		4
+
+#define URING_ACCEPT_MAX	32
+#define URING_ACCEPT_SLOT(s)	((s) << 3)
+
+#define URING_RBUF_GROUP	0
+#define URING_RBUF_SIZE		4096
+#define URING_RBUF_MIN		8
+#define URING_RBUF_MAX		1024
+#define URING_RBUF_ID(f)	((f) >> IORING_CQE_BUFFER_SHIFT)
+
+#define URING_FD_RING		0x01
+#define URING_FD_RECV		0x02
+#define URING_FD_SEND		0x04
+#define URING_FD_SENT		0x08
+#define URING_FD_NOBUF		0x10
+
+struct uring_accept {
+	int		pending;
+	socklen_t	len;
+	union {
+		struct sockaddr_in	ipv4;
+		struct sockaddr_in6	ipv6;
+	} addr;
+};
+
+struct uring_fd {
+	void		*udata;
+	u_int32_t	events;
+	u_int32_t	gen;
+	int		level;
+	int		active;
+
+	/* Reads and writes on the ring, see URING_FD_*. */
+	int		flags;
+	int		sres;
+	u_int8_t	*rbuf;
+	u_int16_t	rbid;
+	u_int32_t	roff;
+	u_int32_t	rlen;
+
+	/* Accepts in flight on a listener. */
+	struct uring_accept	*accepts;
+	u_int32_t		naccepts;
+};
+
+static struct uring_fd	*uring_fd_get(int);
+static void		uring_poll_add(int, struct uring_fd *);
+static void		uring_poll_remove(int, struct uring_fd *);
+static void		uring_recv(int, struct uring_fd *);
+static void		uring_recv_done(struct connection *, int, u_int32_t);
+static void		uring_send(int, struct uring_fd *, void *, u_int32_t);
+static void		uring_send_done(struct connection *, int);
+static void		uring_accept(int, struct uring_fd *);
+static u_int32_t	uring_accept_done(int, u_int32_t, int);
+static void		uring_cancel(int, struct uring_fd *, u_int8_t);
+static void		uring_rbuf_init(void);
+static void		uring_rbuf_put(u_int16_t);
+static int		uring_enter(u_int32_t, u_int64_t);
+static struct io_uring_sqe	*uring_sqe(void);
+
+static int			ring_fd = -1;
+static u_int8_t			*ring = NULL;
+static size_t			ring_len = 0;
+static struct io_uring_sqe	*sqes = NULL;
+static size_t			sqes_len = 0;
+
+static u_int32_t		*sq_head, *sq_tail, *sq_mask, *sq_array;
+static u_int32_t		*cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe	*cqes;
+static u_int32_t		sq_entries = 0;
+static u_int32_t		sq_pending = 0;
+
+static struct uring_fd		*fds = NULL;
+static u_int32_t		fds_len = 0;
+
+static struct io_uring_buf_ring	*rbuf_ring = NULL;
+static u_int8_t			*rbufs = NULL;
+static size_t			rbufs_len = 0;
+static u_int32_t		rbuf_count = 0;
+static u_int16_t		rbuf_tail = 0;
+
+void
+kore_platform_event_init(void)
+{
+	struct io_uring_params		p;
+	u_int32_t			entries;
+
+	/* Workers inherit the ring from the parent, don't share it. */
+	if (ring_fd != -1) {
+		(void)munmap(ring, ring_len);
+		(void)munmap(sqes, sqes_len);
+		close(ring_fd);
+		kore_mem_free(fds);
+
+		if (rbuf_ring != NULL)
+			(void)munmap(rbuf_ring, rbufs_len);
+		rbuf_ring = NULL;
+		rbufs = NULL;
+
+		fds = NULL;
+		fds_len = 0;
+		sq_pending = 0;
+	}
+
+	entries = MIN(worker_max_connections + nlisteners * URING_ACCEPT_MAX,
+	    URING_ENTRIES_MAX);
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CLAMP;
+
+	ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring_fd == -1)
+		fatal("io_uring_setup(): %s", errno_s);
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG))
+		fatal("io_uring: kernel lacks required features");
+
+	ring_len = MAX(p.sq_off.array + p.sq_entries * sizeof(u_int32_t),
+	    p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+	ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED)
+		fatal("io_uring mmap(): %s", errno_s);
+
+	sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		fatal("io_uring mmap(): %s", errno_s);
+
+	sq_head = (u_int32_t *)(ring + p.sq_off.head);
+	sq_tail = (u_int32_t *)(ring + p.sq_off.tail);
+	sq_mask = (u_int32_t *)(ring + p.sq_off.ring_mask);
+	sq_array = (u_int32_t *)(ring + p.sq_off.array);
+	sq_entries = p.sq_entries;
+
+	cq_head = (u_int32_t *)(ring + p.cq_off.head);
+	cq_tail = (u_int32_t *)(ring + p.cq_off.tail);
+	cq_mask = (u_int32_t *)(ring + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+	uring_rbuf_init();
+}
+
+int
+kore_platform_event_wait(u_int64_t timer)
+{
+	u_int32_t		r;
+	struct connection	*c;
+	struct uring_fd		*ufd;
+	void			*udata;
+	u_int8_t		type, op;
+	int			fd, res;
+	u_int32_t		head, tail, gen, flags, events;
+	u_int64_t		ud;
+
+	if (uring_enter(1, timer) == -1) {
+		switch (errno) {
+		case EINTR:
+			return (0);
+		case ETIME:
+		case EBUSY:
+			break;
+		default:
+			fatal("io_uring_enter(): %s", errno_s);
+		}
+	}
+
+	r = 0;
+	head = *cq_head;
+	tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		res = cqes[head & *cq_mask].res;
+		flags = cqes[head & *cq_mask].flags;
+		ud = cqes[head & *cq_mask].user_data;
+
+		fd = ud >> 32;
+		op = ud & URING_OP_MASK;
+		gen = (ud >> 8) & URING_GEN_MASK;
+
+		if (op == URING_OP_IGNORE)
+			continue;
+
+		if (op == URING_OP_ACCEPT) {
+			r += uring_accept_done(fd,
+			    (ud >> 3) & (URING_ACCEPT_MAX - 1), res);
+			continue;
+		}
+
+		if ((u_int32_t)fd >= fds_len || !fds[fd].active ||
+		    fds[fd].gen != gen) {
+			/* The kernel may have taken a buffer for it. */
+			if (op == URING_OP_RECV &&
+			    (flags & IORING_CQE_F_BUFFER))
+				uring_rbuf_put(URING_RBUF_ID(flags));
+			continue;
+		}
+
+		ufd = &fds[fd];
+		if (op == URING_OP_RECV) {
+			uring_recv_done(ufd->udata, res, flags);
+			continue;
+		}
+
+		if (op == URING_OP_SEND) {
+			uring_send_done(ufd->udata, res);
+			continue;
+		}
+
+		/* Rearm oneshot polls or multishot ones the kernel ended. */
+		if (res >= 0 && !(flags & IORING_CQE_F_MORE))
+			uring_poll_add(fd, ufd);
+
+		if (res < 0) {
+			kore_debug("poll on %d failed: %s", fd, strerror(-res));
+			events = POLLERR;
+		} else {
+			events = res;
+		}
+
+		/* ufd may move if the callbacks below add descriptors. */
+		udata = ufd->udata;
+		type = *(u_int8_t *)udata;
+
+		if (events & POLLERR || events & POLLHUP) {
+			switch (type) {
+#if defined(KORE_USE_PGSQL)
+			case KORE_TYPE_PGSQL_CONN:
+				kore_pgsql_handle(udata, 1);
+				break;
+#endif
+#if defined(KORE_USE_TASKS)
+			case KORE_TYPE_TASK:
+				kore_task_handle(udata, 1);
+				break;
+#endif
+			default:
+				c = (struct connection *)udata;
+				kore_connection_disconnect(c);
+				break;
+			}
+
+			continue;
+		}
+
+		switch (type) {
+		case KORE_TYPE_CONNECTION:
+			c = (struct connection *)udata;
+			if (events & POLLIN &&
+			    !(c->flags & CONN_READ_BLOCK))
+				c->flags |= CONN_READ_POSSIBLE;
+			if (events & POLLOUT &&
+			    !(c->flags & CONN_WRITE_BLOCK))
+				c->flags |= CONN_WRITE_POSSIBLE;
+
+			if (!kore_connection_handle(c))
+				kore_connection_disconnect(c);
+			break;
+#if defined(KORE_USE_PGSQL)
+		case KORE_TYPE_PGSQL_CONN:
+			kore_pgsql_handle(udata, 0);
+			break;
+#endif
+#if defined(KORE_USE_TASKS)
+		case KORE_TYPE_TASK:
+			kore_task_handle(udata, 0);
+			break;
+#endif
+		default:
+			fatal("wrong type in event %d", type);
+		}
+	}
+
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+	return (r);
+}
+
+void
+kore_platform_event_all(int fd, void *c)
+{
+	struct uring_fd		*ufd;
+	struct connection	*conn = c;
+
+	if (rbufs == NULL || conn->read != net_read) {
+		kore_platform_event_schedule(fd,
+		    EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, 0, c);
+		return;
+	}
+
+	kore_platform_event_schedule(fd, EPOLLOUT | EPOLLET, 0, c);
+
+	ufd = &fds[fd];
+	ufd->flags = URING_FD_RING;
+	uring_recv(fd, ufd);
+
+	conn->read = net_read_uring;
+	conn->write = net_write_uring;
+	conn->flags |= CONN_WRITE_POSSIBLE;
+}
+
+void
+kore_platform_event_schedule(int fd, int type, int flags, void *udata)
+{
+	struct uring_fd		*ufd;
+
+	kore_debug("kore_platform_event_schedule(%d, %d, %d, %p)",
+	    fd, type, flags, udata);
+
+	ufd = uring_fd_get(fd);
+	if (ufd->active)
+		uring_poll_remove(fd, ufd);
+
+	ufd->active = 1;
+	ufd->udata = udata;
+	ufd->level = !(type & EPOLLET);
+	ufd->events = type & ~EPOLLET;
+
+	uring_poll_add(fd, ufd);
+}
+
+void
+kore_platform_schedule_read(int fd, void *data)
+{
+	kore_platform_event_schedule(fd, EPOLLIN, 0, data);
+}
+
+void
+kore_platform_disable_read(int fd)
+{
+	if ((u_int32_t)fd >= fds_len || !fds[fd].active)
+		return;
+
+	uring_poll_remove(fd, &fds[fd]);
+}
+
+/*
+ * Cancel everything on the ring for fd and submit that right away, so
+ * the caller can close the descriptor and have it released.
+ */
+void
+kore_uring_cancel(int fd)
+{
+	struct uring_fd		*ufd;
+
+	if ((u_int32_t)fd >= fds_len || !fds[fd].active)
+		return;
+
+	ufd = &fds[fd];
+	if (ufd->flags & URING_FD_RECV)
+		uring_cancel(fd, ufd, URING_OP_RECV);
+	if (ufd->flags & URING_FD_SEND)
+		uring_cancel(fd, ufd, URING_OP_SEND);
+	if (ufd->rbuf != NULL)
+		uring_rbuf_put(ufd->rbid);
+
+	ufd->flags = 0;
+	ufd->rbuf = NULL;
+	ufd->rlen = 0;
+
+	uring_poll_remove(fd, ufd);
+
+	if (uring_enter(0, 0) == -1 && errno != EINTR)
+		fatal("io_uring_enter(): %s", errno_s);
+}
+
+void
+kore_platform_enable_accept(void)
+{
+	struct listener		*l;
+	struct uring_fd		*ufd;
+
+	kore_debug("kore_platform_enable_accept()");
+
+	LIST_FOREACH(l, &listeners, list) {
+		ufd = uring_fd_get(l->fd);
+		ufd->active = 1;
+		ufd->udata = l;
+		uring_accept(l->fd, ufd);
+	}
+}
+
+/*
+ * Accepts that complete before their cancellation is seen still hand
+ * over their connection, see uring_accept_done().
+ */
+void
+kore_platform_disable_accept(void)
+{
+	u_int32_t		i;
+	struct listener		*l;
+	struct uring_fd		*ufd;
+
+	kore_debug("kore_platform_disable_accept()");
+
+	LIST_FOREACH(l, &listeners, list) {
+		if ((u_int32_t)l->fd >= fds_len || !fds[l->fd].active)
+			continue;
+
+		ufd = &fds[l->fd];
+		ufd->active = 0;
+
+		for (i = 0; i < URING_ACCEPT_MAX; i++) {
+			if (ufd->accepts[i].pending) {
+				uring_cancel(l->fd, ufd,
+				    URING_OP_ACCEPT | URING_ACCEPT_SLOT(i));
+			}
+		}
+	}
+}
+
+/*
+ * Hand out data from the buffer the last recv completed into. Once that
+ * is used up the next recv is queued and the connection waits for it.
+ */
+int
+net_read_uring(struct connection *c, int *bytes)
+{
+	u_int32_t		len;
+	struct uring_fd		*ufd;
+
+	ufd = &fds[c->fd];
+
+	if (ufd->flags & URING_FD_NOBUF) {
+		/* The buffer ring ran dry, read() until it would block. */
+		if (!net_read(c, bytes))
+			return (KORE_RESULT_ERROR);
+		if (c->flags & CONN_READ_POSSIBLE)
+			return (KORE_RESULT_OK);
+		ufd->flags &= ~URING_FD_NOBUF;
+	} else if (ufd->rbuf != NULL) {
+		len = MIN(ufd->rlen, c->rnb->b_len - c->rnb->s_off);
+		if (len == 0) {
+			kore_debug("net_read_uring(): no room in netbuf");
+			return (KORE_RESULT_ERROR);
+		}
+
+		memcpy(c->rnb->buf + c->rnb->s_off, ufd->rbuf + ufd->roff, len);
+		ufd->roff += len;
+		ufd->rlen -= len;
+
+		if (ufd->rlen == 0) {
+			uring_rbuf_put(ufd->rbid);
+			ufd->rbuf = NULL;
+		}
+
+		*bytes = len;
+		return (KORE_RESULT_OK);
+	}
+
+	if (!(ufd->flags & URING_FD_RECV))
+		uring_recv(c->fd, ufd);
+
+	c->flags &= ~CONN_READ_POSSIBLE;
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Report the result of the last send, or queue one for the netbuf at
+ * the head of the send queue and wait for it to complete.
+ */
+int
+net_write_uring(struct connection *c, int len, int *written)
+{
+	struct uring_fd		*ufd;
+
+	ufd = &fds[c->fd];
+
+	if (ufd->flags & URING_FD_SENT) {
+		ufd->flags &= ~URING_FD_SENT;
+		if (ufd->sres < 0) {
+			kore_debug("send: %s", strerror(-ufd->sres));
+			return (KORE_RESULT_ERROR);
+		}
+
+		*written = ufd->sres;
+		return (KORE_RESULT_OK);
+	}
+
+	if (!(ufd->flags & URING_FD_SEND)) {
+		/* Send all of the netbuf at once, a SPDY frame is capped. */
+		if (c->snb->stream == NULL)
+			len = c->snb->b_len - c->snb->s_off;
+		uring_send(c->fd, ufd, c->snb->buf + c->snb->s_off, len);
+	}
+
+	c->flags &= ~CONN_WRITE_POSSIBLE;
+	return (KORE_RESULT_OK);
+}
+
+static struct uring_fd *
+uring_fd_get(int fd)
+{
+	u_int32_t	len;
+
+	if ((u_int32_t)fd >= fds_len) {
+		len = MAX((u_int32_t)fd + 1, fds_len * 2);
+		fds = kore_realloc(fds, len * sizeof(struct uring_fd));
+		memset(&fds[fds_len], 0,
+		    (len - fds_len) * sizeof(struct uring_fd));
+		fds_len = len;
+	}
+
+	return (&fds[fd]);
+}
+
+static void
+uring_poll_add(int fd, struct uring_fd *ufd)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = uring_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->user_data = URING_UDATA(fd, ufd->gen, URING_OP_POLL);
+
+	/*
+	 * Multishot polls are edge triggered. For level triggered
+	 * interest use a oneshot poll that is rearmed after each
+	 * completion, it fires right away if the fd is still ready.
+	 */
+	if (!ufd->level)
+		sqe->len = IORING_POLL_ADD_MULTI;
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+	sqe->poll32_events = (ufd->events << 16) | (ufd->events >> 16);
+#else
+	sqe->poll32_events = ufd->events;
+#endif
+}
+
+static void
+uring_poll_remove(int fd, struct uring_fd *ufd)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = uring_sqe();
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = URING_UDATA(fd, ufd->gen, URING_OP_POLL);
+	sqe->user_data = URING_OP_IGNORE;
+
+	ufd->active = 0;
+	ufd->gen = (ufd->gen + 1) & URING_GEN_MASK;
+}
+
+static void
+uring_recv(int fd, struct uring_fd *ufd)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = uring_sqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->len = URING_RBUF_SIZE;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_RBUF_GROUP;
+	sqe->user_data = URING_UDATA(fd, ufd->gen, URING_OP_RECV);
+
+	ufd->flags |= URING_FD_RECV;
+}
+
+static void
+uring_recv_done(struct connection *c, int res, u_int32_t flags)
+{
+	struct uring_fd		*ufd;
+
+	ufd = &fds[c->fd];
+	ufd->flags &= ~URING_FD_RECV;
+
+	if (res == -ENOBUFS) {
+		ufd->flags |= URING_FD_NOBUF;
+	} else if (res <= 0) {
+		kore_debug("recv on %d: %s", c->fd,
+		    res == 0 ? "peer closed connection" : strerror(-res));
+		kore_connection_disconnect(c);
+		return;
+	} else {
+		ufd->rbid = URING_RBUF_ID(flags);
+		ufd->rbuf = rbufs + ufd->rbid * URING_RBUF_SIZE;
+		ufd->roff = 0;
+		ufd->rlen = res;
+	}
+
+	if (!(c->flags & CONN_READ_BLOCK))
+		c->flags |= CONN_READ_POSSIBLE;
+
+	if (!kore_connection_handle(c))
+		kore_connection_disconnect(c);
+}
+
+static void
+uring_send(int fd, struct uring_fd *ufd, void *data, u_int32_t len)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = uring_sqe();
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (u_int64_t)(uintptr_t)data;
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = URING_UDATA(fd, ufd->gen, URING_OP_SEND);
+
+	ufd->flags |= URING_FD_SEND;
+}
+
+static void
+uring_send_done(struct connection *c, int res)
+{
+	struct uring_fd		*ufd;
+
+	ufd = &fds[c->fd];
+	ufd->flags &= ~URING_FD_SEND;
+	ufd->flags |= URING_FD_SENT;
+	ufd->sres = res;
+
+	if (!(c->flags & CONN_WRITE_BLOCK))
+		c->flags |= CONN_WRITE_POSSIBLE;
+
+	if (!kore_connection_handle(c))
+		kore_connection_disconnect(c);
+}
+
+/*
+ * Keep as many accepts in flight on the listener as the accept budget
+ * allows, a connection they take counts against it only once it is set
+ * up so the ones in flight are deducted here.
+ */
+static void
+uring_accept(int fd, struct uring_fd *ufd)
+{
+	u_int32_t		i, want;
+	struct listener		*l;
+	struct io_uring_sqe	*sqe;
+	struct uring_accept	*acc;
+
+	if (ufd->accepts == NULL) {
+		ufd->accepts = kore_calloc(URING_ACCEPT_MAX,
+		    sizeof(struct uring_accept));
+		memset(ufd->accepts, 0,
+		    URING_ACCEPT_MAX * sizeof(struct uring_accept));
+	}
+
+	l = ufd->udata;
+	want = MIN(kore_connection_accept_budget(), URING_ACCEPT_MAX);
+
+	for (i = 0; i < URING_ACCEPT_MAX && ufd->naccepts < want; i++) {
+		acc = &ufd->accepts[i];
+		if (acc->pending)
+			continue;
+
+		acc->pending = 1;
+		if (l->addrtype == AF_INET)
+			acc->len = sizeof(acc->addr.ipv4);
+		else
+			acc->len = sizeof(acc->addr.ipv6);
+		ufd->naccepts++;
+
+		sqe = uring_sqe();
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = fd;
+		sqe->addr = (u_int64_t)(uintptr_t)&acc->addr;
+		sqe->addr2 = (u_int64_t)(uintptr_t)&acc->len;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		sqe->user_data = URING_UDATA(fd, ufd->gen,
+		    URING_OP_ACCEPT | URING_ACCEPT_SLOT(i));
+	}
+}
+
+/*
+ * Set up the connection an accept took, even if accepting was disabled
+ * since, and refill the listener. Returns how many accepts to report,
+ * like kore_connection_accept_batch() an error counts as one.
+ */
+static u_int32_t
+uring_accept_done(int fd, u_int32_t slot, int res)
+{
+	u_int32_t		r;
+	struct uring_fd		*ufd;
+	struct uring_accept	*acc;
+	struct connection	*c;
+
+	ufd = &fds[fd];
+	acc = &ufd->accepts[slot];
+	acc->pending = 0;
+	ufd->naccepts--;
+
+	r = 1;
+	if (res >= 0) {
+		if (kore_connection_adopt(ufd->udata, res, &acc->addr, &c))
+			kore_platform_event_all(c->fd, c);
+	} else {
+		switch (-res) {
+		case ECANCELED:
+		case ECONNABORTED:
+		case EINTR:
+		case EAGAIN:
+			/* Nothing was accepted. */
+			r = 0;
+			break;
+		default:
+			kore_debug("accept on %d: %s", fd, strerror(-res));
+			break;
+		}
+	}
+
+	/* ufd may have moved when the connection was added. */
+	ufd = &fds[fd];
+	if (ufd->active)
+		uring_accept(fd, ufd);
+
+	return (r);
+}
+
+static void
+uring_cancel(int fd, struct uring_fd *ufd, u_int8_t op)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = uring_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = URING_UDATA(fd, ufd->gen, op);
+	sqe->user_data = URING_OP_IGNORE;
+}
+
+/*
+ * Receive buffers are shared by all connections of a worker through a
+ * provided buffer ring, a recv only takes one once data came in. Without
+ * kernel support connections fall back to polling and read().
+ */
+static void
+uring_rbuf_init(void)
+{
+	u_int16_t		i;
+	struct io_uring_buf_reg	reg;
+
+	rbuf_count = URING_RBUF_MIN;
+	while (rbuf_count < MIN(worker_max_connections, URING_RBUF_MAX))
+		rbuf_count *= 2;
+
+	rbufs_len = rbuf_count *
+	    (sizeof(struct io_uring_buf) + URING_RBUF_SIZE);
+	rbuf_ring = mmap(NULL, rbufs_len, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (rbuf_ring == MAP_FAILED)
+		fatal("io_uring mmap(): %s", errno_s);
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (u_int64_t)(uintptr_t)rbuf_ring;
+	reg.ring_entries = rbuf_count;
+	reg.bgid = URING_RBUF_GROUP;
+
+	if (syscall(__NR_io_uring_register, ring_fd,
+	    IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		kore_debug("io_uring: no provided buffers: %s", errno_s);
+		(void)munmap(rbuf_ring, rbufs_len);
+		rbuf_ring = NULL;
+		return;
+	}
+
+	rbufs = (u_int8_t *)rbuf_ring +
+	    rbuf_count * sizeof(struct io_uring_buf);
+
+	rbuf_tail = 0;
+	for (i = 0; i < rbuf_count; i++)
+		uring_rbuf_put(i);
+}
+
+static void
+uring_rbuf_put(u_int16_t bid)
+{
+	struct io_uring_buf	*buf;
+
+	buf = &rbuf_ring->bufs[rbuf_tail & (rbuf_count - 1)];
+	buf->addr = (u_int64_t)(uintptr_t)(rbufs + bid * URING_RBUF_SIZE);
+	buf->len = URING_RBUF_SIZE;
+	buf->bid = bid;
+
+	rbuf_tail++;
+	__atomic_store_n(&rbuf_ring->tail, rbuf_tail, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *
+uring_sqe(void)
+{
+	u_int32_t		idx, tail;
+	struct io_uring_sqe	*sqe;
+
+	tail = *sq_tail;
+	while (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) ==
+	    sq_entries) {
+		if (uring_enter(0, 0) == -1 && errno != EINTR)
+			fatal("io_uring_enter(): %s", errno_s);
+	}
+
+	idx = tail & *sq_mask;
+	sqe = &sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+
+	sq_array[idx] = idx;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	sq_pending++;
+
+	return (sqe);
+}
+
+static int
+uring_enter(u_int32_t wait, u_int64_t timer)
+{
+	int					r;
+	struct __kernel_timespec		ts;
+	struct io_uring_getevents_arg		arg;
+
+	if (wait == 0) {
+		r = syscall(__NR_io_uring_enter, ring_fd,
+		    sq_pending, 0, 0, NULL, 0);
+	} else {
+		ts.tv_sec = timer / 1000;
+		ts.tv_nsec = (timer % 1000) * 1000000;
+
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (u_int64_t)(uintptr_t)&ts;
+
+		r = syscall(__NR_io_uring_enter, ring_fd, sq_pending, wait,
+		    IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+		    &arg, sizeof(arg));
+	}
+
+	if (r > 0)
+		sq_pending -= MIN((u_int32_t)r, sq_pending);
+
+	return (r);
+}
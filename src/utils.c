@@ -18,8 +18,22 @@
 
 #include <limits.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define KORE_MEM_FIND_SIMD	1
+#endif
+
 #include "kore.h"
 
+static u_int8_t	*mem_find_scalar(u_int8_t *, size_t, u_int8_t *, size_t);
+#if defined(KORE_MEM_FIND_SIMD)
+static u_int8_t	*mem_find_sse2(u_int8_t *, size_t, u_int8_t *, size_t);
+static u_int8_t	*mem_find_avx2(u_int8_t *, size_t, u_int8_t *, size_t)
+		    __attribute__((target("avx2")));
+#endif
+
+static u_int8_t	*(*mem_find)(u_int8_t *, size_t, u_int8_t *, size_t) = NULL;
+
 static struct {
 	char		*name;
 	int		value;
@@ -84,6 +98,27 @@ kore_log(int prio, const char *fmt, ...)
 	}
 }
 
+/* FNV-1a, used to key the string indexed tables. */
+u_int32_t
+kore_strhash(const char *str)
+{
+	return (kore_strhash_seed(2166136261U, str));
+}
+
+/* Continue a kore_strhash() over str, hash(a + b) == seed(hash(a), b). */
+u_int32_t
+kore_strhash_seed(u_int32_t hash, const char *str)
+{
+	const char	*p;
+
+	for (p = str; *p != '\0'; p++) {
+		hash ^= (u_int8_t)*p;
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
 void
 kore_strlcpy(char *dst, const char *src, size_t len)
 {
@@ -475,21 +510,23 @@ kore_base64_decode(char *in, u_int8_t **out, u_int32_t *olen)
 void *
 kore_mem_find(void *src, size_t slen, void *needle, u_int32_t len)
 {
-	u_int8_t	*p, *end;
-
-	end = (u_int8_t *)src + slen;
-	for (p = src; p < end; p++) {
-		if (*p != *(u_int8_t *)needle)
-			continue;
+	if (len == 0 || slen < len)
+		return (NULL);
 
-		if ((end - p) < len)
-			return (NULL);
+	if (len == 1)
+		return (memchr(src, *(u_int8_t *)needle, slen));
 
-		if (!memcmp(p, needle, len))
-			return (p);
+	if (mem_find == NULL) {
+		mem_find = mem_find_scalar;
+#if defined(KORE_MEM_FIND_SIMD)
+		if (__builtin_cpu_supports("avx2"))
+			mem_find = mem_find_avx2;
+		else
+			mem_find = mem_find_sse2;
+#endif
 	}
 
-	return (NULL);
+	return (mem_find(src, slen, needle, len));
 }
 
 void
@@ -508,3 +545,88 @@ fatal(const char *fmt, ...)
 	printf("kore: %s\n", buf);
 	exit(1);
 }
+
+static u_int8_t *
+mem_find_scalar(u_int8_t *src, size_t slen, u_int8_t *needle, size_t len)
+{
+	u_int8_t	*p, *end;
+
+	p = src;
+	end = src + slen;
+
+	while ((p = memchr(p, needle[0], end - p)) != NULL) {
+		if ((size_t)(end - p) < len)
+			return (NULL);
+
+		if (!memcmp(p, needle, len))
+			return (p);
+
+		p++;
+	}
+
+	return (NULL);
+}
+
+#if defined(KORE_MEM_FIND_SIMD)
+/*
+ * Compare the first and last byte of the needle against 16 (or 32)
+ * candidate positions at once and only memcmp() the positions where
+ * both match. What is left over at the end goes through the scalar
+ * version. Both require len >= 2 and slen >= len.
+ */
+static u_int8_t *
+mem_find_sse2(u_int8_t *src, size_t slen, u_int8_t *needle, size_t len)
+{
+	size_t		i, n;
+	u_int32_t	mask, bit;
+	__m128i		first, last, a, b;
+
+	n = slen - len + 1;
+	first = _mm_set1_epi8(needle[0]);
+	last = _mm_set1_epi8(needle[len - 1]);
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		a = _mm_loadu_si128((__m128i *)(src + i));
+		b = _mm_loadu_si128((__m128i *)(src + i + len - 1));
+		mask = _mm_movemask_epi8(_mm_and_si128(
+		    _mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+		while (mask != 0) {
+			bit = __builtin_ctz(mask);
+			if (!memcmp(src + i + bit + 1, needle + 1, len - 2))
+				return (src + i + bit);
+			mask &= mask - 1;
+		}
+	}
+
+	return (mem_find_scalar(src + i, slen - i, needle, len));
+}
+
+static u_int8_t *
+mem_find_avx2(u_int8_t *src, size_t slen, u_int8_t *needle, size_t len)
+{
+	size_t		i, n;
+	u_int32_t	mask, bit;
+	__m256i		first, last, a, b;
+
+	n = slen - len + 1;
+	first = _mm256_set1_epi8(needle[0]);
+	last = _mm256_set1_epi8(needle[len - 1]);
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		a = _mm256_loadu_si256((__m256i *)(src + i));
+		b = _mm256_loadu_si256((__m256i *)(src + i + len - 1));
+		mask = _mm256_movemask_epi8(_mm256_and_si256(
+		    _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+
+		while (mask != 0) {
+			bit = __builtin_ctz(mask);
+			if (!memcmp(src + i + bit + 1, needle + 1, len - 2))
+				return (src + i + bit);
+			mask &= mask - 1;
+		}
+	}
+
+	return (mem_find_sse2(src + i, slen - i, needle, len));
+}
+#endif
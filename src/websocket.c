@@ -106,8 +106,8 @@ kore_websocket_handshake(struct http_request *req, struct kore_wscbs *wscbs)
 	req->owner->rnb->flags &= ~NETBUF_CALL_CB_ALWAYS;
 
 	req->owner->wscbs = wscbs;
-	req->owner->idle_timer.start = kore_time_ms();
 	req->owner->idle_timer.length = kore_websocket_timeout;
+	kore_connection_start_idletimer(req->owner);
 
 	if (wscbs->connect != NULL)
 		wscbs->connect(req->owner);
@@ -23,6 +23,7 @@
 
 #include <fcntl.h>
 #include <grp.h>
+#include <inttypes.h>
 #include <pwd.h>
 #include <signal.h>
 
@@ -69,6 +70,7 @@ extern volatile sig_atomic_t	sig_recv;
 struct kore_worker		*worker = NULL;
 u_int8_t			worker_set_affinity = 1;
 u_int32_t			worker_accept_threshold = 0;
+u_int32_t			worker_accept_budget = 0;
 u_int32_t			worker_rlimit_nofiles = 1024;
 u_int32_t			worker_max_connections = 250;
 u_int32_t			worker_active_connections = 0;
@@ -98,6 +100,8 @@ kore_worker_init(void)
 	    sizeof(*accept_lock));
 	memset(kore_workers, 0, sizeof(struct kore_worker) * worker_count);
 
+	http_cache_shm_init();
+
 	kore_debug("kore_worker_init(): system has %d cpu's", cpu_count);
 	kore_debug("kore_worker_init(): starting %d workers", worker_count);
 
@@ -176,6 +180,8 @@ kore_worker_shutdown(void)
 		kore_log(LOG_NOTICE,
 		    "failed to deleted shm segment: %s", errno_s);
 	}
+
+	http_cache_shm_cleanup();
 }
 
 void
@@ -199,11 +205,15 @@ kore_worker_entry(struct kore_worker *kw)
 	struct rlimit		rl;
 	char			buf[16];
 	int			quit, had_lock, r;
-	u_int64_t		now, idle_check, next_lock, netwait;
+	u_int64_t		now, next_lock, netwait;
 	struct passwd		*pw = NULL;
 
 	worker = kw;
 
+	/* Own listening sockets, must happen before dropping privileges. */
+	if (kore_socket_reuseport)
+		kore_server_worker_bind();
+
 	/* Must happen before chroot. */
 	if (skip_runas == 0) {
 		pw = getpwnam(runas_user);
@@ -279,7 +289,6 @@ kore_worker_entry(struct kore_worker *kw)
 	quit = 0;
 	had_lock = 0;
 	next_lock = 0;
-	idle_check = 0;
 	kore_platform_event_init();
 	kore_accesslog_worker_init();
 	kore_msg_worker_init();
@@ -297,8 +306,11 @@ kore_worker_entry(struct kore_worker *kw)
 
 	for (;;) {
 		if (sig_recv != 0) {
-			if (sig_recv == SIGHUP)
+			if (sig_recv == SIGHUP) {
 				kore_module_reload(1);
+				http_cache_flush();
+				http_filemap_flush();
+			}
 			else if (sig_recv == SIGQUIT || sig_recv == SIGINT)
 				quit = 1;
 
@@ -308,7 +320,10 @@ kore_worker_entry(struct kore_worker *kw)
 		now = kore_time_ms();
 		netwait = kore_timer_run(now);
 
-		if (now > next_lock) {
+		/* Expired idle timers disconnect, close those before sleeping. */
+		kore_connection_prune(KORE_CONNECTION_PRUNE_DISCONNECT);
+
+		if (!kore_socket_reuseport && now > next_lock) {
 			if (kore_worker_acceptlock_obtain()) {
 				if (had_lock == 0) {
 					kore_platform_enable_accept();
@@ -317,6 +332,22 @@ kore_worker_entry(struct kore_worker *kw)
 			}
 		}
 
+		/* No accept lock needed, the kernel spreads connections. */
+		if (kore_socket_reuseport && had_lock == 0 &&
+		    worker_active_connections < worker_max_connections) {
+			worker->has_lock = 1;
+			kore_platform_enable_accept();
+			had_lock = 1;
+		}
+
+		/* Stop listening for new clients while we are full. */
+		if (worker->has_lock &&
+		    worker_active_connections >= worker_max_connections) {
+			if (!kore_socket_reuseport && worker_count > 1)
+				worker_unlock();
+			worker->has_lock = 0;
+		}
+
 		if (!worker->has_lock) {
 			if (had_lock == 1) {
 				had_lock = 0;
@@ -325,25 +356,35 @@ kore_worker_entry(struct kore_worker *kw)
 		}
 
 		r = kore_platform_event_wait(netwait);
-		if (worker->has_lock && r > 0) {
+		if (!kore_socket_reuseport && worker->has_lock && r > 0) {
 			kore_worker_acceptlock_release();
 			next_lock = now + WORKER_LOCK_TIMEOUT;
 		}
 
 		http_process();
 
-		if ((now - idle_check) >= 10000) {
-			idle_check = now;
-			kore_connection_check_timeout();
-		}
-
-		kore_connection_prune(KORE_CONNECTION_PRUNE_DISCONNECT);
-
 		if (quit && http_request_count == 0)
 			break;
 	}
 
 	kore_connection_prune(KORE_CONNECTION_PRUNE_ALL);
+
+	kore_log(LOG_NOTICE, "worker %d sent %" PRIu64 " bytes (%" PRIu64
+	    " netbufs) in %" PRIu64 " calls", kw->id, net_stats.send_bytes,
+	    net_stats.send_netbufs, net_stats.send_calls);
+	kore_log(LOG_NOTICE, "worker %d saved up to %" PRIu64
+	    " bytes of idle receive buffers", kw->id, net_stats.recv_saved_max);
+	kore_log(LOG_NOTICE, "worker %d did %" PRIu64 " route lookups in %"
+	    PRIu64 " ns (%" PRIu64 " regexec calls)", kw->id,
+	    route_stats.lookups, route_stats.lookup_ns,
+	    route_stats.regexec_calls);
+	kore_log(LOG_NOTICE, "worker %d response cache: %" PRIu64 " hits, %"
+	    PRIu64 " misses, %" PRIu64 " evictions", kw->id,
+	    http_cache_stats.hits, http_cache_stats.misses,
+	    http_cache_stats.evictions);
+	kore_log(LOG_NOTICE, "worker %d filemap: %" PRIu64 " hits, %" PRIu64
+	    " opens, %" PRIu64 " stale", kw->id, http_filemap_stats.hits,
+	    http_filemap_stats.opens, http_filemap_stats.stale);
 	kore_debug("worker %d shutting down", kw->id);
 	exit(0);
 }
@@ -393,6 +434,8 @@ kore_worker_wait(int final)
 			if (kw->pid == accept_lock->current)
 				worker_unlock();
 
+			http_cache_shm_reap(kw->pid);
+
 			if (kw->active_hdlr != NULL) {
 				kw->active_hdlr->errors++;
 				kore_log(LOG_NOTICE,